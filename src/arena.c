@@ -0,0 +1,92 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "arena.h"
+
+struct arena_block {
+	struct arena_block *next;
+	size_t used;
+	size_t size;
+	/* Keep the data that follows aligned for anything we might store */
+	union {
+		long double ld;
+		void *ptr;
+		uint64_t u64;
+	} data[];
+};
+
+#define ALIGNMENT (sizeof(((struct arena_block *)0)->data[0]))
+
+arena *arena_init(arena *ar, size_t block_size)
+{
+	ar->blocks = NULL;
+	ar->block_size = block_size ? block_size : 64 * 1024;
+	return ar;
+}
+
+void arena_destroy(arena *ar)
+{
+	struct arena_block *block, *next;
+
+	for (block = ar->blocks; block != NULL; block = next) {
+		next = block->next;
+		free(block);
+	}
+	ar->blocks = NULL;
+}
+
+static void *arena_alloc_aligned(arena *ar, size_t size, size_t align)
+{
+	struct arena_block *block = ar->blocks;
+	size_t offset = 0;
+	void *ptr;
+
+	if (block != NULL)
+		offset = (block->used + align - 1) & ~(align - 1);
+
+	if (block == NULL || offset > block->size || block->size - offset < size) {
+		size_t block_size = size > ar->block_size ? size : ar->block_size;
+
+		block = calloc(1, sizeof(struct arena_block) + block_size);
+		if (block == NULL)
+			return NULL;
+		block->size = block_size;
+		offset = 0;
+
+		if (ar->blocks != NULL && size > ar->block_size) {
+			/* Oversized request: keep allocating from the current block afterwards */
+			block->next = ar->blocks->next;
+			ar->blocks->next = block;
+		} else {
+			block->next = ar->blocks;
+			ar->blocks = block;
+		}
+	}
+
+	ptr = (char *)block->data + offset;
+	block->used = offset + size;
+	return ptr;
+}
+
+void *arena_alloc(arena *ar, size_t size)
+{
+	return arena_alloc_aligned(ar, size ? size : 1, ALIGNMENT);
+}
+
+void *arena_calloc(arena *ar, size_t count, size_t size)
+{
+	if (size && count > SIZE_MAX / size)
+		return NULL;
+	return arena_alloc(ar, count * size);
+}
+
+char *arena_strdup(arena *ar, const char *str)
+{
+	size_t len = strlen(str) + 1;
+	char *copy = arena_alloc_aligned(ar, len, 1);
+
+	if (copy != NULL)
+		memcpy(copy, str, len);
+	return copy;
+}
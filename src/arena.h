@@ -0,0 +1,24 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/* A bump allocator: many small allocations carved out of a few large blocks,
+ * all released together by arena_destroy.  There is no per-allocation free. */
+
+struct arena_block;
+
+typedef struct {
+	struct arena_block *blocks;
+	size_t block_size; /* Size of each new block; larger requests get a block of their own */
+} arena;
+
+arena *arena_init(arena *ar, size_t block_size); /* Initialize new arena; allocates nothing yet */
+void arena_destroy(arena *ar); /* Release every block */
+
+/* Returns zeroed memory aligned for any type, or NULL if out of memory */
+void *arena_alloc(arena *ar, size_t size);
+void *arena_calloc(arena *ar, size_t count, size_t size);
+char *arena_strdup(arena *ar, const char *str);
+
+#endif
@@ -7,7 +7,103 @@
 #include "elf-utils.h"
 
 
-int elf_utils_copy(Elf *dest, Elf *source)
+/* A piece of the file that compact_layout may move */
+typedef struct {
+	size_t ndx;		/* 0 for the section header table */
+	GElf_Off offset;
+	GElf_Xword size;
+	GElf_Xword align;
+} file_block_t;
+
+static int block_compar(const void *el1, const void *el2)
+{
+	const file_block_t *block1 = el1, *block2 = el2;
+
+	if (block1->offset != block2->offset)
+		return block1->offset < block2->offset ? -1 : 1;
+	return 0;
+}
+
+static int in_segment(Elf *e, size_t segment_count, GElf_Off offset)
+{
+	GElf_Phdr phdr;
+	size_t segndx;
+
+	for (segndx = 0; segndx < segment_count; segndx++) {
+		if (gelf_getphdr(e, segndx, &phdr) == NULL)
+			continue;
+		if (offset >= phdr.p_offset && offset < phdr.p_offset + phdr.p_filesz)
+			return 1;
+	}
+	return 0;
+}
+
+/* Closes the gaps the dropped sections left behind, from the first of them on.
+ * Whatever a segment covers stays put; the rest moves down, keeping its alignment. */
+static int compact_layout(Elf *dest, GElf_Off gap_start, size_t segment_count)
+{
+	GElf_Ehdr ehdr;
+	GElf_Shdr shdr;
+	Elf_Scn *scn;
+	file_block_t *blocks = NULL;
+	size_t num_blocks = 0, section_count, i;
+	GElf_Off pos, end;
+
+	ELF_ASSERT(gelf_getehdr(dest, &ehdr));
+	ELF_ASSERT(elf_getshdrnum(dest, &section_count) == 0);
+	ASSERT(blocks = calloc(section_count + 1, sizeof(file_block_t)));
+
+	scn = NULL;
+	while ((scn = elf_nextscn(dest, scn)) != NULL) {
+		ELF_ASSERT(gelf_getshdr(scn, &shdr));
+		if (shdr.sh_type == SHT_NULL || shdr.sh_offset < gap_start)
+			continue;
+		blocks[num_blocks].ndx = elf_ndxscn(scn);
+		blocks[num_blocks].offset = shdr.sh_offset;
+		blocks[num_blocks].size = shdr.sh_type == SHT_NOBITS ? 0 : shdr.sh_size;
+		blocks[num_blocks].align = shdr.sh_addralign ? shdr.sh_addralign : 1;
+		num_blocks++;
+	}
+	if (ehdr.e_shoff >= gap_start) {
+		blocks[num_blocks].ndx = 0;
+		blocks[num_blocks].offset = ehdr.e_shoff;
+		blocks[num_blocks].size = 0;
+		blocks[num_blocks].align = 4;
+		num_blocks++;
+	}
+	qsort(blocks, num_blocks, sizeof(file_block_t), block_compar);
+
+	pos = gap_start;
+	for (i = 0; i < num_blocks; i++) {
+		if (blocks[i].ndx != 0 && in_segment(dest, segment_count, blocks[i].offset)) {
+			end = blocks[i].offset + blocks[i].size;
+			if (end > pos)
+				pos = end;
+			continue;
+		}
+
+		pos = (pos + blocks[i].align - 1) & ~(blocks[i].align - 1);
+		if (blocks[i].ndx == 0) {
+			ehdr.e_shoff = pos;
+			ELF_ASSERT(gelf_update_ehdr(dest, &ehdr));
+			pos += section_count * gelf_fsize(dest, ELF_T_SHDR, 1, EV_CURRENT);
+			continue;
+		}
+		ELF_ASSERT(scn = elf_getscn(dest, blocks[i].ndx));
+		ELF_ASSERT(gelf_getshdr(scn, &shdr));
+		shdr.sh_offset = pos;
+		ELF_ASSERT(gelf_update_shdr(scn, &shdr));
+		pos += blocks[i].size;
+	}
+
+	free(blocks);
+	return 1;
+failure:
+	free(blocks);
+	return 0;
+}
+
+int elf_utils_copy(Elf *dest, Elf *source, const char *drop)
 {
 	GElf_Ehdr ehdr;
 	Elf_Scn *dst_scn, *src_scn;
@@ -15,6 +111,8 @@ int elf_utils_copy(Elf *dest, Elf *source)
 	Elf_Data *dst_data, *src_data;
 	size_t segment_count, segndx;
 	GElf_Phdr phdr;
+	GElf_Off gap_start = 0;
+	int dropped = 0;
 
 	ELF_ASSERT(elf_flagelf(dest, ELF_C_SET, ELF_F_LAYOUT));
 
@@ -26,6 +124,16 @@ int elf_utils_copy(Elf *dest, Elf *source)
 	while ((src_scn = elf_nextscn(source, src_scn)) != NULL) {
 		ELF_ASSERT(gelf_getshdr(src_scn, &shdr));
 		ELF_ASSERT(dst_scn = elf_newscn(dest));
+
+		/* An empty header keeps every later section index, so the symbols and links still hold */
+		if (drop && drop[elf_ndxscn(src_scn)]) {
+			if (!dropped || shdr.sh_offset < gap_start)
+				gap_start = shdr.sh_offset;
+			dropped = 1;
+			memset(&shdr, 0, sizeof(shdr));
+			ELF_ASSERT(gelf_update_shdr(dst_scn, &shdr));
+			continue;
+		}
 		ELF_ASSERT(gelf_update_shdr(dst_scn, &shdr));
 
 		src_data = NULL;
@@ -42,13 +150,16 @@ int elf_utils_copy(Elf *dest, Elf *source)
 		ELF_ASSERT(gelf_getphdr(source, segndx, &phdr));
 		ELF_ASSERT(gelf_update_phdr(dest, segndx, &phdr));
 	}
-		
+
+	if (dropped && !compact_layout(dest, gap_start, segment_count))
+		goto failure;
+
 	return 1;
 failure:
 	return 0;
 }
 
-Elf *elf_utils_copy_to_file(const char *filename, Elf *source, FILE **file)
+Elf *elf_utils_copy_to_file(const char *filename, Elf *source, const char *drop, FILE **file)
 {
 	Elf *dest = NULL;
 
@@ -56,11 +167,9 @@ Elf *elf_utils_copy_to_file(const char *filename, Elf *source, FILE **file)
 	if (*file == NULL)
 		FAIL("Could not open %s for writing", filename);
 
-
-	ELF_ASSERT(elf_version(EV_CURRENT) != EV_NONE);
 	ELF_ASSERT(dest = elf_begin(fileno(*file), ELF_C_WRITE, NULL));
 
-	if (!elf_utils_copy(dest, source))
+	if (!elf_utils_copy(dest, source, drop))
 		goto failure;
 
 	return dest;
@@ -70,6 +179,19 @@ failure:
 	return NULL;
 }
 
+Elf *elf_utils_copy_to_memory(Elf *source, const char *drop, FILE **file)
+{
+	/* libelf won't begin an ELF_C_WRITE Elf without a descriptor, though nothing
+	 * goes through it: elf_utils_write_to_memory never calls elf_update.  The
+	 * null device can still be missing (in a bare chroot, say); then this fails
+	 * like any other output that can't be opened. */
+#ifdef _WIN32
+	return elf_utils_copy_to_file("NUL", source, drop, file);
+#else
+	return elf_utils_copy_to_file("/dev/null", source, drop, file);
+#endif
+}
+
 int elf_utils_duplicate_scn_contents(Elf *e, int scndx)
 {
 	Elf_Scn *scn;
@@ -118,6 +240,14 @@ failure:
 	return 0;
 }
 
+void elf_utils_free_shstrtab(Elf *e)
+{
+	size_t shstrndx;
+
+	if (elf_getshdrstrndx(e, &shstrndx) == 0)
+		elf_utils_free_scn_contents(e, shstrndx);
+}
+
 int elf_utils_shift_contents(Elf *e, int start_offset, int shift_amount)
 {
 	GElf_Ehdr ehdr;
@@ -238,3 +368,263 @@ Elf_Scn *elf_utils_new_scn_with_data(Elf *e, const char *scn_name, void *buf, in
 failure:
 	return NULL;
 }
+
+/* One header or data block of the output, at its place in the file */
+typedef struct {
+	size_t offset;
+	void *buf;
+	size_t size;
+	Elf_Type type;
+	size_t ndx;		/* Position in the order libelf writes them */
+} image_block;
+
+typedef struct {
+	Elf32_Ehdr ehdr;
+	Elf32_Shdr *shdrs;
+	image_block *blocks;	/* In the order libelf writes them */
+	size_t num_blocks;
+	size_t size;
+} image_layout;
+
+static int block_sort(const void *el1, const void *el2)
+{
+	const image_block *block1 = el1, *block2 = el2;
+
+	if (block1->offset != block2->offset)
+		return block1->offset < block2->offset ? -1 : 1;
+	return block1->ndx < block2->ndx ? -1 : 1;
+}
+
+static int block_ndx_sort(const void *el1, const void *el2)
+{
+	const image_block *block1 = el1, *block2 = el2;
+
+	return block1->ndx < block2->ndx ? -1 : block1->ndx > block2->ndx;
+}
+
+static void add_block(image_layout *layout, size_t offset, void *buf, size_t size, Elf_Type type)
+{
+	image_block *block;
+
+	if (size == 0 || buf == NULL)
+		return;
+	block = layout->blocks + layout->num_blocks;
+	block->offset = offset;
+	block->buf = buf;
+	block->size = size;
+	block->type = type;
+	block->ndx = layout->num_blocks++;
+}
+
+static void free_layout(image_layout *layout)
+{
+	free(layout->shdrs);
+	free(layout->blocks);
+}
+
+/* Collects every block from the headers of e, which hold the final layout */
+static int get_layout(Elf *e, image_layout *layout)
+{
+	Elf32_Phdr *phdrs;
+	Elf_Scn *scn;
+	Elf_Data *data;
+	size_t phnum = 0, shnum = 0, num_data = 0, ndx;
+	size_t end;
+
+	memset(layout, 0, sizeof(*layout));
+
+	ELF_ASSERT(elf32_getehdr(e));
+	layout->ehdr = *elf32_getehdr(e);
+
+	/* A bug in libelf means that getphdrnum will report failure in a new file.
+	 * However, it will still set segment_count, so we'll use it. */
+	elf_getphdrnum(e, &phnum);
+	ELF_ASSERT(elf_getshdrnum(e, &shnum) == 0);
+	if (shnum >= SHN_LORESERVE || phnum >= PN_XNUM)
+		FAILX("Too many sections or segments to write");
+	phdrs = phnum ? elf32_getphdr(e) : NULL;
+	ELF_ASSERT(phnum == 0 || phdrs != NULL);
+
+	/* The counts and entry sizes are what elf_update would fill in */
+	layout->ehdr.e_ehsize = sizeof(Elf32_Ehdr);
+	layout->ehdr.e_phentsize = phnum ? sizeof(Elf32_Phdr) : 0;
+	layout->ehdr.e_phnum = phnum;
+	layout->ehdr.e_shentsize = sizeof(Elf32_Shdr);
+	layout->ehdr.e_shnum = shnum;
+
+	ASSERT(layout->shdrs = calloc(shnum ? shnum : 1, sizeof(Elf32_Shdr)));
+	layout->size = sizeof(Elf32_Ehdr);
+	for (ndx = 1; ndx < shnum; ndx++) {
+		ELF_ASSERT(scn = elf_getscn(e, ndx));
+		ELF_ASSERT(elf32_getshdr(scn));
+		layout->shdrs[ndx] = *elf32_getshdr(scn);
+		if (layout->shdrs[ndx].sh_type == SHT_NOBITS)
+			continue;
+
+		end = layout->shdrs[ndx].sh_offset + layout->shdrs[ndx].sh_size;
+		if (end > layout->size)
+			layout->size = end;
+		data = NULL;
+		while ((data = elf_getdata(scn, data)) != NULL) {
+			end = layout->shdrs[ndx].sh_offset + data->d_off + data->d_size;
+			if (end > layout->size)
+				layout->size = end;
+			num_data++;
+		}
+	}
+	if (phnum && layout->ehdr.e_phoff + phnum * sizeof(Elf32_Phdr) > layout->size)
+		layout->size = layout->ehdr.e_phoff + phnum * sizeof(Elf32_Phdr);
+	if (shnum && layout->ehdr.e_shoff + shnum * sizeof(Elf32_Shdr) > layout->size)
+		layout->size = layout->ehdr.e_shoff + shnum * sizeof(Elf32_Shdr);
+
+	/* Same order as libelf: headers, then section contents, then the section table */
+	ASSERT(layout->blocks = calloc(num_data + 3, sizeof(image_block)));
+	add_block(layout, 0, &layout->ehdr, sizeof(Elf32_Ehdr), ELF_T_EHDR);
+	add_block(layout, layout->ehdr.e_phoff, phdrs, phnum * sizeof(Elf32_Phdr), ELF_T_PHDR);
+	for (ndx = 1; ndx < shnum; ndx++) {
+		if (layout->shdrs[ndx].sh_type == SHT_NOBITS)
+			continue;
+		ELF_ASSERT(scn = elf_getscn(e, ndx));
+		data = NULL;
+		while ((data = elf_getdata(scn, data)) != NULL)
+			add_block(layout, layout->shdrs[ndx].sh_offset + data->d_off, data->d_buf, data->d_size, data->d_type);
+	}
+	add_block(layout, layout->ehdr.e_shoff, layout->shdrs, shnum * sizeof(Elf32_Shdr), ELF_T_SHDR);
+
+	return 1;
+failure:
+	free_layout(layout);
+	return 0;
+}
+
+/* Converts size bytes of a block to their file representation in dst */
+static int convert_block(void *dst, void *src, size_t size, Elf_Type type)
+{
+	Elf_Data src_data, dst_data;
+
+	memset(&src_data, 0, sizeof(src_data));
+	src_data.d_buf = src;
+	src_data.d_type = type;
+	src_data.d_version = EV_CURRENT;
+	src_data.d_size = size;
+	dst_data = src_data;
+	dst_data.d_buf = dst;
+
+	ELF_ASSERT(elf32_xlatetof(&dst_data, &src_data, ELFDATA2LSB));
+	return 1;
+failure:
+	return 0;
+}
+
+/* Lays the blocks out in one buffer, later ones overwriting what they overlap */
+static void *build_image(const image_layout *layout)
+{
+	const image_block *block;
+	void *image;
+	size_t i;
+
+	ASSERT(image = calloc(1, layout->size));
+	for (i = 0, block = layout->blocks; i < layout->num_blocks; i++, block++) {
+		if (!convert_block((char *)image + block->offset, block->buf, block->size, block->type))
+			goto failure;
+	}
+
+	return image;
+failure:
+	free(image);
+	return NULL;
+}
+
+/* Structures converted to file format go out through a buffer this big */
+#define WRITE_CHUNK_SIZE 16384
+
+static int write_zeros(FILE *file, size_t count)
+{
+	static const char zeros[4096];
+	size_t n;
+
+	while (count > 0) {
+		n = count < sizeof(zeros) ? count : sizeof(zeros);
+		if (fwrite(zeros, n, 1, file) != 1)
+			return 0;
+		count -= n;
+	}
+	return 1;
+}
+
+int elf_utils_write(Elf *e, FILE *file)
+{
+	image_layout layout;
+	image_block *block;
+	char chunk[WRITE_CHUNK_SIZE];
+	void *image = NULL;
+	size_t pos = 0, done, step, n, i;
+
+	if (!get_layout(e, &layout))
+		return 0;
+
+	qsort(layout.blocks, layout.num_blocks, sizeof(image_block), block_sort);
+	for (i = 1; i < layout.num_blocks; i++) {
+		if (layout.blocks[i].offset < layout.blocks[i - 1].offset + layout.blocks[i - 1].size)
+			break;
+	}
+	if (i < layout.num_blocks) {
+		/* Overlapping blocks (a program header table grown into .text, say)
+		 * come out as elf_update would write them, which takes the whole image */
+		qsort(layout.blocks, layout.num_blocks, sizeof(image_block), block_ndx_sort);
+		if ((image = build_image(&layout)) == NULL)
+			goto failure;
+		if (fwrite(image, layout.size, 1, file) != 1)
+			FAIL("Could not write output");
+		free(image);
+		free_layout(&layout);
+		return 1;
+	}
+
+	/* Otherwise the blocks go out straight from their buffers, in file order */
+	for (i = 0, block = layout.blocks; i < layout.num_blocks; i++, block++) {
+		if (!write_zeros(file, block->offset - pos))
+			FAIL("Could not write output");
+
+		if (block->type == ELF_T_BYTE) {
+			if (fwrite(block->buf, block->size, 1, file) != 1)
+				FAIL("Could not write output");
+		} else {
+			/* A whole number of structures at a time */
+			ELF_ASSERT(step = gelf_fsize(e, block->type, 1, EV_CURRENT));
+			step *= sizeof(chunk) / step;
+			for (done = 0; done < block->size; done += n) {
+				n = block->size - done < step ? block->size - done : step;
+				if (!convert_block(chunk, (char *)block->buf + done, n, block->type))
+					goto failure;
+				if (fwrite(chunk, n, 1, file) != 1)
+					FAIL("Could not write output");
+			}
+		}
+		pos = block->offset + block->size;
+	}
+	if (!write_zeros(file, layout.size - pos))
+		FAIL("Could not write output");
+
+	free_layout(&layout);
+	return 1;
+failure:
+	free(image);
+	free_layout(&layout);
+	return 0;
+}
+
+void *elf_utils_write_to_memory(Elf *e, size_t *size)
+{
+	image_layout layout;
+	void *image;
+
+	if (!get_layout(e, &layout))
+		return NULL;
+
+	/* get_layout leaves the blocks in the order build_image wants */
+	image = build_image(&layout);
+	*size = layout.size;
+	free_layout(&layout);
+	return image;
+}
@@ -4,12 +4,19 @@
 #include <stdio.h>
 #include <libelf.h>
 
-int elf_utils_copy(Elf *dest, Elf *source);
+/* drop, if not NULL, flags by index the sections to leave out; they become
+ * empty headers and the non-segment contents after them move down */
+int elf_utils_copy(Elf *dest, Elf *source, const char *drop);
 
-Elf *elf_utils_copy_to_file(const char *filename, Elf *source, FILE **file);
+Elf *elf_utils_copy_to_file(const char *filename, Elf *source, const char *drop, FILE **file);
+/* For a dest that only elf_utils_write_to_memory will lay out; *file is the
+ * null device, and still has to be closed after elf_end */
+Elf *elf_utils_copy_to_memory(Elf *source, const char *drop, FILE **file);
 
 int elf_utils_duplicate_scn_contents(Elf *e, int scndx);
 int elf_utils_duplicate_shstrtab(Elf *e);
+/* Only after elf_utils_duplicate_shstrtab, which made the copy this frees */
+void elf_utils_free_shstrtab(Elf *e);
 void elf_utils_free_scn_contents(Elf *e, int scndx);
 
 int elf_utils_shift_contents(Elf *e, int start_offset, int shift_amount);
@@ -18,4 +25,10 @@ Elf_Scn *elf_utils_new_scn_with_name(Elf *e, const char *scn_name);
 
 Elf_Scn *elf_utils_new_scn_with_data(Elf *e, const char *scn_name, void *buf, int len);
 
+/* Writes e to file exactly as its headers lay it out (it must use ELF_F_LAYOUT),
+ * without going through elf_update */
+int elf_utils_write(Elf *e, FILE *file);
+/* The same, into a malloc'ed buffer of *size bytes */
+void *elf_utils_write_to_memory(Elf *e, size_t *size);
+
 #endif
@@ -0,0 +1,49 @@
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "fail-utils.h"
+
+/* Per thread, so that concurrent jobs can each keep their messages apart */
+static __thread FILE *diag_stream;
+static __thread const char *diag_prefix;
+
+void fail_utils_redirect(FILE *stream, const char *prefix)
+{
+	diag_stream = stream;
+	diag_prefix = prefix;
+}
+
+void fail_utils_warn(int with_errno, const char *fmt, ...)
+{
+	int saved_errno = errno;
+	FILE *stream = diag_stream ? diag_stream : stderr;
+	va_list ap;
+
+#ifndef __MINGW32__
+	if (diag_stream == NULL) {
+		/* The err.h format, program name and all */
+		va_start(ap, fmt);
+		errno = saved_errno;
+		if (with_errno)
+			vwarn(fmt, ap);
+		else
+			vwarnx(fmt, ap);
+		va_end(ap);
+		errno = saved_errno;
+		return;
+	}
+#endif
+
+	if (diag_stream != NULL && diag_prefix != NULL)
+		fprintf(stream, "%s: ", diag_prefix);
+	va_start(ap, fmt);
+	vfprintf(stream, fmt, ap);
+	va_end(ap);
+	if (with_errno)
+		fprintf(stream, ": %s", strerror(saved_errno));
+	fputc('\n', stream);
+
+	errno = saved_errno;
+}
@@ -1,17 +1,25 @@
 #ifndef FAIL_UTILS_H
 #define FAIL_UTILS_H
 
+#include <stdio.h>
+
 #ifndef __MINGW32__
 #include <err.h>
 #else
-#include <stdio.h>
 #include <string.h>
-#define warnx(fmt, args...) fprintf(stderr, __FILE__ ": " fmt, ##args)
-#define warn(fmt, args...) warnx(fmt ": %s", ##args, strerror(errno))
 #define errx(retval, args...) do {warnx(args); exit(retval);} while (0)
 #define err(retval, args...) do {warn(args); exit(retval);} while (0)
 #endif
 
+/* warn and warnx, and so every FAIL below, report to the calling thread's
+ * diagnostics stream.  That is stderr until fail_utils_redirect points it
+ * at stream, each message then starting with prefix if it is not NULL;
+ * a NULL stream goes back to stderr. */
+void fail_utils_redirect(FILE *stream, const char *prefix);
+void fail_utils_warn(int with_errno, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+#define warnx(fmt...) fail_utils_warn(0, fmt)
+#define warn(fmt...) fail_utils_warn(1, fmt)
+
 #define FAIL_EX(label, function, fmt...) do { \
 	function(fmt); \
 	goto label; \
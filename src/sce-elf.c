@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <stddef.h>
 #include <string.h>
+#include <pthread.h>
 
 #include <libelf.h>
 #include <gelf.h>
@@ -100,6 +101,157 @@ typedef union {
 	varray va;
 } import_module_list;
 
+/* Orders stubs the way the import tables list them: by descending module NID,
+ * then descending target NID.  Every stub needs its own entry even if the NID
+ * repeats; those stay in stub order until order_duplicate_stubs places them. */
+static int _stub_module_sort(const void *el1, const void *el2)
+{
+	const vita_elf_stub_t *stub1 = el1, *stub2 = el2;
+	if (stub1->module_nid != stub2->module_nid)
+		return stub2->module_nid > stub1->module_nid ? 1 : -1;
+	if (stub1->target_nid != stub2->target_nid)
+		return stub2->target_nid > stub1->target_nid ? 1 : -1;
+	if (stub1->addr != stub2->addr)
+		return stub1->addr > stub2->addr ? 1 : -1;
+	return 0;
+}
+
+/* Where a sorted insert into count stubs put one whose target NID matches the
+ * run_len stubs at run_start: the first probe of its binary search to land in
+ * that run, or run_start if the run is empty */
+static int sorted_insert_index(int count, int run_start, int run_len)
+{
+	int low_idx = 0, high_idx = count;
+
+	while (low_idx < high_idx) {
+		int test_idx = (low_idx + high_idx) / 2;
+
+		if (test_idx < run_start)
+			low_idx = test_idx + 1;
+		else if (test_idx >= run_start + run_len)
+			high_idx = test_idx;
+		else
+			return test_idx;
+	}
+
+	return low_idx;
+}
+
+/* The tables used to be built by one sorted insert per stub, which left stubs
+ * sharing a target NID in an order only the probes decided.  stubs is one
+ * module's sorted list, with each such run in stub order; replay those
+ * inserts so every run comes out as it did. */
+static int order_duplicate_stubs(vita_elf_stub_t *stubs, int num_stubs)
+{
+	vita_elf_stub_t *run = NULL;
+	int start, end, i, j, count, run_start, pos;
+
+	for (start = 0; start < num_stubs; start = end) {
+		for (end = start + 1; end < num_stubs && stubs[end].target_nid == stubs[start].target_nid; end++);
+		if (end - start < 2)
+			continue;
+
+		if (run == NULL && (run = malloc(num_stubs * sizeof(vita_elf_stub_t))) == NULL)
+			return 0;
+
+		for (i = start; i < end; i++) {
+			/* The module's stubs inserted before this one, and those of them sorting ahead of the run */
+			count = run_start = 0;
+			for (j = 0; j < num_stubs; j++) {
+				if (stubs[j].addr < stubs[i].addr) {
+					count++;
+					if (j < start)
+						run_start++;
+				}
+			}
+
+			pos = sorted_insert_index(count, run_start, i - start) - run_start;
+			memmove(run + pos + 1, run + pos, (i - start - pos) * sizeof(vita_elf_stub_t));
+			run[pos] = stubs[i];
+		}
+		memcpy(stubs + start, run, (end - start) * sizeof(vita_elf_stub_t));
+	}
+
+	free(run);
+	return 1;
+}
+
+/* With gc_imports, stubs nothing refers to are left out */
+static int sort_stubs(varray *va, vita_elf_stub_t *stubs, int num_stubs, int gc_imports)
+{
+	int i;
+
+	if (!varray_init(va, sizeof(vita_elf_stub_t), num_stubs))
+		return 0;
+	va->sort_compar = _stub_module_sort;
+
+	if (!gc_imports) {
+		if (num_stubs && !varray_push_many(va, stubs, num_stubs))
+			return 0;
+	} else {
+		for (i = 0; i < num_stubs; i++) {
+			if (stubs[i].num_refs && !varray_push(va, stubs + i))
+				return 0;
+		}
+	}
+	varray_sort(va);
+	return 1;
+}
+
+#define SORTED_STUB(va, i) ((vita_elf_stub_t *)VARRAY_ELEMENT(va, i))
+
+/* Both stub lists are sorted by module, so the modules come out of a single merge */
+static int group_stubs(import_module_list *modlist, varray *functions, varray *variables)
+{
+	import_module *curmodule;
+	uint32_t nid;
+	int f = 0, v = 0, end;
+
+	while (f < functions->count || v < variables->count) {
+		if (v == variables->count || (f < functions->count
+					&& SORTED_STUB(functions, f)->module_nid >= SORTED_STUB(variables, v)->module_nid))
+			nid = SORTED_STUB(functions, f)->module_nid;
+		else
+			nid = SORTED_STUB(variables, v)->module_nid;
+
+		curmodule = varray_push(&modlist->va, NULL);
+		if (curmodule == NULL)
+			return 0;
+		curmodule->nid = nid;
+
+		for (end = f; end < functions->count && SORTED_STUB(functions, end)->module_nid == nid; end++);
+		if (!order_duplicate_stubs(SORTED_STUB(functions, f), end - f))
+			return 0;
+		if (end > f && !varray_push_many(&curmodule->functions_va, SORTED_STUB(functions, f), end - f))
+			return 0;
+		f = end;
+
+		for (end = v; end < variables->count && SORTED_STUB(variables, end)->module_nid == nid; end++);
+		if (!order_duplicate_stubs(SORTED_STUB(variables, v), end - v))
+			return 0;
+		if (end > v && !varray_push_many(&curmodule->variables_va, SORTED_STUB(variables, v), end - v))
+			return 0;
+		v = end;
+	}
+
+	return 1;
+}
+
+/* The last stub naming a module decides which vita_imports_module_t it refers to */
+static void set_stub_modules(import_module_list *modlist, vita_elf_stub_t *stubs, int num_stubs)
+{
+	import_module *curmodule;
+	int i;
+
+	for (i = 0; i < num_stubs; i++) {
+		if (stubs[i].module == NULL)
+			continue;
+		curmodule = varray_sorted_search(&modlist->va, &stubs[i].module_nid);
+		if (curmodule != NULL)
+			curmodule->module = stubs[i].module;
+	}
+}
+
 static void set_main_module_export(sce_module_exports_t *export, const sce_module_info_t *module_info)
 {
 	export->size = sizeof(sce_module_exports_raw);
@@ -143,13 +295,12 @@ static void set_module_import(vita_elf_t *ve, sce_module_imports_t *import, cons
 	}
 }
 
-sce_module_info_t *sce_elf_module_info_create(vita_elf_t *ve)
+sce_module_info_t *sce_elf_module_info_create(vita_elf_t *ve, int gc_imports)
 {
 	int i;
 	sce_module_info_t *module_info;
 	import_module_list modlist = {0};
-	vita_elf_stub_t *curstub;
-	import_module *curmodule;
+	varray functions = {0}, variables = {0};
 
 	module_info = calloc(1, sizeof(sce_module_info_t));
 	ASSERT(module_info != NULL);
@@ -169,27 +320,15 @@ sce_module_info_t *sce_elf_module_info_create(vita_elf_t *ve)
 	modlist.va.sort_compar = _module_sort;
 	modlist.va.search_compar = _module_search;
 
-	for (i = 0; i < ve->num_fstubs; i++) {
-		curstub = ve->fstubs + i;
-		curmodule = varray_sorted_search_or_insert(&modlist.va, &curstub->module_nid, NULL);
-		ASSERT(curmodule);
-		curmodule->nid = curstub->module_nid;
-		if (curstub->module)
-			curmodule->module = curstub->module;
-
-		varray_sorted_insert_ex(&curmodule->functions_va, curstub, 0);
-	}
-
-	for (i = 0; i < ve->num_vstubs; i++) {
-		curstub = ve->vstubs + i;
-		curmodule = varray_sorted_search_or_insert(&modlist.va, &curstub->module_nid, NULL);
-		ASSERT(curmodule);
-		curmodule->nid = curstub->module_nid;
-		if (curstub->module)
-			curmodule->module = curstub->module;
+	/* Modules left without stubs get no import entry at all */
+	ASSERT(sort_stubs(&functions, ve->fstubs, ve->num_fstubs, gc_imports));
+	ASSERT(sort_stubs(&variables, ve->vstubs, ve->num_vstubs, gc_imports));
+	ASSERT(group_stubs(&modlist, &functions, &variables));
+	varray_destroy(&functions);
+	varray_destroy(&variables);
 
-		varray_sorted_insert_ex(&curmodule->variables_va, curstub, 0);
-	}
+	set_stub_modules(&modlist, ve->fstubs, ve->num_fstubs);
+	set_stub_modules(&modlist, ve->vstubs, ve->num_vstubs);
 
 	module_info->import_top = calloc(modlist.va.count, sizeof(sce_module_imports_t));
 	ASSERT(module_info->import_top != NULL);
@@ -199,9 +338,13 @@ sce_module_info_t *sce_elf_module_info_create(vita_elf_t *ve)
 		set_module_import(ve, module_info->import_top + i, modlist.modules + i);
 	}
 
+	varray_destroy(&modlist.va);
+
 	return module_info;
 
 failure:
+	varray_destroy(&functions);
+	varray_destroy(&variables);
 	varray_destroy(&modlist.va);
 	sce_elf_module_info_free(module_info);
 	return NULL;
@@ -211,35 +354,58 @@ failure:
 	sizes->section += (size); \
 	total_size += (size); \
 } while (0)
-int sce_elf_module_info_get_size(sce_module_info_t *module_info, sce_section_sizes_t *sizes)
+int sce_elf_module_info_get_layout(const sce_module_info_t *module_info, sce_module_info_layout_t *layout)
 {
+	sce_section_sizes_t *sizes = &layout->sizes;
 	int total_size = 0;
+	int max_relas = 0;
+	int num_syms;
+	int i;
 	sce_module_exports_t *export;
 	sce_module_imports_t *import;
 
-	memset(sizes, 0, sizeof(*sizes));
+	memset(layout, 0, sizeof(*layout));
 
+	/* Every local pointer and every entry address may need an ABS32 reloc */
 	INCR(sceModuleInfo_rodata, sizeof(sce_module_info_raw));
 	for (export = module_info->export_top; export < module_info->export_end; export++) {
 		INCR(sceLib_ent, sizeof(sce_module_exports_raw));
 		if (export->module_name != NULL) {
 			INCR(sceExport_rodata, ALIGN_4(strlen(export->module_name) + 1));
+			max_relas++;
 		}
-		INCR(sceExport_rodata, (export->num_syms_funcs + export->num_syms_vars + export->num_syms_unk) * 8);
+		num_syms = export->num_syms_funcs + export->num_syms_vars + export->num_syms_unk;
+		INCR(sceExport_rodata, num_syms * 8);
+		max_relas += 2 + num_syms;
 	}
 
 	for (import = module_info->import_top; import < module_info->import_end; import++) {
 		INCR(sceLib_stubs, sizeof(sce_module_imports_raw));
 		if (import->module_name != NULL) {
 			INCR(sceImport_rodata, ALIGN_4(strlen(import->module_name) + 1));
+			max_relas++;
 		}
 		INCR(sceFNID_rodata, import->num_syms_funcs * 4);
 		INCR(sceFStub_rodata, import->num_syms_funcs * 4);
 		INCR(sceVNID_rodata, import->num_syms_vars * 4);
 		INCR(sceVStub_rodata, import->num_syms_vars * 4);
 		INCR(sceImport_rodata, import->num_syms_unk * 8);
+		if (import->num_syms_funcs)
+			max_relas += 2 + import->num_syms_funcs;
+		if (import->num_syms_vars)
+			max_relas += 2 + import->num_syms_vars;
+		if (import->num_syms_unk)
+			max_relas += 2 + import->num_syms_unk;
 	}
 
+	total_size = 0;
+	for (i = 0; i < sizeof(sce_section_sizes_t) / sizeof(Elf32_Word); i++) {
+		((Elf32_Word *)&layout->offsets)[i] = total_size;
+		total_size += ((Elf32_Word *)sizes)[i];
+	}
+
+	layout->total_size = total_size;
+	layout->max_relas = max_relas;
 	return total_size;
 }
 #undef INCR
@@ -292,20 +458,24 @@ void sce_elf_module_info_free(sce_module_info_t *module_info)
 #define ADDRELA(localaddr) do { \
 	uint32_t addend = le32toh(*((uint32_t *)localaddr)); \
 	if (addend) { \
-		vita_elf_rela_t *rela = varray_push(&relas, NULL); \
-		rela->type = R_ARM_ABS32; \
-		rela->offset = ((void*)(localaddr)) - data + segment_base + start_offset; \
-		rela->addend = addend; \
+		if (rtable->num_relas == layout->max_relas) \
+			FAILX("Attempted to overrun the planned relocation count!"); \
+		rtable->offsets[rtable->num_relas] = ((void*)(localaddr)) - data + segment_base + start_offset; \
+		rtable->addends[rtable->num_relas] = addend; \
+		rtable->symbols[rtable->num_relas] = VITA_ELF_NO_SYMBOL; \
+		rtable->types[rtable->num_relas] = R_ARM_ABS32; \
+		rtable->num_relas++; \
 	} \
 } while(0)
 void *sce_elf_module_info_encode(
-		const sce_module_info_t *module_info, const vita_elf_t *ve, const sce_section_sizes_t *sizes,
+		const sce_module_info_t *module_info, const vita_elf_t *ve, const sce_module_info_layout_t *layout,
 		vita_elf_rela_table_t *rtable)
 {
-	void *data;
+	void *data = NULL;
+	const sce_section_sizes_t *sizes = &layout->sizes;
 	sce_section_sizes_t cur_sizes = {0};
-	sce_section_sizes_t section_addrs = {0};
-	int total_size = 0;
+	sce_section_sizes_t section_addrs = layout->offsets;
+	int total_size = layout->total_size;
 	Elf32_Addr segment_base;
 	Elf32_Word start_offset;
 	int segndx;
@@ -315,14 +485,8 @@ void *sce_elf_module_info_encode(
 	sce_module_info_raw *module_info_raw;
 	sce_module_exports_raw *export_raw;
 	sce_module_imports_raw *import_raw;
-	varray relas;
 
-	ASSERT(varray_init(&relas, sizeof(vita_elf_rela_t), 16));
-
-	for (i = 0; i < sizeof(sce_section_sizes_t) / sizeof(Elf32_Word); i++) {
-		((Elf32_Word *)&section_addrs)[i] = total_size;
-		total_size += ((Elf32_Word *)sizes)[i];
-	}
+	ASSERT(vita_elf_rela_table_alloc(rtable, layout->max_relas));
 
 	segndx = vita_elf_host_to_segndx(ve, module_info->module_start);
 
@@ -462,11 +626,9 @@ void *sce_elf_module_info_encode(
 			FAILX("sce_elf_module_info_encode() did not use all space in section %d!", i);
 	}
 
-	rtable->num_relas = relas.count;
-	rtable->relas = varray_extract_array(&relas);
-
 	return data;
 failure:
+	vita_elf_rela_table_release(rtable);
 	free(data);
 	return NULL;
 }
@@ -483,7 +645,7 @@ failure:
 #undef ADDRELA
 
 int sce_elf_write_module_info(
-		Elf *dest, const vita_elf_t *ve, const sce_section_sizes_t *sizes, void *module_info)
+		Elf *dest, vita_elf_t *ve, const sce_module_info_layout_t *layout, void *module_info)
 {
 	/* Corresponds to the order in sce_section_sizes_t */
 	static const char *section_names[] = {
@@ -502,19 +664,14 @@ int sce_elf_write_module_info(
 	GElf_Phdr phdr;
 	Elf_Scn *scn;
 	Elf_Data *data;
-	sce_section_sizes_t section_addrs = {0};
-	int total_size = 0;
+	const sce_section_sizes_t *sizes = &layout->sizes;
+	int total_size = layout->total_size;
 	Elf32_Addr segment_base, start_vaddr;
 	Elf32_Word start_segoffset, start_foffset;
 	int cur_pos;
 	int segndx;
 	int i;
 
-	for (i = 0; i < sizeof(sce_section_sizes_t) / sizeof(Elf32_Word); i++) {
-		((Elf32_Word *)&section_addrs)[i] = total_size;
-		total_size += ((Elf32_Word *)sizes)[i];
-	}
-
 	ELF_ASSERT(gelf_getehdr(dest, &ehdr));
 
 	for (segndx = 0; segndx < ve->num_segments; segndx++) {
@@ -537,7 +694,7 @@ int sce_elf_write_module_info(
 		FAILX("Unable to relocate ELF sections");
 
 	/* Extend in our copy of phdrs so that vita_elf_vaddr_to_segndx can match it */
-	ve->segments[segndx].memsz += total_size;
+	ASSERT(vita_elf_resize_segment(ve, segndx, ve->segments[segndx].memsz + total_size));
 
 	phdr.p_filesz += total_size;
 	phdr.p_memsz += total_size;
@@ -579,28 +736,34 @@ failure:
 	return 0;
 }
 
+/* The short form only has 12 bits of addend; stay clear of the sign bit */
+static int sce_rel_fits_short(int addend)
+{
+	return addend >= 0 && addend < 1 << 11;
+}
+
 static int sce_rel_short(SCE_Rel *rel, int symseg, int code, int datseg, int offset, int addend)
 {
-	if (addend > 1 << 11)
+	if (!sce_rel_fits_short(addend))
 		return 0;
 	rel->r_short_entry.r_short = 1;
 	rel->r_short_entry.r_symseg = symseg;
 	rel->r_short_entry.r_code = code;
 	rel->r_short_entry.r_datseg = datseg;
 	rel->r_short_entry.r_offset_lo = offset & 0xFFF;
-	rel->r_short_entry.r_offset_hi = offset >> 20;
+	rel->r_short_entry.r_offset_hi = (uint32_t)offset >> 12;
 	rel->r_short_entry.r_addend = addend;
 	return 1;
 }
 
-static int sce_rel_long(SCE_Rel *rel, int symseg, int code, int datseg, int offset, int addend)
+static int sce_rel_long(SCE_Rel *rel, int symseg, int code, int datseg, int offset, int addend, int code2, int dist2)
 {
 	rel->r_long_entry.r_short = 0;
 	rel->r_long_entry.r_symseg = symseg;
 	rel->r_long_entry.r_code = code;
 	rel->r_long_entry.r_datseg = datseg;
-	rel->r_long_entry.r_code2 = 0;
-	rel->r_long_entry.r_dist2 = 0;
+	rel->r_long_entry.r_code2 = code2;
+	rel->r_long_entry.r_dist2 = dist2;
 	rel->r_long_entry.r_offset = offset;
 	rel->r_long_entry.r_addend = addend;
 	return 1;
@@ -611,23 +774,23 @@ static int encode_sce_rel(SCE_Rel *rel)
 	if (rel->r_short_entry.r_short) {
 		rel->r_raw_entry.r_word1 = htole32(
 				(rel->r_short_entry.r_short) |
-				(rel->r_short_entry.r_symseg << 4) |
-				(rel->r_short_entry.r_code << 8) |
-				(rel->r_short_entry.r_datseg << 16) |
-				(rel->r_short_entry.r_offset_lo << 20));
+				((Elf32_Word)rel->r_short_entry.r_symseg << 4) |
+				((Elf32_Word)rel->r_short_entry.r_code << 8) |
+				((Elf32_Word)rel->r_short_entry.r_datseg << 16) |
+				((Elf32_Word)rel->r_short_entry.r_offset_lo << 20));
 		rel->r_raw_entry.r_word2 = htole32(
 				(rel->r_short_entry.r_offset_hi) |
-				(rel->r_short_entry.r_addend << 20));
+				((Elf32_Word)rel->r_short_entry.r_addend << 20));
 
 		return 8;
 	} else {
 		rel->r_raw_entry.r_word1 = htole32(
 				(rel->r_long_entry.r_short) |
-				(rel->r_long_entry.r_symseg << 4) |
-				(rel->r_long_entry.r_code << 8) |
-				(rel->r_long_entry.r_datseg << 16) |
-				(rel->r_long_entry.r_code2 << 20) |
-				(rel->r_long_entry.r_dist2 << 28));
+				((Elf32_Word)rel->r_long_entry.r_symseg << 4) |
+				((Elf32_Word)rel->r_long_entry.r_code << 8) |
+				((Elf32_Word)rel->r_long_entry.r_datseg << 16) |
+				((Elf32_Word)rel->r_long_entry.r_code2 << 20) |
+				((Elf32_Word)rel->r_long_entry.r_dist2 << 28));
 		rel->r_raw_entry.r_word2 = htole32(rel->r_long_entry.r_addend);
 		rel->r_raw_entry.r_word3 = htole32(rel->r_long_entry.r_offset);
 		return 12;
@@ -639,80 +802,288 @@ static int encode_sce_rel(SCE_Rel *rel)
  * the invalid addresses may become valid */
 int sce_elf_discard_invalid_relocs(const vita_elf_t *ve, vita_elf_rela_table_t *rtable) {
 	vita_elf_rela_table_t *curtable;
-	vita_elf_rela_t *vrela;
+	const vita_elf_symbol_t *symbol;
 	int i, datseg;
 	for (curtable = rtable; curtable; curtable = curtable->next) {
-		for (i = 0, vrela = curtable->relas; i < curtable->num_relas; i++, vrela++) {
-			if (vrela->type == R_ARM_NONE || (vrela->symbol && vrela->symbol->shndx == 0)) {
-				vrela->type = R_ARM_NONE;
+		for (i = 0; i < curtable->num_relas; i++) {
+			symbol = VITA_ELF_RELA_SYMBOL(ve, curtable, i);
+			if (curtable->types[i] == R_ARM_NONE || (symbol && symbol->shndx == 0)) {
+				curtable->types[i] = R_ARM_NONE;
 				continue;
 			}
-			datseg = vita_elf_vaddr_to_segndx(ve, vrela->offset);
+			datseg = vita_elf_vaddr_to_segndx(ve, curtable->offsets[i]);
 			/* We can get -1 here for some debugging-related relocations.
 			 * These are done against debug sections that aren't mapped to any segment.
 			 * Just ignore these */
 			if (datseg == -1)
-				vrela->type = R_ARM_NONE;
+				curtable->types[i] = R_ARM_NONE;
 		}
 	}
 	return 1;
 }
 
-int sce_elf_write_rela_sections(
-		Elf *dest, const vita_elf_t *ve, const vita_elf_rela_table_t *rtable)
+/* How many following entries to search for the other half of a MOVW/MOVT pair */
+#define MOVW_MOVT_WINDOW 8
+
+static int movw_movt_partner(int type)
 {
-	int total_relas = 0;
-	const vita_elf_rela_table_t *curtable;
-	const vita_elf_rela_t *vrela;
-	void *encoded_relas = NULL, *curpos;
+	switch (type) {
+		case R_ARM_MOVW_ABS_NC: return R_ARM_MOVT_ABS;
+		case R_ARM_MOVT_ABS: return R_ARM_MOVW_ABS_NC;
+		case R_ARM_THM_MOVW_ABS_NC: return R_ARM_THM_MOVT_ABS;
+		case R_ARM_THM_MOVT_ABS: return R_ARM_THM_MOVW_ABS_NC;
+	}
+	return R_ARM_NONE;
+}
+
+int sce_elf_optimize_relocs(const vita_elf_t *ve, vita_elf_rela_table_t *rtable)
+{
+	vita_elf_rela_table_t *curtable;
+	vita_elf_rela_location_t *locs = NULL;
+	int first, second;
+	int i, j, partner, dist;
+
+	for (curtable = rtable; curtable; curtable = curtable->next) {
+		free(locs);
+		ASSERT(locs = calloc(curtable->num_relas ? curtable->num_relas : 1, sizeof(vita_elf_rela_location_t)));
+		vita_elf_translate_relas(ve, curtable, locs);
+
+		for (i = 0; i < curtable->num_relas; i++) {
+			if (curtable->codes2[i] || locs[i].symseg == -1)
+				continue;
+			partner = movw_movt_partner(curtable->types[i]);
+			if (partner == R_ARM_NONE)
+				continue;
+
+			for (j = i + 1; j < curtable->num_relas && j <= i + MOVW_MOVT_WINDOW; j++) {
+				if (curtable->types[j] != partner || curtable->codes2[j])
+					continue;
+				if (locs[j].datseg != locs[i].datseg || locs[j].symseg != locs[i].symseg
+						|| locs[j].symoff != locs[i].symoff)
+					continue;
+
+				/* The entry at the lower address carries the pair */
+				if (curtable->offsets[j] > curtable->offsets[i]) {
+					first = i;
+					second = j;
+				} else {
+					first = j;
+					second = i;
+				}
+				dist = curtable->offsets[second] - curtable->offsets[first];
+				if (dist == 0 || dist % 2 != 0 || dist / 2 > 0xF)
+					continue;
+
+				curtable->codes2[first] = curtable->types[second];
+				curtable->dists2[first] = dist / 2;
+				curtable->types[second] = R_ARM_NONE;
+				break;
+			}
+		}
+	}
+
+	free(locs);
+	return 1;
+
+failure:
+	return 0;
+}
+
+/* Each entry takes the short form when its addend fits and it carries no second relocation */
+static int encoded_size(const vita_elf_rela_table_t *rtable, const vita_elf_rela_location_t *locs)
+{
+	int i, size = 0;
+
+	for (i = 0; i < rtable->num_relas; i++, locs++) {
+		if (rtable->types[i] == R_ARM_NONE || locs->symseg == -1)
+			continue;
+		size += !rtable->codes2[i] && sce_rel_fits_short(locs->symoff) ? 8 : 12;
+	}
+
+	return size;
+}
+
+/* Entries per chunk when encoding on several threads */
+#define ENCODE_CHUNK_RELAS	65536
+
+/* A run of entries from one table, encoded into its own buffer */
+typedef struct {
+	vita_elf_rela_table_t slice;	/* Points into the table's arrays; next is NULL */
+	void *encoded;
+	int size;
+	int num_short;
+	int num_long;
+	int ok;
+} encode_chunk_t;
+
+static int encode_chunk(const vita_elf_t *ve, encode_chunk_t *chunk)
+{
+	const vita_elf_rela_table_t *slice = &chunk->slice;
+	vita_elf_rela_location_t *locs = NULL, *loc;
+	void *curpos;
 	SCE_Rel rel;
 	int relsz;
 	int i;
-	Elf32_Addr symvaddr;
-	Elf32_Word symseg, symoff;
-	Elf32_Word datseg, datoff;
-	int (*sce_rel_func)(SCE_Rel *, int, int, int, int, int);
 
-	Elf_Scn *scn;
-	GElf_Shdr shdr;
-	GElf_Phdr *phdrs;
-	size_t segment_count = 0;
+	ASSERT(locs = calloc(slice->num_relas ? slice->num_relas : 1, sizeof(vita_elf_rela_location_t)));
+	vita_elf_translate_relas(ve, slice, locs);
 
-	for (curtable = rtable; curtable; curtable = curtable->next)
-		total_relas += curtable->num_relas;
+	chunk->size = encoded_size(slice, locs);
+	ASSERT(chunk->encoded = calloc(1, chunk->size ? chunk->size : 1));
+	curpos = chunk->encoded;
 
-	ASSERT(encoded_relas = calloc(total_relas, 12));
+	for (i = 0, loc = locs; i < slice->num_relas; i++, loc++) {
+		if (slice->types[i] == R_ARM_NONE || loc->symseg == -1)
+			continue;
+		if (slice->codes2[i] || !sce_rel_short(&rel, loc->symseg, slice->types[i], loc->datseg, loc->datoff, loc->symoff))
+			sce_rel_long(&rel, loc->symseg, slice->types[i], loc->datseg, loc->datoff, loc->symoff,
+					slice->codes2[i], slice->dists2[i]);
+		relsz = encode_sce_rel(&rel);
+		memcpy(curpos, &rel, relsz);
+		curpos += relsz;
+		if (relsz == 8)
+			chunk->num_short++;
+		else
+			chunk->num_long++;
+	}
 
-	sce_rel_func = sce_rel_short;
+	free(locs);
+	return 1;
+failure:
+	free(locs);
+	return 0;
+}
 
-encode_relas:
-	curpos = encoded_relas;
+typedef struct {
+	const vita_elf_t *ve;
+	encode_chunk_t *chunks;
+	int num_chunks;
+	pthread_mutex_t lock;
+	int next_chunk;
+} encode_queue_t;
+
+static void *encode_worker(void *arg)
+{
+	encode_queue_t *queue = arg;
+	int i;
+
+	for (;;) {
+		pthread_mutex_lock(&queue->lock);
+		i = queue->next_chunk < queue->num_chunks ? queue->next_chunk++ : -1;
+		pthread_mutex_unlock(&queue->lock);
+		if (i < 0)
+			break;
+
+		queue->chunks[i].ok = encode_chunk(queue->ve, queue->chunks + i);
+	}
 
+	return NULL;
+}
+
+static int table_chunks(const vita_elf_rela_table_t *rtable, int num_threads)
+{
+	/* With one thread there is nothing to gain from splitting a table */
+	if (num_threads <= 1 || rtable->num_relas <= ENCODE_CHUNK_RELAS)
+		return 1;
+	return (rtable->num_relas + ENCODE_CHUNK_RELAS - 1) / ENCODE_CHUNK_RELAS;
+}
+
+/* Splits the tables into chunks and encodes them on num_threads threads */
+static encode_chunk_t *encode_chunks(const vita_elf_t *ve, const vita_elf_rela_table_t *rtable,
+		int num_threads, int *num_chunks)
+{
+	const vita_elf_rela_table_t *curtable;
+	encode_chunk_t *chunks = NULL, *chunk;
+	encode_queue_t queue;
+	pthread_t *threads = NULL;
+	int count = 0, started = 0;
+	int i, n, start, len;
+
+	for (curtable = rtable; curtable; curtable = curtable->next)
+		count += table_chunks(curtable, num_threads);
+	ASSERT(chunks = calloc(count ? count : 1, sizeof(encode_chunk_t)));
+
+	chunk = chunks;
 	for (curtable = rtable; curtable; curtable = curtable->next) {
-		for (i = 0, vrela = curtable->relas; i < curtable->num_relas; i++, vrela++) {
-			if (vrela->type == R_ARM_NONE)
-				continue;
-			datseg = vita_elf_vaddr_to_segndx(ve, vrela->offset);
-			datoff = vita_elf_vaddr_to_segoffset(ve, vrela->offset, datseg);
-			if (vrela->symbol) {
-				symvaddr = vrela->symbol->value + vrela->addend;
-			} else {
-				symvaddr = vrela->addend;
-			}
-			symseg = vita_elf_vaddr_to_segndx(ve, vrela->symbol ? vrela->symbol->value : vrela->addend);
-			if (symseg == -1)
-				continue;
-			symoff = vita_elf_vaddr_to_segoffset(ve, symvaddr, symseg);
-			if (!sce_rel_func(&rel, symseg, vrela->type, datseg, datoff, symoff)) {
-				sce_rel_func = sce_rel_long;
-				goto encode_relas;
-			}
-			relsz = encode_sce_rel(&rel);
-			memcpy(curpos, &rel, relsz);
-			curpos += relsz;
+		n = table_chunks(curtable, num_threads);
+		for (i = 0, start = 0; i < n; i++, start += len, chunk++) {
+			len = i < n - 1 ? ENCODE_CHUNK_RELAS : curtable->num_relas - start;
+			chunk->slice.offsets = curtable->offsets + start;
+			chunk->slice.addends = curtable->addends + start;
+			chunk->slice.symbols = curtable->symbols + start;
+			chunk->slice.types = curtable->types + start;
+			chunk->slice.codes2 = curtable->codes2 + start;
+			chunk->slice.dists2 = curtable->dists2 + start;
+			chunk->slice.num_relas = len;
+			chunk->slice.target_ndx = curtable->target_ndx;
 		}
 	}
 
+	queue.ve = ve;
+	queue.chunks = chunks;
+	queue.num_chunks = count;
+	queue.next_chunk = 0;
+	pthread_mutex_init(&queue.lock, NULL);
+
+	if (num_threads > count)
+		num_threads = count;
+	if (num_threads > 1 && (threads = calloc(num_threads - 1, sizeof(pthread_t))) == NULL)
+		num_threads = 1;
+	for (i = 0; i < num_threads - 1; i++) {
+		if (pthread_create(&threads[i], NULL, encode_worker, &queue) != 0) {
+			warnx("Could not start worker thread %d", i + 1);
+			break;
+		}
+		started++;
+	}
+	encode_worker(&queue);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	pthread_mutex_destroy(&queue.lock);
+
+	*num_chunks = count;
+	return chunks;
+failure:
+	free(chunks);
+	return NULL;
+}
+
+int sce_elf_write_rela_sections(
+		Elf *dest, const vita_elf_t *ve, const vita_elf_rela_table_t *rtable, int num_threads, sce_rel_stats_t *stats)
+{
+	int total_size = 0;
+	encode_chunk_t *chunks = NULL;
+	int num_chunks = 0;
+	void *encoded_relas = NULL, *curpos;
+	int num_short = 0, num_long = 0;
+	int i;
+
+	Elf_Scn *scn;
+	GElf_Shdr shdr;
+	GElf_Phdr *phdrs = NULL;
+	size_t segment_count = 0;
+
+	ASSERT(chunks = encode_chunks(ve, rtable, num_threads, &num_chunks));
+
+	/* Concatenated in table order, so the result doesn't depend on num_threads */
+	for (i = 0; i < num_chunks; i++) {
+		if (!chunks[i].ok)
+			goto failure;
+		total_size += chunks[i].size;
+	}
+	ASSERT(encoded_relas = calloc(1, total_size ? total_size : 1));
+	curpos = encoded_relas;
+	for (i = 0; i < num_chunks; i++) {
+		memcpy(curpos, chunks[i].encoded, chunks[i].size);
+		curpos += chunks[i].size;
+		num_short += chunks[i].num_short;
+		num_long += chunks[i].num_long;
+		free(chunks[i].encoded);
+	}
+	free(chunks);
+	chunks = NULL;
+
 	scn = elf_utils_new_scn_with_data(dest, ".sce.rel", encoded_relas, curpos - encoded_relas);
 	if (scn == NULL)
 		goto failure;
@@ -739,13 +1110,34 @@ encode_relas:
 		ELF_ASSERT(gelf_update_phdr(dest, i, phdrs + i));
 	}
 
+	free(phdrs);
+	if (stats) {
+		stats->num_short = num_short;
+		stats->num_long = num_long;
+		stats->size = num_short * 8 + num_long * 12;
+	}
 	return 1;
 
 failure:
+	for (i = 0; chunks && i < num_chunks; i++)
+		free(chunks[i].encoded);
+	free(chunks);
+	free(phdrs);
 	free(encoded_relas);
 	return 0;
 }
 
+void sce_elf_free_rela_sections(Elf *dest)
+{
+	Elf_Scn *scn = NULL;
+	GElf_Shdr shdr;
+
+	while ((scn = elf_nextscn(dest, scn)) != NULL) {
+		if (gelf_getshdr(scn, &shdr) != NULL && shdr.sh_type == SHT_SCE_RELA)
+			elf_utils_free_scn_contents(dest, elf_ndxscn(scn));
+	}
+}
+
 int sce_elf_rewrite_stubs(Elf *dest, const vita_elf_t *ve)
 {
 	Elf_Scn *scn;
@@ -796,14 +1188,14 @@ failure:
 	return 0;
 }
 
-int sce_elf_set_headers(FILE *destfile, const vita_elf_t *ve)
+int sce_elf_set_headers(Elf *dest, const vita_elf_t *ve)
 {
-	Elf32_Ehdr ehdr;
-
-	ehdr.e_type = htole16(ET_SCE_RELEXEC);
+	GElf_Ehdr ehdr;
 
-	SYS_ASSERT(fseek(destfile, offsetof(Elf32_Ehdr, e_type), SEEK_SET));
-	SYS_ASSERT(fwrite(&ehdr.e_type, sizeof(ehdr.e_type), 1, destfile));
+	/* libelf never sees this; the output is written with elf_utils_write */
+	ELF_ASSERT(gelf_getehdr(dest, &ehdr));
+	ehdr.e_type = ET_SCE_RELEXEC;
+	ELF_ASSERT(gelf_update_ehdr(dest, &ehdr));
 
 	return 1;
 failure:
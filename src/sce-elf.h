@@ -80,28 +80,52 @@ typedef struct {
 	Elf32_Word sceVStub_rodata;		/* The imported function NID arrays */
 } sce_section_sizes_t;
 
-sce_module_info_t *sce_elf_module_info_create(vita_elf_t *ve);
+/* Where everything goes in the encoded SCE data, planned before encoding */
+typedef struct {
+	sce_section_sizes_t sizes;
+	sce_section_sizes_t offsets;	/* Section offsets from the start of the SCE data */
+	int total_size;
+	int max_relas;			/* Upper bound on the ABS32 relocs the encoded data needs */
+} sce_module_info_layout_t;
+
+/* With gc_imports, stubs whose num_refs is 0 are left out of the import tables */
+sce_module_info_t *sce_elf_module_info_create(vita_elf_t *ve, int gc_imports);
 
-int sce_elf_module_info_get_size(sce_module_info_t *module_info, sce_section_sizes_t *sizes);
+/* Fills in layout and returns the total size of the SCE data */
+int sce_elf_module_info_get_layout(const sce_module_info_t *module_info, sce_module_info_layout_t *layout);
 
 void sce_elf_module_info_free(sce_module_info_t *module_info);
 
 void *sce_elf_module_info_encode(
-		const sce_module_info_t *module_info, const vita_elf_t *ve, const sce_section_sizes_t *sizes,
+		const sce_module_info_t *module_info, const vita_elf_t *ve, const sce_module_info_layout_t *layout,
 		vita_elf_rela_table_t *rtable);
 
 int sce_elf_write_module_info(
-		Elf *dest, const vita_elf_t *ve, const sce_section_sizes_t *sizes, void *module_info);
+		Elf *dest, vita_elf_t *ve, const sce_module_info_layout_t *layout, void *module_info);
 
 int sce_elf_discard_invalid_relocs(const vita_elf_t *ve, vita_elf_rela_table_t *rtable);
 
+/* Folds MOVW/MOVT pairs against the same target into single entries using r_code2/r_dist2 */
+int sce_elf_optimize_relocs(const vita_elf_t *ve, vita_elf_rela_table_t *rtable);
+
+/* What sce_elf_write_rela_sections put in .sce.rel */
+typedef struct {
+	int num_short;
+	int num_long;
+	int size;
+} sce_rel_stats_t;
+
+/* Encodes on num_threads threads, with the same result for any count; stats may be NULL */
 int sce_elf_write_rela_sections(
-		Elf *dest, const vita_elf_t *ve, const vita_elf_rela_table_t *rtable);
+		Elf *dest, const vita_elf_t *ve, const vita_elf_rela_table_t *rtable, int num_threads, sce_rel_stats_t *stats);
+
+/* Frees the .sce.rel contents, which libelf leaves to us; call before elf_end(dest) */
+void sce_elf_free_rela_sections(Elf *dest);
 
 int sce_elf_rewrite_stubs(Elf *dest, const vita_elf_t *ve);
 
-int sce_elf_set_headers(FILE *outfile, const vita_elf_t *ve);
+int sce_elf_set_headers(Elf *dest, const vita_elf_t *ve);
 
-const uint32_t sce_elf_stub_func[3];
+extern const uint32_t sce_elf_stub_func[3];
 
 #endif
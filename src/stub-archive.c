@@ -0,0 +1,407 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+/* Only for the ELF types and constants; nothing here calls into libelf */
+#include <libelf.h>
+
+#include "stub-archive.h"
+#include "endian-utils.h"
+#include "fail-utils.h"
+
+#ifndef EF_ARM_EABI_VER5
+#define EF_ARM_EABI_VER5 0x05000000
+#endif
+#ifndef SHT_ARM_ATTRIBUTES
+#define SHT_ARM_ATTRIBUTES 0x70000003
+#endif
+
+#define AR_MAGIC	"!<arch>\n"
+#define AR_HEADER_SIZE	60
+#define AR_NAME_SIZE	16
+
+/* The object's sections, in section header order */
+enum {
+	SCN_NULL,
+	SCN_STUBS,
+	SCN_ATTRIBUTES,
+	SCN_SYMTAB,
+	SCN_STRTAB,
+	SCN_SHSTRTAB,
+	NUM_SCNS
+};
+
+/* Both stub section names are the same length, so one layout serves either */
+#define FSTUBS_NAME	".vitalink.fstubs"
+#define VSTUBS_NAME	".vitalink.vstubs"
+
+enum {
+	SHSTR_STUBS = 1,
+	SHSTR_ATTRIBUTES = SHSTR_STUBS + sizeof(FSTUBS_NAME),
+	SHSTR_SYMTAB = SHSTR_ATTRIBUTES + sizeof(".ARM.attributes"),
+	SHSTR_STRTAB = SHSTR_SYMTAB + sizeof(".symtab"),
+	SHSTR_SHSTRTAB = SHSTR_STRTAB + sizeof(".strtab"),
+	SHSTRTAB_SIZE = SHSTR_SHSTRTAB + sizeof(".shstrtab")
+};
+
+/* ".align 4", three words, ".align 4" */
+#define STUB_ALIGN	16
+#define STUB_SIZE	16
+#define STUB_OFFSET	((sizeof(Elf32_Ehdr) + STUB_ALIGN - 1) & ~(STUB_ALIGN - 1))
+
+/* What "as" records for ".arch armv7a"; ld merges these, so they are kept */
+static const uint8_t arm_attributes[] = {
+	'A',
+	28, 0, 0, 0,			/* "aeabi" subsection size */
+	'a', 'e', 'a', 'b', 'i', 0,
+	1, 18, 0, 0, 0,			/* Tag_File and its size */
+	5, '7', '-', 'A', 0,		/* Tag_CPU_name */
+	6, 10,				/* Tag_CPU_arch: v7 */
+	7, 'A',				/* Tag_CPU_arch_profile: application */
+	8, 1,				/* Tag_ARM_ISA_use */
+	9, 2				/* Tag_THUMB_ISA_use: Thumb-2 */
+};
+
+/* Functions get a $d mapping symbol, as the section holding them is executable */
+#define MAPPING_SYMBOL	"$d"
+
+typedef struct {
+	uint32_t attributes_offset;
+	uint32_t strtab_offset;
+	uint32_t strtab_size;
+	uint32_t shstrtab_offset;
+	uint32_t symtab_offset;
+	int num_syms;
+	uint32_t shdr_offset;
+	uint32_t size;
+} object_layout_t;
+
+static void object_destroy(void *element)
+{
+	stub_object_t *obj = element;
+
+	free(obj->member);
+}
+
+stub_archive_t *stub_archive_init(stub_archive_t *ar, const char *filename)
+{
+	if ((ar->filename = strdup(filename)) == NULL)
+		return NULL;
+	if (varray_init(&ar->objects, sizeof(stub_object_t), 16) == NULL) {
+		free(ar->filename);
+		return NULL;
+	}
+	ar->objects.destroy_func = object_destroy;
+	return ar;
+}
+
+void stub_archive_destroy(stub_archive_t *ar)
+{
+	varray_destroy(&ar->objects);
+	free(ar->filename);
+}
+
+int stub_archive_add(stub_archive_t *ar, const char *library, const char *module,
+		const char *symbol, int is_variable, uint32_t library_nid, uint32_t module_nid, uint32_t nid)
+{
+	stub_object_t obj;
+	size_t len;
+
+	len = strlen(library) + strlen(module) + strlen(symbol) + sizeof("__.o");
+	if ((obj.member = malloc(len)) == NULL)
+		return 0;
+	snprintf(obj.member, len, "%s_%s_%s.o", library, module, symbol);
+	obj.symbol = symbol;
+	obj.is_variable = is_variable;
+	obj.library_nid = library_nid;
+	obj.module_nid = module_nid;
+	obj.nid = nid;
+
+	if (varray_push(&ar->objects, &obj) == NULL) {
+		free(obj.member);
+		return 0;
+	}
+	return 1;
+}
+
+/* Length-prefixed, so that no two sequences of fields hash alike */
+static void hash_bytes(sha256_ctx *ctx, const void *data, uint64_t len)
+{
+	sha256_update(ctx, &len, sizeof(len));
+	sha256_update(ctx, data, len);
+}
+
+void stub_archive_digest(const stub_archive_t *ar, uint8_t digest[SHA256_DIGEST_SIZE])
+{
+	const stub_object_t *obj;
+	uint32_t fields[4];
+	sha256_ctx ctx;
+	int i;
+
+	sha256_init(&ctx);
+	hash_bytes(&ctx, STUB_ARCHIVE_VERSION, strlen(STUB_ARCHIVE_VERSION));
+	for (i = 0; i < ar->objects.count; i++) {
+		obj = VARRAY_ELEMENT(&ar->objects, i);
+		hash_bytes(&ctx, obj->member, strlen(obj->member));
+		hash_bytes(&ctx, obj->symbol, strlen(obj->symbol));
+		fields[0] = obj->is_variable;
+		fields[1] = obj->library_nid;
+		fields[2] = obj->module_nid;
+		fields[3] = obj->nid;
+		hash_bytes(&ctx, fields, sizeof(fields));
+	}
+	sha256_final(&ctx, digest);
+}
+
+static uint32_t align4(uint32_t offset)
+{
+	return (offset + 3) & ~3;
+}
+
+static void object_layout(const stub_object_t *obj, object_layout_t *layout)
+{
+	layout->attributes_offset = STUB_OFFSET + STUB_SIZE;
+	layout->strtab_offset = layout->attributes_offset + sizeof(arm_attributes);
+	layout->strtab_size = 1 + (obj->is_variable ? 0 : sizeof(MAPPING_SYMBOL)) + strlen(obj->symbol) + 1;
+	layout->shstrtab_offset = layout->strtab_offset + layout->strtab_size;
+	layout->symtab_offset = align4(layout->shstrtab_offset + SHSTRTAB_SIZE);
+	/* Null, section, the mapping symbol if any, then the stub's own */
+	layout->num_syms = obj->is_variable ? 3 : 4;
+	layout->shdr_offset = align4(layout->symtab_offset + layout->num_syms * sizeof(Elf32_Sym));
+	layout->size = layout->shdr_offset + NUM_SCNS * sizeof(Elf32_Shdr);
+}
+
+static void set_shdr(Elf32_Shdr *shdr, uint32_t name, uint32_t type, uint32_t flags,
+		uint32_t offset, uint32_t size, uint32_t link, uint32_t info, uint32_t align, uint32_t entsize)
+{
+	shdr->sh_name = htole32(name);
+	shdr->sh_type = htole32(type);
+	shdr->sh_flags = htole32(flags);
+	shdr->sh_addr = 0;
+	shdr->sh_offset = htole32(offset);
+	shdr->sh_size = htole32(size);
+	shdr->sh_link = htole32(link);
+	shdr->sh_info = htole32(info);
+	shdr->sh_addralign = htole32(align);
+	shdr->sh_entsize = htole32(entsize);
+}
+
+static void set_sym(Elf32_Sym *sym, uint32_t name, int bind, int type, int shndx)
+{
+	sym->st_name = htole32(name);
+	sym->st_value = 0;
+	sym->st_size = 0;
+	sym->st_info = ELF32_ST_INFO(bind, type);
+	sym->st_other = STV_DEFAULT;
+	sym->st_shndx = htole16(shndx);
+}
+
+/* out must be zeroed and layout->size long */
+static void write_object(uint8_t *out, const stub_object_t *obj, const object_layout_t *layout)
+{
+	Elf32_Ehdr *ehdr = (Elf32_Ehdr *)out;
+	Elf32_Shdr shdrs[NUM_SCNS];
+	Elf32_Sym syms[4];
+	uint32_t stub[3];
+	char *strtab;
+	uint32_t name;
+	int n = 0;
+
+	memcpy(ehdr->e_ident, ELFMAG, SELFMAG);
+	ehdr->e_ident[EI_CLASS] = ELFCLASS32;
+	ehdr->e_ident[EI_DATA] = ELFDATA2LSB;
+	ehdr->e_ident[EI_VERSION] = EV_CURRENT;
+	ehdr->e_ident[EI_OSABI] = ELFOSABI_NONE;
+	ehdr->e_type = htole16(ET_REL);
+	ehdr->e_machine = htole16(EM_ARM);
+	ehdr->e_version = htole32(EV_CURRENT);
+	ehdr->e_shoff = htole32(layout->shdr_offset);
+	ehdr->e_flags = htole32(EF_ARM_EABI_VER5);
+	ehdr->e_ehsize = htole16(sizeof(Elf32_Ehdr));
+	ehdr->e_shentsize = htole16(sizeof(Elf32_Shdr));
+	ehdr->e_shnum = htole16(NUM_SCNS);
+	ehdr->e_shstrndx = htole16(SCN_SHSTRTAB);
+
+	stub[0] = htole32(obj->library_nid);
+	stub[1] = htole32(obj->module_nid);
+	stub[2] = htole32(obj->nid);
+	memcpy(out + STUB_OFFSET, stub, sizeof(stub));
+
+	memcpy(out + layout->attributes_offset, arm_attributes, sizeof(arm_attributes));
+
+	strtab = (char *)out + layout->strtab_offset;
+	memset(syms, 0, sizeof(syms));
+	n++;
+	set_sym(&syms[n++], 0, STB_LOCAL, STT_SECTION, SCN_STUBS);
+	name = 1;
+	if (!obj->is_variable) {
+		strcpy(strtab + name, MAPPING_SYMBOL);
+		set_sym(&syms[n++], name, STB_LOCAL, STT_NOTYPE, SCN_STUBS);
+		name += sizeof(MAPPING_SYMBOL);
+	}
+	strcpy(strtab + name, obj->symbol);
+	set_sym(&syms[n++], name, STB_GLOBAL, obj->is_variable ? STT_OBJECT : STT_FUNC, SCN_STUBS);
+	memcpy(out + layout->symtab_offset, syms, n * sizeof(Elf32_Sym));
+
+	memcpy(out + layout->shstrtab_offset + SHSTR_STUBS, obj->is_variable ? VSTUBS_NAME : FSTUBS_NAME, sizeof(FSTUBS_NAME));
+	memcpy(out + layout->shstrtab_offset + SHSTR_ATTRIBUTES, ".ARM.attributes", sizeof(".ARM.attributes"));
+	memcpy(out + layout->shstrtab_offset + SHSTR_SYMTAB, ".symtab", sizeof(".symtab"));
+	memcpy(out + layout->shstrtab_offset + SHSTR_STRTAB, ".strtab", sizeof(".strtab"));
+	memcpy(out + layout->shstrtab_offset + SHSTR_SHSTRTAB, ".shstrtab", sizeof(".shstrtab"));
+
+	memset(shdrs, 0, sizeof(shdrs));
+	set_shdr(&shdrs[SCN_STUBS], SHSTR_STUBS, SHT_PROGBITS,
+			obj->is_variable ? SHF_ALLOC | SHF_WRITE : SHF_ALLOC | SHF_EXECINSTR,
+			STUB_OFFSET, STUB_SIZE, 0, 0, STUB_ALIGN, 0);
+	set_shdr(&shdrs[SCN_ATTRIBUTES], SHSTR_ATTRIBUTES, SHT_ARM_ATTRIBUTES, 0,
+			layout->attributes_offset, sizeof(arm_attributes), 0, 0, 1, 0);
+	/* sh_info is one past the last local symbol, which leaves only the stub's */
+	set_shdr(&shdrs[SCN_SYMTAB], SHSTR_SYMTAB, SHT_SYMTAB, 0,
+			layout->symtab_offset, n * sizeof(Elf32_Sym), SCN_STRTAB, n - 1, 4, sizeof(Elf32_Sym));
+	set_shdr(&shdrs[SCN_STRTAB], SHSTR_STRTAB, SHT_STRTAB, 0,
+			layout->strtab_offset, layout->strtab_size, 0, 0, 1, 0);
+	set_shdr(&shdrs[SCN_SHSTRTAB], SHSTR_SHSTRTAB, SHT_STRTAB, 0,
+			layout->shstrtab_offset, SHSTRTAB_SIZE, 0, 0, 1, 0);
+	memcpy(out + layout->shdr_offset, shdrs, sizeof(shdrs));
+}
+
+static void write_ar_header(uint8_t *out, const char *name, const char *mode, uint32_t size)
+{
+	char header[AR_HEADER_SIZE + 1];
+
+	snprintf(header, sizeof(header), "%-16s%-12d%-6d%-6d%-8s%-10u`\n", name, 0, 0, 0, mode, size);
+	memcpy(out, header, AR_HEADER_SIZE);
+}
+
+/* The GNU symbol index is big-endian whatever the target */
+static void put_be32(uint8_t *out, uint32_t value)
+{
+	out[0] = value >> 24;
+	out[1] = value >> 16;
+	out[2] = value >> 8;
+	out[3] = value;
+}
+
+static uint32_t align2(uint32_t offset)
+{
+	return (offset + 1) & ~1;
+}
+
+int stub_archive_write(const stub_archive_t *ar)
+{
+	const stub_object_t *obj;
+	object_layout_t *layouts = NULL;
+	uint32_t *member_offsets = NULL;
+	uint32_t symtab_size, names_size = 0;
+	uint32_t offset, size;
+	uint8_t *out = NULL, *p;
+	char name[AR_NAME_SIZE + 1];
+	uint32_t name_offset;
+	size_t len;
+	FILE *fp;
+	int count = ar->objects.count;
+	int i;
+
+	if (count > 0) {
+		ASSERT(layouts = calloc(count, sizeof(*layouts)));
+		ASSERT(member_offsets = calloc(count, sizeof(*member_offsets)));
+	}
+
+	/* Everything is sized up front, since the index needs every member's offset */
+	symtab_size = 4 + count * 4;
+	for (i = 0; i < count; i++) {
+		obj = VARRAY_ELEMENT(&ar->objects, i);
+		object_layout(obj, &layouts[i]);
+		symtab_size += strlen(obj->symbol) + 1;
+		/* Names that don't fit "name/" in the header go in the "//" member */
+		if ((len = strlen(obj->member)) >= AR_NAME_SIZE)
+			names_size += len + 2;
+	}
+
+	offset = sizeof(AR_MAGIC) - 1;
+	if (count > 0)
+		offset += AR_HEADER_SIZE + align2(symtab_size);
+	if (names_size > 0)
+		offset += AR_HEADER_SIZE + align2(names_size);
+	for (i = 0; i < count; i++) {
+		member_offsets[i] = offset;
+		offset += AR_HEADER_SIZE + align2(layouts[i].size);
+	}
+	size = offset;
+
+	ASSERT(out = calloc(1, size));
+	memcpy(out, AR_MAGIC, sizeof(AR_MAGIC) - 1);
+	p = out + sizeof(AR_MAGIC) - 1;
+
+	if (count > 0) {
+		write_ar_header(p, "/", "0", symtab_size);
+		p += AR_HEADER_SIZE;
+		put_be32(p, count);
+		for (i = 0; i < count; i++)
+			put_be32(p + 4 + i * 4, member_offsets[i]);
+		p += 4 + count * 4;
+		for (i = 0; i < count; i++) {
+			obj = VARRAY_ELEMENT(&ar->objects, i);
+			len = strlen(obj->symbol) + 1;
+			memcpy(p, obj->symbol, len);
+			p += len;
+		}
+		if (symtab_size & 1)
+			*p++ = '\0';
+	}
+
+	name_offset = 0;
+	if (names_size > 0) {
+		write_ar_header(p, "//", "", names_size);
+		p += AR_HEADER_SIZE;
+		for (i = 0; i < count; i++) {
+			obj = VARRAY_ELEMENT(&ar->objects, i);
+			if ((len = strlen(obj->member)) < AR_NAME_SIZE)
+				continue;
+			memcpy(p, obj->member, len);
+			memcpy(p + len, "/\n", 2);
+			p += len + 2;
+		}
+		if (names_size & 1)
+			*p++ = '\n';
+	}
+
+	for (i = 0; i < count; i++) {
+		obj = VARRAY_ELEMENT(&ar->objects, i);
+		if ((len = strlen(obj->member)) < AR_NAME_SIZE) {
+			snprintf(name, sizeof(name), "%s/", obj->member);
+		} else {
+			snprintf(name, sizeof(name), "/%u", name_offset);
+			name_offset += len + 2;
+		}
+		write_ar_header(p, name, "644", layouts[i].size);
+		p += AR_HEADER_SIZE;
+		write_object(p, obj, &layouts[i]);
+		p += layouts[i].size;
+		if (layouts[i].size & 1)
+			*p++ = '\n';
+	}
+
+	if ((fp = fopen(ar->filename, "wb")) == NULL)
+		FAIL("Could not open %s for writing", ar->filename);
+	if (fwrite(out, 1, size, fp) != size) {
+		fclose(fp);
+		remove(ar->filename);
+		FAIL("Could not write %s", ar->filename);
+	}
+	if (fclose(fp) != 0) {
+		remove(ar->filename);
+		FAIL("Could not write %s", ar->filename);
+	}
+
+	free(out);
+	free(member_offsets);
+	free(layouts);
+	return 1;
+failure:
+	free(out);
+	free(member_offsets);
+	free(layouts);
+	return 0;
+}
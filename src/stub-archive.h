@@ -0,0 +1,42 @@
+#ifndef STUB_ARCHIVE_H
+#define STUB_ARCHIVE_H
+
+#include <stdint.h>
+
+#include "varray.h"
+#include "sha256.h"
+
+/* Part of every digest; bump it whenever the same stubs would now be written differently */
+#define STUB_ARCHIVE_VERSION	"stub-archive 1"
+
+/* What one generated .S used to assemble to: a NID triple in
+ * .vitalink.fstubs or .vitalink.vstubs, and a global symbol on it */
+typedef struct {
+	char *member;		/* Name inside the archive */
+	const char *symbol;	/* Not owned, normally points into the imports */
+	int is_variable;
+	uint32_t library_nid;
+	uint32_t module_nid;
+	uint32_t nid;
+} stub_object_t;
+
+typedef struct {
+	char *filename;
+	varray objects;
+} stub_archive_t;
+
+stub_archive_t *stub_archive_init(stub_archive_t *ar, const char *filename);
+void stub_archive_destroy(stub_archive_t *ar);
+
+/* The member is named library_module_symbol.o, as the Makefile would have it */
+int stub_archive_add(stub_archive_t *ar, const char *library, const char *module,
+		const char *symbol, int is_variable, uint32_t library_nid, uint32_t module_nid, uint32_t nid);
+
+/* Covers everything stub_archive_write puts in the file, so equal digests mean equal archives */
+void stub_archive_digest(const stub_archive_t *ar, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+/* Writes the objects out as an ar archive with a GNU symbol index, like "ar cru"
+ * followed by ranlib; timestamps and owners are zeroed so the output is reproducible */
+int stub_archive_write(const stub_archive_t *ar);
+
+#endif
@@ -129,6 +129,22 @@ void *varray_push(varray *va, void *element)
 	return _IDX(va->count - 1);
 }
 
+void *varray_push_many(varray *va, const void *elements, int count)
+{
+	if (count <= 0)
+		return NULL;
+
+	while (va->count + count > va->allocation) {
+		if (!grow_array(va))
+			return NULL;
+	}
+
+	memcpy(_IDX(va->count), elements, va->element_size * count);
+	va->count += count;
+
+	return _IDX(va->count - count);
+}
+
 void *varray_insert(varray *va, void *element, int index)
 {
 	if (index > va->count || index < 0)
@@ -32,6 +32,8 @@ int varray_get_index(varray *va, void *element_ptr);
 /* if element is NULL in either function, the new element will be initialized to zero. */
 void *varray_push(varray *va, void *element);
 void *varray_insert(varray *va, void *element, int index);
+/* Appends count elements copied from elements; returns the first one, or NULL on failure or if count is 0 */
+void *varray_push_many(varray *va, const void *elements, int count);
 
 /* _pop and _remove will return a value that is only valid until the next array insert. */
 void *varray_pop(varray *va);
@@ -0,0 +1,1054 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <getopt.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+/* Only for the ELF types and constants; nothing here calls into libelf */
+#include <libelf.h>
+
+#include "elf-defs.h"
+#include "endian-utils.h"
+#include "fail-utils.h"
+#include "sha256.h"
+
+#ifndef EF_ARM_EABI_VER5
+#define EF_ARM_EABI_VER5 0x05000000
+#endif
+#ifndef PT_ARM_EXIDX
+#define PT_ARM_EXIDX 0x70000001
+#endif
+
+#define TEXT_VADDR	0x81000000
+#define SEGMENT_ALIGN	0x10000
+
+/* What one synthetic ELF and its DB look like */
+typedef struct {
+	const char *name;
+	int stubs;		/* Function stubs; one in eight more are variables */
+	int relocs;		/* Relocated places; a MOVW/MOVT pair counts once but takes two relocations */
+	int symbols;		/* Local functions for the data relocations to point at */
+	int segments;		/* PT_LOAD segments; the code, then the data ones */
+	int db_size;		/* NIDs in the DB, counting the ones the stubs use */
+	uint32_t seed;
+	const char *flags;	/* Extra vita-elf-create options, space separated */
+	int debug;		/* Adds debug sections, whose relocations only --strip-debug accepts */
+	int duplicates;		/* Runs of this many function stubs in a module import the same NID */
+	const char *same_as;	/* Converts that earlier workload's files, and must match its output */
+} workload_t;
+
+/* The golden suite; sizes stay small enough to run on every build */
+static const workload_t suite[] = {
+	{ "tiny",       16,    200,    32, 2,    64, 1, "", 0, 0, NULL },
+	{ "medium",    300,  20000,  2000, 3,  2000, 2, "", 0, 0, NULL },
+	{ "medium-gc",  300, 20000,  2000, 3,  2000, 2, "--gc-imports", 0, 0, NULL },
+	{ "medium-debug", 300, 20000, 2000, 3, 2000, 2, "--strip-debug", 1, 0, NULL },
+	/* Equal NIDs have to keep the import table order they always had */
+	{ "medium-dup", 300, 20000,  2000, 3,  2000, 2, "", 0, 4, NULL },
+	{ "large",    2000, 200000, 20000, 4, 20000, 3, "", 0, 0, NULL },
+	/* Encoding on several threads has to come out byte for byte the same */
+	{ "large-mt", 2000, 200000, 20000, 4, 20000, 3, "--reloc-threads 4", 0, 0, "large" },
+};
+
+/* The module name comes from the file name, so workloads that must match share their files */
+static const char *file_base(const workload_t *w)
+{
+	return w->same_as ? w->same_as : w->name;
+}
+
+typedef struct {
+	uint8_t *data;
+	size_t len;
+	size_t size;
+} buf_t;
+
+static int buf_reserve(buf_t *buf, size_t len)
+{
+	size_t size = buf->size ? buf->size : 4096;
+	uint8_t *data;
+
+	while (size < buf->len + len)
+		size *= 2;
+	if (size == buf->size)
+		return 1;
+	if ((data = realloc(buf->data, size)) == NULL)
+		return 0;
+	memset(data + buf->size, 0, size - buf->size);
+	buf->data = data;
+	buf->size = size;
+	return 1;
+}
+
+static int buf_put(buf_t *buf, const void *data, size_t len)
+{
+	if (!buf_reserve(buf, len))
+		return 0;
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
+	return 1;
+}
+
+static int buf_align(buf_t *buf, size_t align)
+{
+	size_t pad = (align - buf->len % align) % align;
+
+	if (!buf_reserve(buf, pad))
+		return 0;
+	buf->len += pad;
+	return 1;
+}
+
+static int buf_put32(buf_t *buf, uint32_t value)
+{
+	value = htole32(value);
+	return buf_put(buf, &value, 4);
+}
+
+static int buf_printf(buf_t *buf, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static int buf_printf(buf_t *buf, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	if (n < 0 || !buf_reserve(buf, n + 1))
+		return 0;
+	va_start(ap, fmt);
+	vsnprintf((char *)buf->data + buf->len, n + 1, fmt, ap);
+	va_end(ap);
+	buf->len += n;
+	return 1;
+}
+
+/* Adds a NUL-terminated string and returns its offset */
+static uint32_t buf_string(buf_t *buf, const char *s)
+{
+	uint32_t off = buf->len;
+
+	buf_put(buf, s, strlen(s) + 1);
+	return off;
+}
+
+static int buf_write(const buf_t *buf, const char *path)
+{
+	FILE *fp;
+
+	if ((fp = fopen(path, "wb")) == NULL) {
+		warn("Could not open %s for writing", path);
+		return 0;
+	}
+	if (fwrite(buf->data, 1, buf->len, fp) != buf->len) {
+		warn("Could not write %s", path);
+		fclose(fp);
+		return 0;
+	}
+	if (fclose(fp) != 0) {
+		warn("Could not write %s", path);
+		return 0;
+	}
+	return 1;
+}
+
+/* xorshift32, so the workloads come out the same everywhere */
+static uint32_t next_random(uint32_t *state)
+{
+	uint32_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+static int num_modules(const workload_t *w)
+{
+	return 1 + w->stubs / 32;
+}
+
+static int num_vstubs(const workload_t *w)
+{
+	return (w->stubs + 7) / 8;
+}
+
+#define LIBRARY_NID(m)		(0x10000000 + (m) * 0x1111)
+#define MODULE_NID(m)		(0x20000000 + (m) * 0x2222)
+#define FUNCTION_NID(i)		(0x30000000 + (i) * 7)
+#define VARIABLE_NID(i)		(0x40000000 + (i) * 13)
+#define UNUSED_NID(i)		(0x50000000 + (i) * 11)
+
+/* The NID function stub i imports: that of the first stub of its run */
+static uint32_t stub_nid(const workload_t *w, int i)
+{
+	int modules = num_modules(w), k = i / modules;
+
+	if (w->duplicates > 1)
+		k -= k % w->duplicates;
+	return FUNCTION_NID(k * modules + i % modules);
+}
+
+/* Stub i belongs to module i % num_modules; the unused NIDs pad the DB out to db_size */
+static int write_db(const workload_t *w, const char *path)
+{
+	buf_t buf = {0};
+	int modules = num_modules(w), vstubs = num_vstubs(w);
+	int unused = w->db_size - w->stubs - vstubs;
+	int m, i, first;
+	int ok;
+
+	buf_printf(&buf, "{");
+	for (m = 0; m < modules; m++) {
+		buf_printf(&buf, "%s\n  \"BenchLib%d\": {\n    \"nid\": %u,\n    \"modules\": {\n"
+				"      \"BenchLib%d\": {\n        \"nid\": %u,\n        \"kernel\": false,\n"
+				"        \"functions\": {", m ? "," : "", m, LIBRARY_NID(m), m, MODULE_NID(m));
+		first = 1;
+		for (i = m; i < w->stubs; i += modules, first = 0)
+			buf_printf(&buf, "%s\n          \"BenchLib%d_f%d\": %u", first ? "" : ",", m, i, FUNCTION_NID(i));
+		for (i = m; i < unused; i += modules, first = 0)
+			buf_printf(&buf, "%s\n          \"BenchLib%d_unused%d\": %u", first ? "" : ",", m, i, UNUSED_NID(i));
+		buf_printf(&buf, "\n        },\n        \"variables\": {");
+		first = 1;
+		for (i = m; i < vstubs; i += modules, first = 0)
+			buf_printf(&buf, "%s\n          \"BenchLib%d_v%d\": %u", first ? "" : ",", m, i, VARIABLE_NID(i));
+		buf_printf(&buf, "\n        }\n      }\n    }\n  }");
+	}
+	buf_printf(&buf, "\n}\n");
+
+	ok = buf.data != NULL && buf_write(&buf, path);
+	free(buf.data);
+	return ok;
+}
+
+/* Section header order; the data sections and their relocations follow */
+enum {
+	SCN_NULL,
+	SCN_TEXT,
+	SCN_EXIDX,
+	SCN_FSTUBS,
+	SCN_VSTUBS,
+	SCN_DATA,
+};
+
+typedef struct {
+	char name[32];
+	Elf32_Word type;
+	Elf32_Word flags;
+	Elf32_Word align;
+	Elf32_Word entsize;
+	Elf32_Word link;
+	Elf32_Word info;
+	int segment;		/* -1 if not loaded */
+	buf_t data;
+	Elf32_Addr addr;
+	Elf32_Off offset;
+} gen_section_t;
+
+typedef struct {
+	Elf32_Addr vaddr;
+	Elf32_Off offset;
+	Elf32_Word size;
+} gen_segment_t;
+
+enum { KIND_CALL, KIND_MOVW, KIND_THM_MOVW, KIND_ABS, NUM_KINDS };
+
+static void set_section(gen_section_t *sec, const char *name, Elf32_Word type, Elf32_Word flags,
+		Elf32_Word align, Elf32_Word entsize, Elf32_Word link, Elf32_Word info, int segment)
+{
+	snprintf(sec->name, sizeof(sec->name), "%s", name);
+	sec->type = type;
+	sec->flags = flags;
+	sec->align = align;
+	sec->entsize = entsize;
+	sec->link = link;
+	sec->info = info;
+	sec->segment = segment;
+}
+
+static uint32_t thumb_mov(uint32_t imm16, int top)
+{
+	uint32_t upper = 0xf240 | (top ? 0x80 : 0) | ((imm16 >> 12) & 0xf) | (((imm16 >> 11) & 1) << 10);
+	uint32_t lower = (((imm16 >> 8) & 7) << 12) | (imm16 & 0xff);
+	return upper | (lower << 16);
+}
+
+static void put32_at(gen_section_t *sec, Elf32_Word offset, uint32_t value)
+{
+	value = htole32(value);
+	memcpy(sec->data.data + offset, &value, 4);
+}
+
+static int add_rel(gen_section_t *rel, Elf32_Addr offset, int sym, int type)
+{
+	return buf_put32(&rel->data, offset) && buf_put32(&rel->data, ELF32_R_INFO(sym, type));
+}
+
+static int add_sym(gen_section_t *symtab, buf_t *strtab, const char *name,
+		Elf32_Addr value, int bind, int type, int shndx)
+{
+	Elf32_Sym sym = {0};
+
+	sym.st_name = htole32(*name ? buf_string(strtab, name) : 0);
+	sym.st_value = htole32(value);
+	sym.st_info = ELF32_ST_INFO(bind, type);
+	sym.st_shndx = htole16(shndx);
+	return strtab->data != NULL && buf_put(&symtab->data, &sym, sizeof(sym));
+}
+
+static int zero_fill(buf_t *buf, size_t len)
+{
+	if (!buf_reserve(buf, len))
+		return 0;
+	buf->len += len;
+	return 1;
+}
+
+/* Lays out an executable the way the Vita linker scripts would: code, exidx and
+ * function stubs in the first segment, variable stubs and data in the others.
+ * The relocations cycle through calls to function stubs, ARM and Thumb
+ * MOVW/MOVT pairs against variables and data, and pointers to local functions.
+ * Every fifth function stub is never called, for --gc-imports to find.  With
+ * duplicates, runs of a module's function stubs share a NID, as when several
+ * objects each bring their own stub for it. */
+static int write_elf(const workload_t *w, const char *path)
+{
+	int modules = num_modules(w), vstubs = num_vstubs(w);
+	int data_segments = w->segments - 1;
+	int scn_rel_text = SCN_DATA + data_segments;
+	int scn_debug = scn_rel_text + 1 + data_segments;
+	int scn_symtab = scn_debug + (w->debug ? 2 : 0);
+	int scn_strtab = scn_symtab + 1, scn_shstrtab = scn_symtab + 2;
+	int num_sections = scn_shstrtab + 1;
+	gen_section_t *sections = NULL, *sec, *text, *rel;
+	gen_segment_t *segments = NULL;
+	buf_t out = {0}, strtab = {0}, shstrtab = {0};
+	uint32_t state = w->seed ? w->seed : 1;
+	int text_words = 16, *abs_count = NULL;
+	int first_data_obj, first_fstub, first_vstub;
+	int r, i, s, sym, kind, target;
+	Elf32_Addr vaddr, addr;
+	Elf32_Word off;
+	Elf32_Off shoff;
+	Elf32_Ehdr ehdr = {{0}};
+	Elf32_Phdr phdr;
+	Elf32_Shdr shdr;
+	char name[48];
+	int ok = 0;
+
+	if (w->segments < 2 || w->stubs < 1 || w->symbols < 1 || w->relocs < 0)
+		FAILX("%s: needs at least 2 segments, 1 stub and 1 symbol", w->name);
+	ASSERT(sections = calloc(num_sections, sizeof(gen_section_t)));
+	ASSERT(segments = calloc(w->segments, sizeof(gen_segment_t)));
+	ASSERT(abs_count = calloc(data_segments, sizeof(int)));
+	text = sections + SCN_TEXT;
+	rel = sections + scn_rel_text;
+
+	/* Sizes first, as the contents need every address */
+	for (r = 0; r < w->relocs; r++) {
+		kind = r % NUM_KINDS;
+		if (kind == KIND_CALL)
+			text_words++;
+		else if (kind == KIND_ABS)
+			abs_count[r / NUM_KINDS % data_segments]++;
+		else
+			text_words += 2;
+	}
+	text_words += w->symbols;
+
+	set_section(text, ".text", SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR, 4, 0, 0, 0, 0);
+	set_section(sections + SCN_EXIDX, ".ARM.exidx", SHT_ARM_EXIDX, SHF_ALLOC | SHF_LINK_ORDER, 4, 0, SCN_TEXT, 0, 0);
+	set_section(sections + SCN_FSTUBS, ".vitalink.fstubs", SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR, 16, 0, 0, 0, 0);
+	set_section(sections + SCN_VSTUBS, ".vitalink.vstubs", SHT_PROGBITS, SHF_ALLOC | SHF_WRITE, 16, 0, 0, 0, 1);
+	set_section(rel, ".rel.text", SHT_REL, SHF_INFO_LINK, 4, sizeof(Elf32_Rel), scn_symtab, SCN_TEXT, -1);
+	for (s = 0; s < data_segments; s++) {
+		snprintf(name, sizeof(name), s ? ".data%d" : ".data", s);
+		set_section(sections + SCN_DATA + s, name, SHT_PROGBITS, SHF_ALLOC | SHF_WRITE, 4, 0, 0, 0, 1 + s);
+		snprintf(name, sizeof(name), s ? ".rel.data%d" : ".rel.data", s);
+		set_section(rel + 1 + s, name, SHT_REL, SHF_INFO_LINK, 4, sizeof(Elf32_Rel), scn_symtab, SCN_DATA + s, -1);
+	}
+	if (w->debug) {
+		set_section(sections + scn_debug, ".debug_info", SHT_PROGBITS, 0, 1, 0, 0, 0, -1);
+		set_section(sections + scn_debug + 1, ".rel.debug_info", SHT_REL, SHF_INFO_LINK, 4, sizeof(Elf32_Rel),
+				scn_symtab, scn_debug, -1);
+	}
+	set_section(sections + scn_symtab, ".symtab", SHT_SYMTAB, 0, 4, sizeof(Elf32_Sym), scn_strtab, 0, -1);
+	set_section(sections + scn_strtab, ".strtab", SHT_STRTAB, 0, 1, 0, 0, 0, -1);
+	set_section(sections + scn_shstrtab, ".shstrtab", SHT_STRTAB, 0, 1, 0, 0, 0, -1);
+	sections[SCN_NULL].segment = -1;
+
+	ASSERT(zero_fill(&text->data, text_words * 4));
+	ASSERT(buf_put32(&sections[SCN_EXIDX].data, 0x7fffff00) && buf_put32(&sections[SCN_EXIDX].data, 1));
+	for (i = 0; i < w->stubs; i++) {
+		sec = sections + SCN_FSTUBS;
+		ASSERT(buf_put32(&sec->data, LIBRARY_NID(i % modules)) && buf_put32(&sec->data, MODULE_NID(i % modules))
+				&& buf_put32(&sec->data, stub_nid(w, i)) && buf_put32(&sec->data, 0));
+	}
+	for (i = 0; i < vstubs; i++) {
+		sec = sections + SCN_VSTUBS;
+		ASSERT(buf_put32(&sec->data, LIBRARY_NID(i % modules)) && buf_put32(&sec->data, MODULE_NID(i % modules))
+				&& buf_put32(&sec->data, VARIABLE_NID(i)) && buf_put32(&sec->data, 0));
+	}
+	/* Four words of objects, then one word per pointer */
+	for (s = 0; s < data_segments; s++)
+		ASSERT(zero_fill(&sections[SCN_DATA + s].data, (4 + abs_count[s]) * 4));
+
+	/* Segments are spaced out so that the module info has room to grow the first one */
+	vaddr = TEXT_VADDR;
+	off = sizeof(Elf32_Ehdr) + (w->segments + 1) * sizeof(Elf32_Phdr);
+	for (s = 0; s < w->segments; s++) {
+		off = (off + 15) & ~15;
+		segments[s].vaddr = vaddr;
+		segments[s].offset = off;
+		for (i = 0; i < num_sections; i++) {
+			sec = sections + i;
+			if (sec->segment != s)
+				continue;
+			off = (off + sec->align - 1) & ~(sec->align - 1);
+			sec->offset = off;
+			sec->addr = vaddr + (off - segments[s].offset);
+			off += sec->data.len;
+		}
+		segments[s].size = off - segments[s].offset;
+		vaddr += segments[s].size + SEGMENT_ALIGN + 64 * (w->stubs + vstubs + modules);
+		vaddr = (vaddr + SEGMENT_ALIGN - 1) & ~(SEGMENT_ALIGN - 1);
+	}
+
+	/* Symbols: the local functions at the end of .text, the data objects, then the stubs */
+	sec = sections + scn_symtab;
+	ASSERT(buf_put(&strtab, "", 1));
+	ASSERT(add_sym(sec, &strtab, "", 0, STB_LOCAL, STT_NOTYPE, SHN_UNDEF));
+	for (i = 0; i < w->symbols; i++) {
+		snprintf(name, sizeof(name), "local%d", i);
+		addr = text->addr + (text_words - w->symbols + i) * 4;
+		ASSERT(add_sym(sec, &strtab, name, addr | (i & 1), STB_LOCAL, STT_FUNC, SCN_TEXT));
+	}
+	first_data_obj = 1 + w->symbols;
+	for (s = 0; s < data_segments; s++) {
+		for (i = 0; i < 4; i++) {
+			snprintf(name, sizeof(name), "dataobj%d_%d", s, i);
+			ASSERT(add_sym(sec, &strtab, name, sections[SCN_DATA + s].addr + i * 4, STB_LOCAL, STT_OBJECT, SCN_DATA + s));
+		}
+	}
+	first_fstub = first_data_obj + data_segments * 4;
+	sec->info = first_fstub;
+	for (i = 0; i < w->stubs; i++) {
+		snprintf(name, sizeof(name), "BenchLib%d_f%d", i % modules, i);
+		ASSERT(add_sym(sec, &strtab, name, sections[SCN_FSTUBS].addr + i * 16, STB_GLOBAL, STT_FUNC, SCN_FSTUBS));
+	}
+	first_vstub = first_fstub + w->stubs;
+	for (i = 0; i < vstubs; i++) {
+		snprintf(name, sizeof(name), "BenchLib%d_v%d", i % modules, i);
+		ASSERT(add_sym(sec, &strtab, name, sections[SCN_VSTUBS].addr + i * 16, STB_GLOBAL, STT_OBJECT, SCN_VSTUBS));
+	}
+
+	/* The relocations, and the instructions and pointers they describe */
+	off = 0;
+	memset(abs_count, 0, data_segments * sizeof(int));
+	for (r = 0; r < w->relocs; r++) {
+		kind = r % NUM_KINDS;
+		addr = text->addr + off;
+		if (kind == KIND_CALL) {
+			target = next_random(&state) % w->stubs;
+			if (target % 5 == 4)
+				target--;
+			vaddr = sections[SCN_FSTUBS].addr + target * 16;
+			put32_at(text, off, 0xeb000000 | (((vaddr - addr) >> 2) & 0xffffff));
+			ASSERT(add_rel(rel, addr, first_fstub + target, R_ARM_CALL));
+			off += 4;
+		} else if (kind == KIND_MOVW || kind == KIND_THM_MOVW) {
+			target = next_random(&state) % (vstubs + data_segments * 4);
+			if (target < vstubs) {
+				sym = first_vstub + target;
+				vaddr = sections[SCN_VSTUBS].addr + target * 16;
+			} else {
+				target -= vstubs;
+				sym = first_data_obj + target;
+				vaddr = sections[SCN_DATA + target / 4].addr + target % 4 * 4;
+			}
+			if (kind == KIND_MOVW) {
+				put32_at(text, off, 0xe3000000 | ((vaddr & 0xf000) << 4) | (vaddr & 0xfff));
+				put32_at(text, off + 4, 0xe3400000 | ((vaddr >> 12) & 0xf0000) | ((vaddr >> 16) & 0xfff));
+				ASSERT(add_rel(rel, addr, sym, R_ARM_MOVW_ABS_NC) && add_rel(rel, addr + 4, sym, R_ARM_MOVT_ABS));
+			} else {
+				put32_at(text, off, thumb_mov(vaddr & 0xffff, 0));
+				put32_at(text, off + 4, thumb_mov(vaddr >> 16, 1));
+				ASSERT(add_rel(rel, addr, sym, R_ARM_THM_MOVW_ABS_NC) && add_rel(rel, addr + 4, sym, R_ARM_THM_MOVT_ABS));
+			}
+			off += 8;
+		} else {
+			s = r / NUM_KINDS % data_segments;
+			sec = sections + SCN_DATA + s;
+			target = next_random(&state) % w->symbols;
+			vaddr = text->addr + (text_words - w->symbols + target) * 4;
+			put32_at(sec, (4 + abs_count[s]) * 4, (vaddr | (target & 1)) + r % 3 * 4);
+			ASSERT(add_rel(rel + 1 + s, sec->addr + (4 + abs_count[s]) * 4, 1 + target, R_ARM_ABS32));
+			abs_count[s]++;
+		}
+	}
+	/* One that has to be skipped */
+	ASSERT(add_rel(rel, text->addr, 0, R_ARM_V4BX));
+
+	/* An address per local function, as DWARF would have */
+	if (w->debug) {
+		sec = sections + scn_debug;
+		for (i = 0; i < w->symbols; i++) {
+			ASSERT(add_rel(sec + 1, sec->data.len, 1 + i, R_ARM_ABS32));
+			ASSERT(buf_put32(&sec->data, (text->addr + (text_words - w->symbols + i) * 4) | (i & 1)));
+		}
+	}
+
+	ASSERT(buf_put(&shstrtab, "", 1));
+	for (i = 1; i < num_sections; i++)
+		buf_string(&shstrtab, sections[i].name);
+	ASSERT(shstrtab.data != NULL);
+	sections[scn_strtab].data = strtab;
+	sections[scn_shstrtab].data = shstrtab;
+	memset(&strtab, 0, sizeof(strtab));
+	memset(&shstrtab, 0, sizeof(shstrtab));
+
+	/* Everything not loaded goes after the segments, then the section headers */
+	ASSERT(zero_fill(&out, off = segments[w->segments - 1].offset + segments[w->segments - 1].size));
+	for (i = 1; i < num_sections; i++) {
+		sec = sections + i;
+		if (sec->segment >= 0) {
+			memcpy(out.data + sec->offset, sec->data.data, sec->data.len);
+			continue;
+		}
+		ASSERT(buf_align(&out, sec->align));
+		sec->offset = out.len;
+		ASSERT(buf_put(&out, sec->data.data, sec->data.len));
+	}
+	ASSERT(buf_align(&out, 4));
+	shoff = out.len;
+
+	memset(&shdr, 0, sizeof(shdr));
+	ASSERT(buf_put(&out, &shdr, sizeof(shdr)));
+	for (i = 1, off = 1; i < num_sections; i++) {
+		sec = sections + i;
+		shdr.sh_name = htole32(off);
+		shdr.sh_type = htole32(sec->type);
+		shdr.sh_flags = htole32(sec->flags);
+		shdr.sh_addr = htole32(sec->segment >= 0 ? sec->addr : 0);
+		shdr.sh_offset = htole32(sec->offset);
+		shdr.sh_size = htole32(sec->data.len);
+		shdr.sh_link = htole32(sec->link);
+		shdr.sh_info = htole32(sec->info);
+		shdr.sh_addralign = htole32(sec->align);
+		shdr.sh_entsize = htole32(sec->entsize);
+		ASSERT(buf_put(&out, &shdr, sizeof(shdr)));
+		off += strlen(sec->name) + 1;
+	}
+
+	memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+	ehdr.e_ident[EI_CLASS] = ELFCLASS32;
+	ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+	ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+	ehdr.e_type = htole16(ET_EXEC);
+	ehdr.e_machine = htole16(EM_ARM);
+	ehdr.e_version = htole32(EV_CURRENT);
+	ehdr.e_entry = htole32(text->addr);
+	ehdr.e_phoff = htole32(sizeof(Elf32_Ehdr));
+	ehdr.e_shoff = htole32(shoff);
+	ehdr.e_flags = htole32(EF_ARM_EABI_VER5);
+	ehdr.e_ehsize = htole16(sizeof(Elf32_Ehdr));
+	ehdr.e_phentsize = htole16(sizeof(Elf32_Phdr));
+	ehdr.e_phnum = htole16(w->segments + 1);
+	ehdr.e_shentsize = htole16(sizeof(Elf32_Shdr));
+	ehdr.e_shnum = htole16(num_sections);
+	ehdr.e_shstrndx = htole16(scn_shstrtab);
+	memcpy(out.data, &ehdr, sizeof(ehdr));
+
+	for (s = 0; s <= w->segments; s++) {
+		memset(&phdr, 0, sizeof(phdr));
+		if (s < w->segments) {
+			phdr.p_type = htole32(PT_LOAD);
+			phdr.p_offset = htole32(segments[s].offset);
+			phdr.p_vaddr = phdr.p_paddr = htole32(segments[s].vaddr);
+			phdr.p_filesz = phdr.p_memsz = htole32(segments[s].size);
+			phdr.p_flags = htole32(s ? PF_R | PF_W : PF_R | PF_X);
+			phdr.p_align = htole32(16);
+		} else {
+			sec = sections + SCN_EXIDX;
+			phdr.p_type = htole32(PT_ARM_EXIDX);
+			phdr.p_offset = htole32(sec->offset);
+			phdr.p_vaddr = phdr.p_paddr = htole32(sec->addr);
+			phdr.p_filesz = phdr.p_memsz = htole32(sec->data.len);
+			phdr.p_flags = htole32(PF_R);
+			phdr.p_align = htole32(4);
+		}
+		memcpy(out.data + sizeof(Elf32_Ehdr) + s * sizeof(Elf32_Phdr), &phdr, sizeof(phdr));
+	}
+
+	ok = buf_write(&out, path);
+failure:
+	if (sections) {
+		for (i = 0; i < num_sections; i++)
+			free(sections[i].data.data);
+	}
+	free(sections);
+	free(segments);
+	free(abs_count);
+	free(strtab.data);
+	free(shstrtab.data);
+	free(out.data);
+	return ok;
+}
+
+#define MAX_PHASES	16
+
+/* What one conversion took, from its --stats-json and the process itself */
+typedef struct {
+	int num_phases;
+	char phase_names[MAX_PHASES][32];
+	double phase_ms[MAX_PHASES];	/* Wall time */
+	double convert_ms;		/* The phases added up */
+	double process_ms;		/* Including startup and loading the DB */
+	long peak_rss_kib;
+	int relocs;
+	int stubs;
+	long output_size;
+	char digest[SHA256_DIGEST_SIZE * 2 + 1];
+} run_result_t;
+
+static char *read_file(const char *path, long *size)
+{
+	FILE *fp;
+	char *data = NULL;
+	long len;
+
+	if ((fp = fopen(path, "rb")) == NULL)
+		FAIL("Could not open %s", path);
+	if (fseek(fp, 0, SEEK_END) != 0 || (len = ftell(fp)) < 0 || fseek(fp, 0, SEEK_SET) != 0)
+		FAIL("Could not read %s", path);
+	ASSERT(data = malloc(len + 1));
+	if (fread(data, 1, len, fp) != len)
+		FAIL("Could not read %s", path);
+	data[len] = '\0';
+	fclose(fp);
+	if (size)
+		*size = len;
+	return data;
+failure:
+	if (fp)
+		fclose(fp);
+	free(data);
+	return NULL;
+}
+
+static int json_int(const char *json, const char *key, long *value)
+{
+	char pattern[64];
+	const char *p;
+
+	snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+	if ((p = strstr(json, pattern)) == NULL)
+		return 0;
+	*value = strtol(p + strlen(pattern), NULL, 10);
+	return 1;
+}
+
+/* Only has to follow what stats_write_json writes for a single file */
+static int parse_stats(const char *path, run_result_t *result)
+{
+	char *json, *p;
+	long value;
+	double wall, cpu;
+	int n;
+
+	if ((json = read_file(path, NULL)) == NULL)
+		return 0;
+
+	if ((p = strstr(json, "\"phases\": {")) == NULL)
+		FAILX("%s: no phases", path);
+	p += strlen("\"phases\": {");
+	while (result->num_phases < MAX_PHASES
+			&& sscanf(p, " \"%31[^\"]\": { \"wall_ms\": %lf, \"cpu_ms\": %lf }%n",
+				result->phase_names[result->num_phases], &wall, &cpu, &n) == 3) {
+		result->phase_ms[result->num_phases++] = wall;
+		result->convert_ms += wall;
+		p += n;
+		if (*p == ',')
+			p++;
+	}
+
+	if (json_int(json, "peak_rss_kib", &value))
+		result->peak_rss_kib = value;
+	if (json_int(json, "relocs", &value))
+		result->relocs = value;
+	if (json_int(json, "function_stubs", &value))
+		result->stubs = value;
+	if (json_int(json, "variable_stubs", &value))
+		result->stubs += value;
+	free(json);
+	return 1;
+failure:
+	free(json);
+	return 0;
+}
+
+static int digest_file(const char *path, run_result_t *result)
+{
+	static const char hex[] = "0123456789abcdef";
+	uint8_t digest[SHA256_DIGEST_SIZE];
+	sha256_ctx ctx;
+	char *data;
+	int i;
+
+	if ((data = read_file(path, &result->output_size)) == NULL)
+		return 0;
+	sha256_init(&ctx);
+	sha256_update(&ctx, data, result->output_size);
+	sha256_final(&ctx, digest);
+	free(data);
+
+	for (i = 0; i < SHA256_DIGEST_SIZE; i++) {
+		result->digest[i * 2] = hex[digest[i] >> 4];
+		result->digest[i * 2 + 1] = hex[digest[i] & 0xf];
+	}
+	result->digest[SHA256_DIGEST_SIZE * 2] = '\0';
+	return 1;
+}
+
+static double elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/* Runs tool from inside workdir, so the module name is the same wherever workdir is */
+static int run_tool(const char *tool, const char *workdir, const workload_t *w, run_result_t *result)
+{
+	char elf[PATH_MAX], velf[PATH_MAX], db[PATH_MAX], stats[PATH_MAX];
+	char *flags = NULL, *argv[32];
+	struct timespec start;
+	char *saveptr, *s;
+	int argc = 0, status;
+	pid_t pid;
+
+	snprintf(elf, sizeof(elf), "%s.elf", file_base(w));
+	snprintf(velf, sizeof(velf), "%s.velf", file_base(w));
+	snprintf(db, sizeof(db), "%s.json", file_base(w));
+	snprintf(stats, sizeof(stats), "%s.stats.json", file_base(w));
+
+	ASSERT(flags = strdup(w->flags));
+	argv[argc++] = (char *)tool;
+	argv[argc++] = "--stats-json";
+	argv[argc++] = stats;
+	for (s = strtok_r(flags, " ", &saveptr); s && argc < 28; s = strtok_r(NULL, " ", &saveptr))
+		argv[argc++] = s;
+	argv[argc++] = elf;
+	argv[argc++] = velf;
+	argv[argc++] = db;
+	argv[argc] = NULL;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if ((pid = fork()) < 0)
+		FAIL("fork");
+	if (pid == 0) {
+		/* A server would answer for it and write no stats */
+		unsetenv("VITA_ELF_CREATE_SOCKET");
+		if (chdir(workdir) < 0) {
+			warn("Could not enter %s", workdir);
+			_exit(127);
+		}
+		execv(tool, argv);
+		warn("Could not run %s", tool);
+		_exit(127);
+	}
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR)
+			FAIL("waitpid");
+	}
+	result->process_ms = elapsed_ms(&start);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		FAILX("%s: vita-elf-create failed", w->name);
+
+	snprintf(stats, sizeof(stats), "%s/%s.stats.json", workdir, file_base(w));
+	snprintf(velf, sizeof(velf), "%s/%s.velf", workdir, file_base(w));
+	if (!parse_stats(stats, result) || !digest_file(velf, result))
+		goto failure;
+
+	free(flags);
+	return 1;
+failure:
+	free(flags);
+	return 0;
+}
+
+static void print_rate(const char *what, double count, double ms)
+{
+	if (ms <= 0)
+		return;
+	count = count * 1e3 / ms;
+	if (count >= 1e6)
+		printf(", %.2fM %s/s", count / 1e6, what);
+	else if (count >= 1e3)
+		printf(", %.1fk %s/s", count / 1e3, what);
+	else
+		printf(", %.0f %s/s", count, what);
+}
+
+static void print_result(const workload_t *w, const run_result_t *result, int runs)
+{
+	int i;
+
+	printf("%s: %d stubs, %d relocation sites, %d symbols, %d segments, %d NIDs%s%s\n",
+			w->name, w->stubs + num_vstubs(w), w->relocs, w->symbols, w->segments,
+			w->db_size, *w->flags ? ", " : "", w->flags);
+	printf("  best of %d:", runs);
+	for (i = 0; i < result->num_phases; i++)
+		printf("%s %s %.3f", i ? "," : "", result->phase_names[i], result->phase_ms[i]);
+	printf(" ms\n");
+	printf("  convert %.3f ms (process %.3f ms)", result->convert_ms, result->process_ms);
+	print_rate("relocs", result->relocs, result->convert_ms);
+	print_rate("stubs", result->stubs, result->convert_ms);
+	printf("\n  peak RSS %ld KiB, output %ld bytes, sha256 %s\n", result->peak_rss_kib, result->output_size, result->digest);
+}
+
+/* Generates the workload once and converts it runs times, keeping the fastest */
+static int bench(const char *tool, const char *workdir, const workload_t *w, int runs, run_result_t *best)
+{
+	char path[PATH_MAX];
+	run_result_t result;
+	int i;
+
+	snprintf(path, sizeof(path), "%s/%s.json", workdir, file_base(w));
+	if (!write_db(w, path))
+		return 0;
+	snprintf(path, sizeof(path), "%s/%s.elf", workdir, file_base(w));
+	if (!write_elf(w, path))
+		return 0;
+
+	for (i = 0; i < runs; i++) {
+		memset(&result, 0, sizeof(result));
+		if (!run_tool(tool, workdir, w, &result))
+			return 0;
+		if (i > 0 && strcmp(result.digest, best->digest) != 0)
+			FAILX("%s: output differs between runs", w->name);
+		if (i == 0 || result.convert_ms < best->convert_ms)
+			*best = result;
+	}
+
+	print_result(w, best, runs);
+	return 1;
+failure:
+	return 0;
+}
+
+typedef struct {
+	char name[64];
+	char digest[SHA256_DIGEST_SIZE * 2 + 1];
+} golden_t;
+
+/* "name sha256" per line; # starts a comment */
+static int read_golden(const char *path, golden_t *golden, int max)
+{
+	char line[256];
+	FILE *fp;
+	int count = 0;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		if (errno == ENOENT)
+			return 0;
+		warn("Could not open %s", path);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fp) && count < max) {
+		if (line[0] == '#' || sscanf(line, "%63s %64s", golden[count].name, golden[count].digest) != 2)
+			continue;
+		count++;
+	}
+	fclose(fp);
+	return count;
+}
+
+static int write_golden(const char *path, const run_result_t *results, int count)
+{
+	FILE *fp;
+	int i;
+
+	if ((fp = fopen(path, "w")) == NULL) {
+		warn("Could not open %s for writing", path);
+		return 0;
+	}
+	fprintf(fp, "# SHA-256 of the .velf vita-bench --golden converts each suite workload to.\n"
+			"# Regenerate with --update-golden only when an output change is intended.\n");
+	for (i = 0; i < count; i++)
+		fprintf(fp, "%s %s\n", suite[i].name, results[i].digest);
+	if (fclose(fp) != 0) {
+		warn("Could not write %s", path);
+		return 0;
+	}
+	return 1;
+}
+
+/* Runs the suite and checks every output against the golden digests */
+static int run_suite(const char *tool, const char *workdir, const char *golden_path, int update, int runs)
+{
+	enum { SUITE_SIZE = sizeof(suite) / sizeof(suite[0]) };
+	golden_t golden[SUITE_SIZE * 2];
+	run_result_t results[SUITE_SIZE];
+	int num_golden, failed = 0;
+	int i, j, k;
+
+	if ((num_golden = read_golden(golden_path, golden, SUITE_SIZE * 2)) < 0)
+		return 0;
+
+	for (i = 0; i < SUITE_SIZE; i++) {
+		if (!bench(tool, workdir, suite + i, runs, results + i))
+			return 0;
+		if (suite[i].same_as) {
+			for (k = 0; k < i && strcmp(suite[k].name, suite[i].same_as) != 0; k++);
+			if (k == i) {
+				warnx("%s: no earlier workload %s", suite[i].name, suite[i].same_as);
+				return 0;
+			}
+			if (strcmp(results[k].digest, results[i].digest) != 0) {
+				printf("  output differs from %s\n", suite[k].name);
+				failed++;
+				continue;
+			}
+		}
+		if (update)
+			continue;
+		for (j = 0; j < num_golden && strcmp(golden[j].name, suite[i].name) != 0; j++);
+		if (j == num_golden) {
+			printf("  golden: MISSING\n");
+			failed++;
+		} else if (strcmp(golden[j].digest, results[i].digest) != 0) {
+			printf("  golden: MISMATCH, expected %s\n", golden[j].digest);
+			failed++;
+		} else {
+			printf("  golden: ok\n");
+		}
+	}
+
+	/* Never records outputs that already disagree with each other */
+	if (update)
+		return failed == 0 && write_golden(golden_path, results, SUITE_SIZE);
+	if (failed)
+		warnx("%d of %d outputs differ from %s", failed, SUITE_SIZE, golden_path);
+	return failed == 0;
+}
+
+static int parse_count(const char *arg, int *value)
+{
+	char *end;
+	long n = strtol(arg, &end, 10);
+
+	if (*end != '\0' || n < 0 || n > INT_MAX)
+		return 0;
+	*value = n;
+	return 1;
+}
+
+static const struct option long_options[] = {
+	{"stubs", required_argument, NULL, 'n'},
+	{"relocs", required_argument, NULL, 'm'},
+	{"symbols", required_argument, NULL, 'k'},
+	{"segments", required_argument, NULL, 's'},
+	{"db-size", required_argument, NULL, 'd'},
+	{"seed", required_argument, NULL, 'S'},
+	{"flags", required_argument, NULL, 'f'},
+	{"debug", no_argument, NULL, 'D'},
+	{"duplicates", required_argument, NULL, 'p'},
+	{"runs", required_argument, NULL, 'r'},
+	{"golden", required_argument, NULL, 'g'},
+	{"update-golden", no_argument, NULL, 'u'},
+	{NULL, 0, NULL, 0}
+};
+
+int main(int argc, char *argv[])
+{
+	workload_t custom = { "custom", 1000, 100000, 10000, 3, 10000, 1, "", 0, 0, NULL };
+	const char *golden = NULL;
+	char tool[PATH_MAX];
+	run_result_t result;
+	int update = 0, runs = 1;
+	int seed;
+	int opt, index;
+	int ok;
+
+	while ((opt = getopt_long(argc, argv, "", long_options, &index)) != -1) {
+		switch (opt) {
+			case 'n':
+				ok = parse_count(optarg, &custom.stubs);
+				break;
+			case 'm':
+				ok = parse_count(optarg, &custom.relocs);
+				break;
+			case 'k':
+				ok = parse_count(optarg, &custom.symbols);
+				break;
+			case 's':
+				ok = parse_count(optarg, &custom.segments);
+				break;
+			case 'd':
+				ok = parse_count(optarg, &custom.db_size);
+				break;
+			case 'S':
+				ok = parse_count(optarg, &seed);
+				custom.seed = seed;
+				break;
+			case 'f':
+				custom.flags = optarg;
+				ok = 1;
+				break;
+			case 'D':
+				custom.debug = 1;
+				ok = 1;
+				break;
+			case 'p':
+				ok = parse_count(optarg, &custom.duplicates);
+				break;
+			case 'r':
+				ok = parse_count(optarg, &runs) && runs > 0;
+				break;
+			case 'g':
+				golden = optarg;
+				ok = 1;
+				break;
+			case 'u':
+				update = 1;
+				ok = 1;
+				break;
+			default:
+				return EXIT_FAILURE;
+		}
+		if (!ok)
+			errx(EXIT_FAILURE, "Invalid value for --%s: %s", long_options[index].name, optarg);
+	}
+
+	if (argc - optind != 2 || (update && !golden))
+		errx(EXIT_FAILURE, "Usage: vita-bench [options] vita-elf-create workdir\n"
+				"       vita-bench --golden file [--update-golden] [--runs n] vita-elf-create workdir\n"
+				"Options: --stubs n, --relocs n, --symbols n, --segments n (at least 2),\n"
+				"         --db-size n (NIDs in the DB), --seed n, --runs n (keeps the fastest),\n"
+				"         --flags \"...\" (passed on to vita-elf-create),\n"
+				"         --debug (adds debug sections; needs --flags --strip-debug),\n"
+				"         --duplicates n (runs of n function stubs share a NID)");
+
+	/* The tool runs from inside workdir */
+	if (realpath(argv[optind], tool) == NULL)
+		err(EXIT_FAILURE, "%s", argv[optind]);
+	if (mkdir(argv[optind + 1], 0777) < 0 && errno != EEXIST)
+		err(EXIT_FAILURE, "Could not create %s", argv[optind + 1]);
+
+	if (golden)
+		ok = run_suite(tool, argv[optind + 1], golden, update, runs);
+	else
+		ok = bench(tool, argv[optind + 1], &custom, runs, &result);
+
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,432 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <utime.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+#include "vita-elf-cache.h"
+#include "vita-elf-create.h"
+#include "fail-utils.h"
+#include "varray.h"
+
+#ifdef __MINGW32__
+#define mkdir(path, mode) mkdir(path)
+static int mkstemp(char *template)
+{
+	if (_mktemp(template) == NULL)
+		return -1;
+	return open(template, O_CREAT | O_EXCL | O_WRONLY | O_BINARY, 0644);
+}
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#define ENTRY_SUFFIX ".velf"
+/* The lines an --import-manifest gets for the entry, kept beside it under the same key */
+#define IMPORTS_SUFFIX ".imports"
+
+typedef struct {
+	char name[SHA256_DIGEST_SIZE * 2 + sizeof(ENTRY_SUFFIX)];
+	time_t mtime;
+	uint64_t size;
+} cache_entry_t;
+
+/* Length-prefixed, so that no two sequences of fields hash alike */
+static void hash_bytes(sha256_ctx *ctx, const void *data, uint64_t len)
+{
+	sha256_update(ctx, &len, sizeof(len));
+	sha256_update(ctx, data, len);
+}
+
+static int hash_file(sha256_ctx *ctx, const char *path)
+{
+	uint8_t buf[64 * 1024];
+	struct stat st;
+	uint64_t len;
+	ssize_t n;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY | O_BINARY)) < 0 || fstat(fd, &st) < 0) {
+		warn("Could not open %s", path);
+		if (fd >= 0)
+			close(fd);
+		return 0;
+	}
+
+	len = st.st_size;
+	sha256_update(ctx, &len, sizeof(len));
+	while (len > 0) {
+		if ((n = read(fd, buf, len < sizeof(buf) ? len : sizeof(buf))) <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			warn("Could not read %s", path);
+			close(fd);
+			return 0;
+		}
+		sha256_update(ctx, buf, n);
+		len -= n;
+	}
+
+	close(fd);
+	return 1;
+}
+
+static int write_all(int fd, const char *p, size_t n)
+{
+	ssize_t written;
+
+	for (; n > 0; p += written, n -= written) {
+		if ((written = write(fd, p, n)) < 0) {
+			if (errno == EINTR) {
+				written = 0;
+				continue;
+			}
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int copy_fd(int in, int out)
+{
+	char buf[64 * 1024];
+	ssize_t n;
+
+#ifdef FICLONE
+	/* Shares the blocks on filesystems that can, e.g. btrfs and XFS */
+	if (ioctl(out, FICLONE, in) == 0)
+		return 1;
+#endif
+
+	while ((n = read(in, buf, sizeof(buf))) != 0) {
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return 0;
+		}
+		if (!write_all(out, buf, n))
+			return 0;
+	}
+	return 1;
+}
+
+static void entry_path(const vita_elf_cache_t *cache, const vita_elf_cache_key_t key, char *path, size_t n)
+{
+	snprintf(path, n, "%s/%s" ENTRY_SUFFIX, cache->dir, key);
+}
+
+static void imports_path(const vita_elf_cache_t *cache, const vita_elf_cache_key_t key, char *path, size_t n)
+{
+	snprintf(path, n, "%s/%s" IMPORTS_SUFFIX, cache->dir, key);
+}
+
+vita_elf_cache_t *vita_elf_cache_open(const char *dir, uint64_t max_size, char **db_paths, int db_count)
+{
+	vita_elf_cache_t *cache = NULL;
+	sha256_ctx ctx;
+	struct stat st;
+	int i;
+
+	if (mkdir(dir, 0777) < 0 && errno != EEXIST)
+		FAIL("Could not create cache directory %s", dir);
+	if (stat(dir, &st) < 0 || !S_ISDIR(st.st_mode))
+		FAILX("Cache path %s is not a directory", dir);
+
+	ASSERT(cache = calloc(1, sizeof(*cache)));
+	ASSERT(cache->dir = strdup(dir));
+	cache->max_size = max_size;
+
+	/* The DBs are the same for every ELF converted, so they are hashed on their own */
+	sha256_init(&ctx);
+	hash_bytes(&ctx, VITA_ELF_CACHE_VERSION, strlen(VITA_ELF_CACHE_VERSION));
+	hash_bytes(&ctx, VITA_ELF_BUILD_ID, strlen(VITA_ELF_BUILD_ID));
+	for (i = 0; i < db_count; i++) {
+		if (!hash_file(&ctx, db_paths[i]))
+			goto failure;
+	}
+	sha256_final(&ctx, cache->db_digest);
+
+	pthread_mutex_init(&cache->lock, NULL);
+	return cache;
+failure:
+	if (cache)
+		free(cache->dir);
+	free(cache);
+	return NULL;
+}
+
+int vita_elf_cache_key(const vita_elf_cache_t *cache, const char *input, int flags, vita_elf_cache_key_t key)
+{
+	static const char hex[] = "0123456789abcdef";
+	uint8_t digest[SHA256_DIGEST_SIZE];
+	uint32_t flags_word = flags;
+	sha256_ctx ctx;
+	int i;
+
+	sha256_init(&ctx);
+	hash_bytes(&ctx, cache->db_digest, sizeof(cache->db_digest));
+	hash_bytes(&ctx, &flags_word, sizeof(flags_word));
+	hash_bytes(&ctx, input, strlen(input));
+	if (!hash_file(&ctx, input))
+		return 0;
+	sha256_final(&ctx, digest);
+
+	for (i = 0; i < SHA256_DIGEST_SIZE; i++) {
+		key[i * 2] = hex[digest[i] >> 4];
+		key[i * 2 + 1] = hex[digest[i] & 0xf];
+	}
+	key[SHA256_DIGEST_SIZE * 2] = '\0';
+	return 1;
+}
+
+/* NULL if the entry has no lines, or they can't be read */
+static char *read_imports(const vita_elf_cache_t *cache, const vita_elf_cache_key_t key, size_t *size)
+{
+	char path[PATH_MAX];
+	char *imports = NULL;
+	struct stat st;
+	size_t len, done = 0;
+	ssize_t n;
+	int fd;
+
+	imports_path(cache, key, path, sizeof(path));
+
+	if ((fd = open(path, O_RDONLY | O_BINARY)) >= 0 && fstat(fd, &st) == 0
+			&& (imports = malloc((len = st.st_size) + 1)) != NULL) {
+		while (done < len) {
+			if ((n = read(fd, imports + done, len - done)) <= 0) {
+				if (n < 0 && errno == EINTR)
+					continue;
+				warn("Could not read %s", path);
+				free(imports);
+				imports = NULL;
+				break;
+			}
+			done += n;
+		}
+	}
+	if (fd >= 0)
+		close(fd);
+
+	if (imports) {
+		imports[done] = '\0';
+		*size = done;
+	}
+	return imports;
+}
+
+int vita_elf_cache_fetch(vita_elf_cache_t *cache, const vita_elf_cache_key_t key, const char *output,
+		char **imports, size_t *imports_size)
+{
+	char path[PATH_MAX];
+	int in = -1, out = -1;
+	int hit = 0;
+
+	entry_path(cache, key, path, sizeof(path));
+
+	/* Without its lines the .velf alone is no use, so that misses too */
+	if (imports)
+		*imports = read_imports(cache, key, imports_size);
+	if ((imports == NULL || *imports != NULL) && (in = open(path, O_RDONLY | O_BINARY)) >= 0) {
+		/* A copy rather than a hard link, as later writes to output would edit the entry too */
+		if ((out = open(output, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666)) < 0)
+			warn("Could not open %s for writing", output);
+		else if (!copy_fd(in, out))
+			warn("Could not copy %s to %s", path, output);
+		else
+			hit = 1;
+	}
+
+	if (out >= 0 && close(out) < 0)
+		hit = 0;
+	if (in >= 0)
+		close(in);
+
+	/* Recency for eviction */
+	if (hit)
+		utime(path, NULL);
+	else if (imports) {
+		free(*imports);
+		*imports = NULL;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	if (hit)
+		cache->hits++;
+	else
+		cache->misses++;
+	pthread_mutex_unlock(&cache->lock);
+
+	return hit;
+}
+
+int vita_elf_cache_store(vita_elf_cache_t *cache, const vita_elf_cache_key_t key, const char *output)
+{
+	char path[PATH_MAX];
+	char tmp_path[PATH_MAX];
+	int in = -1, out = -1;
+
+	entry_path(cache, key, path, sizeof(path));
+	snprintf(tmp_path, sizeof(tmp_path), "%s/%s.XXXXXX", cache->dir, key);
+
+	/* Written aside and renamed into place, so readers never see half an entry */
+	if ((out = mkstemp(tmp_path)) < 0)
+		FAIL("Could not create %s", tmp_path);
+	if ((in = open(output, O_RDONLY | O_BINARY)) < 0)
+		FAIL("Could not open %s", output);
+	if (!copy_fd(in, out))
+		FAIL("Could not copy %s to %s", output, tmp_path);
+	close(in);
+	in = -1;
+	if (close(out) < 0) {
+		out = -1;
+		FAIL("Could not write %s", tmp_path);
+	}
+	out = -1;
+	if (rename(tmp_path, path) < 0)
+		FAIL("Could not rename %s to %s", tmp_path, path);
+
+	pthread_mutex_lock(&cache->lock);
+	cache->stores++;
+	pthread_mutex_unlock(&cache->lock);
+	return 1;
+failure:
+	if (in >= 0)
+		close(in);
+	if (out >= 0)
+		close(out);
+	unlink(tmp_path);
+	return 0;
+}
+
+int vita_elf_cache_store_imports(vita_elf_cache_t *cache, const vita_elf_cache_key_t key, const char *imports, size_t size)
+{
+	char path[PATH_MAX];
+	char tmp_path[PATH_MAX];
+	int out = -1;
+
+	imports_path(cache, key, path, sizeof(path));
+	snprintf(tmp_path, sizeof(tmp_path), "%s/%s.XXXXXX", cache->dir, key);
+
+	if ((out = mkstemp(tmp_path)) < 0)
+		FAIL("Could not create %s", tmp_path);
+	if (!write_all(out, imports, size))
+		FAIL("Could not write %s", tmp_path);
+	if (close(out) < 0) {
+		out = -1;
+		FAIL("Could not write %s", tmp_path);
+	}
+	out = -1;
+	if (rename(tmp_path, path) < 0)
+		FAIL("Could not rename %s to %s", tmp_path, path);
+	return 1;
+failure:
+	if (out >= 0)
+		close(out);
+	unlink(tmp_path);
+	return 0;
+}
+
+static int entry_compar(const void *el1, const void *el2)
+{
+	const cache_entry_t *entry1 = el1, *entry2 = el2;
+
+	if (entry1->mtime != entry2->mtime)
+		return entry1->mtime < entry2->mtime ? -1 : 1;
+	return strcmp(entry1->name, entry2->name);
+}
+
+/* Drops the least recently used entries until the cache fits in max_size; returns how many went */
+static int evict(vita_elf_cache_t *cache)
+{
+	char path[PATH_MAX];
+	cache_entry_t *entry;
+	struct dirent *de;
+	struct stat st;
+	uint64_t total = 0;
+	varray entries;
+	size_t len;
+	DIR *dir;
+	int evicted = 0;
+	int i;
+
+	if ((dir = opendir(cache->dir)) == NULL)
+		return 0;
+	if (varray_init(&entries, sizeof(cache_entry_t), 64) == NULL) {
+		closedir(dir);
+		return 0;
+	}
+	entries.sort_compar = entry_compar;
+
+	while ((de = readdir(dir)) != NULL) {
+		len = strlen(de->d_name);
+		if (len != sizeof(((cache_entry_t *)0)->name) - 1
+				|| strcmp(de->d_name + len - strlen(ENTRY_SUFFIX), ENTRY_SUFFIX) != 0)
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", cache->dir, de->d_name);
+		if (stat(path, &st) < 0)
+			continue;
+		if ((entry = varray_push(&entries, NULL)) == NULL)
+			break;
+		strcpy(entry->name, de->d_name);
+		entry->mtime = st.st_mtime;
+		entry->size = st.st_size;
+		/* The imports, if any, live and die with the entry */
+		snprintf(path, sizeof(path), "%s/%.*s" IMPORTS_SUFFIX, cache->dir,
+				(int)(len - strlen(ENTRY_SUFFIX)), de->d_name);
+		if (stat(path, &st) == 0)
+			entry->size += st.st_size;
+		total += entry->size;
+	}
+	closedir(dir);
+
+	if (total > cache->max_size) {
+		varray_sort(&entries);
+		for (i = 0; i < entries.count && total > cache->max_size; i++) {
+			entry = VARRAY_ELEMENT(&entries, i);
+			snprintf(path, sizeof(path), "%s/%s", cache->dir, entry->name);
+			if (unlink(path) == 0) {
+				snprintf(path, sizeof(path), "%s/%.*s" IMPORTS_SUFFIX, cache->dir,
+						(int)(strlen(entry->name) - strlen(ENTRY_SUFFIX)), entry->name);
+				unlink(path);
+				total -= entry->size;
+				evicted++;
+			}
+		}
+	}
+
+	varray_destroy(&entries);
+	return evicted;
+}
+
+void vita_elf_cache_close(vita_elf_cache_t *cache, FILE *report)
+{
+	int evicted = 0;
+
+	if (cache == NULL)
+		return;
+
+	if (cache->stores)
+		evicted = evict(cache);
+	if (report)
+		fprintf(report, "Cache: %d hits, %d misses, %d evicted\n", cache->hits, cache->misses, evicted);
+
+	pthread_mutex_destroy(&cache->lock);
+	free(cache->dir);
+	free(cache);
+}
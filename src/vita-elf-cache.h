@@ -0,0 +1,53 @@
+#ifndef VITA_ELF_CACHE_H
+#define VITA_ELF_CACHE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "sha256.h"
+
+/* Part of every key, along with VITA_ELF_BUILD_ID, which already changes with the
+ * sources; bump it when the layout of the cache itself changes */
+#define VITA_ELF_CACHE_VERSION	"vita-elf-create 1"
+
+#define VITA_ELF_CACHE_FLAG_STRIP_DEBUG	1
+#define VITA_ELF_CACHE_FLAG_GC_IMPORTS	2
+
+/* Hex digest naming one cache entry */
+typedef char vita_elf_cache_key_t[SHA256_DIGEST_SIZE * 2 + 1];
+
+typedef struct {
+	char *dir;
+	uint64_t max_size;	/* Least recently used entries go once the cache outgrows this */
+	uint8_t db_digest[SHA256_DIGEST_SIZE];
+
+	pthread_mutex_t lock;	/* Guards the counters; entries themselves are replaced atomically */
+	int hits;
+	int misses;
+	int stores;
+} vita_elf_cache_t;
+
+/* Hashes the DBs at db_paths once, up front; returns NULL if the cache can't be used */
+vita_elf_cache_t *vita_elf_cache_open(const char *dir, uint64_t max_size, char **db_paths, int db_count);
+
+/* Evicts down to max_size, prints the counters to report if not NULL and frees the cache */
+void vita_elf_cache_close(vita_elf_cache_t *cache, FILE *report);
+
+/* The key covers the input's contents and name (which ends up in the module info), the flags,
+ * the build and the DBs */
+int vita_elf_cache_key(const vita_elf_cache_t *cache, const char *input, int flags, vita_elf_cache_key_t key);
+
+/* Returns 1 and writes the cached .velf to output on a hit.  With imports set,
+ * only an entry stored with its --import-manifest lines hits, and *imports gets
+ * them, malloc'ed and NUL-terminated; either way it counts as one lookup. */
+int vita_elf_cache_fetch(vita_elf_cache_t *cache, const vita_elf_cache_key_t key, const char *output,
+		char **imports, size_t *imports_size);
+
+/* Adds output, which must be complete, as the entry for key */
+int vita_elf_cache_store(vita_elf_cache_t *cache, const vita_elf_cache_key_t key, const char *output);
+
+/* Adds the lines for the entry for key; store the entry itself first */
+int vita_elf_cache_store_imports(vita_elf_cache_t *cache, const vita_elf_cache_key_t key, const char *imports, size_t size);
+
+#endif
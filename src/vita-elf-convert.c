@@ -0,0 +1,284 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <libelf.h>
+#include <gelf.h>
+
+#include "vita-elf.h"
+#include "vita-import.h"
+#include "elf-defs.h"
+#include "sce-elf.h"
+#include "elf-utils.h"
+#include "fail-utils.h"
+#include "vita-elf-convert.h"
+
+static void print_stubs(FILE *log, vita_elf_stub_t *stubs, int num_stubs)
+{
+	int i;
+
+	for (i = 0; i < num_stubs; i++) {
+		fprintf(log, "  0x%06x (%s):\n", stubs[i].addr, stubs[i].symbol ? stubs[i].symbol->name : "unreferenced stub");
+		fprintf(log, "    Library: %u (%s)\n", stubs[i].library_nid, stubs[i].library ? stubs[i].library->name : "not found");
+		fprintf(log, "    Module : %u (%s)\n", stubs[i].module_nid, stubs[i].module ? stubs[i].module->name : "not found");
+		fprintf(log, "    NID    : %u (%s)\n", stubs[i].target_nid, stubs[i].target ? stubs[i].target->name : "not found");
+	}
+}
+
+static const char *get_scn_name(vita_elf_t *ve, size_t shstrndx, Elf_Scn *scn)
+{
+	GElf_Shdr shdr;
+
+	gelf_getshdr(scn, &shdr);
+	return elf_strptr(ve->elf, shstrndx, shdr.sh_name);
+}
+
+static const char *get_scndx_name(vita_elf_t *ve, size_t shstrndx, int scndx)
+{
+	return get_scn_name(ve, shstrndx, elf_getscn(ve->elf, scndx));
+}
+
+static void print_rtable(FILE *log, const vita_elf_t *ve, const vita_elf_rela_table_t *rtable)
+{
+	const vita_elf_symbol_t *symbol;
+	int i;
+
+	for (i = 0; i < rtable->num_relas; i++) {
+		symbol = VITA_ELF_RELA_SYMBOL(ve, rtable, i);
+		if (symbol) {
+			fprintf(log, "    offset %06x: type %s, %s%+d\n",
+					rtable->offsets[i],
+					elf_decode_r_type(rtable->types[i]),
+					symbol->name, rtable->addends[i]);
+		} else {
+			fprintf(log, "    offset %06x: type %s, absolute %06x\n",
+					rtable->offsets[i],
+					elf_decode_r_type(rtable->types[i]),
+					(uint32_t)rtable->addends[i]);
+		}
+	}
+}
+
+static void list_rels(FILE *log, vita_elf_t *ve)
+{
+	vita_elf_rela_table_t *rtable;
+	size_t shstrndx;
+
+	elf_getshdrstrndx(ve->elf, &shstrndx);
+	for (rtable = ve->rela_tables; rtable; rtable = rtable->next) {
+		fprintf(log, "  Relocations for section %d: %s\n",
+				rtable->target_ndx, get_scndx_name(ve, shstrndx, rtable->target_ndx));
+		print_rtable(log, ve, rtable);
+
+	}
+}
+
+static void list_segments(FILE *log, vita_elf_t *ve)
+{
+	int i;
+
+	for (i = 0; i < ve->num_segments; i++) {
+		fprintf(log, "  Segment %d: vaddr %06x, size 0x%x\n",
+				i, ve->segments[i].vaddr, ve->segments[i].memsz);
+		if (ve->segments[i].memsz) {
+			fprintf(log, "    Host address region: %p - %p\n",
+					ve->segments[i].vaddr_top, ve->segments[i].vaddr_bottom);
+			fprintf(log, "    4 bytes into segment (%p): %x\n",
+					ve->segments[i].vaddr_top + 4, vita_elf_host_to_vaddr(ve, ve->segments[i].vaddr_top + 4));
+			fprintf(log, "    addr of 8 bytes into segment (%x): %p\n",
+					ve->segments[i].vaddr + 8, vita_elf_vaddr_to_host(ve, ve->segments[i].vaddr + 8));
+			fprintf(log, "    12 bytes into segment offset (%p): %d\n",
+					ve->segments[i].vaddr_top + 12, vita_elf_host_to_segoffset(ve, ve->segments[i].vaddr_top + 12, i));
+			fprintf(log, "    addr of 16 bytes into segment (%d): %p\n",
+					16, vita_elf_segoffset_to_host(ve, i, 16));
+		}
+	}
+}
+
+int vita_elf_convert_loaded(FILE *log, vita_elf_t *ve, const char *name,
+		const vita_imports_index_t *imports_index, const convert_options_t *options,
+		void **output, size_t *output_size, convert_stats_t *stats, stats_clock_t *clock)
+{
+	unsigned dump = options->dump;
+	sce_module_info_t *module_info = NULL;
+	sce_module_info_layout_t layout;
+	void *encoded_modinfo = NULL;
+	vita_elf_rela_table_t rtable = {};
+	FILE *null_file = NULL;
+	Elf *dest = NULL;
+	int own_shstrtab = 0;
+	sce_rel_stats_t rel_stats = {};
+	int ok = 1;
+
+	*output = NULL;
+
+	if (stats) {
+		vita_elf_rela_table_t *curtable;
+		stats->num_symbols = ve->num_symbols;
+		for (curtable = ve->rela_tables; curtable; curtable = curtable->next)
+			stats->num_relocs += curtable->num_relas;
+		stats->num_fstubs = ve->num_fstubs;
+		stats->num_vstubs = ve->num_vstubs;
+	}
+
+	if (!vita_elf_lookup_imports(ve, imports_index))
+		ok = 0;
+	stats_phase(stats, STATS_PHASE_LOOKUP_IMPORTS, clock);
+
+	if (dump & DUMP_STUBS) {
+		if (ve->fstubs_ndx) {
+			fprintf(log, "Function stubs in section %d:\n", ve->fstubs_ndx);
+			print_stubs(log, ve->fstubs, ve->num_fstubs);
+		}
+		if (ve->vstubs_ndx) {
+			fprintf(log, "Variable stubs in section %d:\n", ve->vstubs_ndx);
+			print_stubs(log, ve->vstubs, ve->num_vstubs);
+		}
+	}
+
+	if (dump & DUMP_RELOCS) {
+		fprintf(log, "Relocations:\n");
+		list_rels(log, ve);
+	}
+
+	if (dump & DUMP_SEGMENTS) {
+		fprintf(log, "Segments:\n");
+		list_segments(log, ve);
+	}
+	stats_phase(stats, STATS_PHASE_DUMP, clock);
+
+	if (options->gc_imports) {
+		int unreferenced = vita_elf_count_stub_refs(ve);
+		if (dump & DUMP_SIZES)
+			fprintf(log, "Dropping %d unreferenced stubs from the imports\n", unreferenced);
+	}
+	ASSERT(module_info = sce_elf_module_info_create(ve, options->gc_imports));
+
+	int total_size = sce_elf_module_info_get_layout(module_info, &layout);
+	int curpos = 0;
+	if (dump & DUMP_SIZES) {
+		fprintf(log, "Total SCE data size: %d / %x\n", total_size, total_size);
+#define PRINTSEC(name) fprintf(log, "  .%.*s.%s: %d (%x @ %x)\n", (int)strcspn(#name,"_"), #name, strchr(#name,'_')+1, layout.sizes.name, layout.sizes.name, curpos+ve->segments[0].vaddr+ve->segments[0].memsz); curpos += layout.sizes.name
+		PRINTSEC(sceModuleInfo_rodata);
+		PRINTSEC(sceLib_ent);
+		PRINTSEC(sceExport_rodata);
+		PRINTSEC(sceLib_stubs);
+		PRINTSEC(sceImport_rodata);
+		PRINTSEC(sceFNID_rodata);
+		PRINTSEC(sceFStub_rodata);
+		PRINTSEC(sceVNID_rodata);
+		PRINTSEC(sceVStub_rodata);
+	}
+
+	strncpy(module_info->name, name, sizeof(module_info->name) - 1);
+
+	ASSERT(encoded_modinfo = sce_elf_module_info_encode(
+			module_info, ve, &layout, &rtable));
+
+	if (dump & DUMP_RELOCS) {
+		fprintf(log, "Relocations from encoded modinfo:\n");
+		print_rtable(log, ve, &rtable);
+	}
+	if (stats)
+		stats->num_modules = module_info->import_end - module_info->import_top;
+	stats_phase(stats, STATS_PHASE_MODULE_INFO, clock);
+
+	if (ve->num_stripped && (dump & DUMP_SIZES))
+		fprintf(log, "Stripped %d debug sections\n", ve->num_stripped);
+	if ((dest = elf_utils_copy_to_memory(ve->elf, ve->stripped, &null_file)) == NULL)
+		FAILX("Could not set up the output of %s", name);
+	ASSERT(own_shstrtab = elf_utils_duplicate_shstrtab(dest));
+	stats_phase(stats, STATS_PHASE_COPY, clock);
+	ASSERT(sce_elf_discard_invalid_relocs(ve, ve->rela_tables));
+	stats_phase(stats, STATS_PHASE_DISCARD_INVALID_RELOCS, clock);
+	ASSERT(sce_elf_write_module_info(dest, ve, &layout, encoded_modinfo));
+	stats_phase(stats, STATS_PHASE_WRITE_MODULE_INFO, clock);
+	rtable.next = ve->rela_tables;
+	ASSERT(sce_elf_optimize_relocs(ve, &rtable));
+	ASSERT(sce_elf_write_rela_sections(dest, ve, &rtable, options->reloc_threads, &rel_stats));
+	if (stats) {
+		stats->rel.num_short = rel_stats.num_short;
+		stats->rel.num_long = rel_stats.num_long;
+		stats->rel.size = rel_stats.size;
+	}
+	stats_phase(stats, STATS_PHASE_WRITE_RELA_SECTIONS, clock);
+	ASSERT(sce_elf_rewrite_stubs(dest, ve));
+	stats_phase(stats, STATS_PHASE_REWRITE_STUBS, clock);
+	ASSERT(sce_elf_set_headers(dest, ve));
+	ASSERT(*output = elf_utils_write_to_memory(dest, output_size));
+	stats_phase(stats, STATS_PHASE_WRITE, clock);
+
+	goto cleanup;
+failure:
+	ok = 0;
+cleanup:
+	/* dest still points into encoded_modinfo, so it has to go first; the buffers
+	 * we gave it ourselves are ours to free, which matters once many conversions
+	 * share a process */
+	if (dest) {
+		sce_elf_free_rela_sections(dest);
+		if (own_shstrtab)
+			elf_utils_free_shstrtab(dest);
+		elf_end(dest);
+	}
+	if (null_file)
+		fclose(null_file);
+	vita_elf_rela_table_release(&rtable);
+	free(encoded_modinfo);
+	if (module_info)
+		sce_elf_module_info_free(module_info);
+	return ok;
+}
+
+vita_elf_converter_t *vita_elf_converter_new(const vita_imports_index_t *imports_index,
+		const convert_options_t *options, FILE *log)
+{
+	vita_elf_converter_t *converter;
+
+	if (elf_version(EV_CURRENT) == EV_NONE) {
+		warnx("libelf init failed: %s", elf_errmsg(-1));
+		return NULL;
+	}
+	if ((converter = calloc(1, sizeof(*converter))) == NULL)
+		return NULL;
+	converter->imports_index = imports_index;
+	converter->options = *options;
+	converter->log = log ? log : stdout;
+	return converter;
+}
+
+void vita_elf_converter_free(vita_elf_converter_t *converter)
+{
+	free(converter);
+}
+
+int vita_elf_converter_run(const vita_elf_converter_t *converter, const char *name,
+		const void *input, size_t input_size, void **output, size_t *output_size, convert_stats_t *stats)
+{
+	const convert_options_t *options = &converter->options;
+	stats_clock_t clock;
+	vita_elf_t *ve;
+	int ok;
+
+	*output = NULL;
+	if (stats) {
+		memset(stats, 0, sizeof(*stats));
+		stats->input = name;
+	}
+	stats_start(&clock);
+
+	ve = vita_elf_load_memory(name, input, input_size, options->strip_debug, options->reloc_threads);
+	stats_phase(stats, STATS_PHASE_LOAD, &clock);
+	if (ve == NULL) {
+		ok = 0;
+	} else {
+		ok = vita_elf_convert_loaded(converter->log, ve, name, converter->imports_index, options,
+				output, output_size, stats, &clock);
+		vita_elf_free(ve);
+	}
+
+	if (stats)
+		stats->ok = ok;
+	return ok;
+}
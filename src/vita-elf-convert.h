@@ -0,0 +1,103 @@
+#ifndef VITA_ELF_CONVERT_H
+#define VITA_ELF_CONVERT_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "vita-import.h"
+
+/* Only vita_elf_convert_loaded takes one, from a caller that has vita-elf.h */
+struct vita_elf_t;
+
+/* The steps of a conversion that --stats times, in the order they run */
+enum {
+	STATS_PHASE_LOAD,
+	STATS_PHASE_LOOKUP_IMPORTS,
+	STATS_PHASE_DUMP,
+	STATS_PHASE_MODULE_INFO,
+	STATS_PHASE_COPY,
+	STATS_PHASE_DISCARD_INVALID_RELOCS,
+	STATS_PHASE_WRITE_MODULE_INFO,
+	STATS_PHASE_WRITE_RELA_SECTIONS,
+	STATS_PHASE_REWRITE_STUBS,
+	STATS_PHASE_WRITE,
+	STATS_NUM_PHASES
+};
+
+typedef struct {
+	struct timespec wall;
+	struct timespec cpu;
+} stats_clock_t;
+
+typedef struct {
+	const char *input;
+	const char *output;
+	int ok;
+	int cached;		/* Came from the cache, so nothing was timed */
+
+	double wall_ms[STATS_NUM_PHASES];
+	double cpu_ms[STATS_NUM_PHASES];	/* Of the converting thread only */
+
+	int num_symbols;
+	int num_relocs;		/* As loaded, before invalid ones are discarded */
+	int num_fstubs;
+	int num_vstubs;
+	int num_modules;	/* Imported modules in the module info */
+	struct {
+		int num_short;
+		int num_long;
+		int size;
+	} rel;			/* What went into .sce.rel */
+} convert_stats_t;
+
+void stats_start(stats_clock_t *clock);
+/* Charges the time since the last mark to phase; a NULL stats does nothing */
+void stats_phase(convert_stats_t *stats, int phase, stats_clock_t *clock);
+/* In KiB, or -1 where the platform can't tell */
+long stats_peak_rss(void);
+void stats_print(FILE *fp, const convert_stats_t *stats);
+void stats_write_json(FILE *fp, const convert_stats_t *stats, int count);
+
+/* What a conversion writes to its log; nothing by default */
+#define DUMP_SIZES	(1 << 0)	/* SCE data and .sce.rel sizes */
+#define DUMP_STUBS	(1 << 1)
+#define DUMP_RELOCS	(1 << 2)
+#define DUMP_SEGMENTS	(1 << 3)
+#define DUMP_ALL	(DUMP_SIZES | DUMP_STUBS | DUMP_RELOCS | DUMP_SEGMENTS)
+
+typedef struct {
+	int strip_debug;		/* Leave the debug sections and their relocations out */
+	int gc_imports;			/* Leave stubs no relocation points at out of the imports */
+	int reloc_threads;		/* Decode and encode relocations on this many threads; the output is the same */
+	unsigned dump;
+} convert_options_t;
+
+/* Everything a conversion needs besides the input, so one can be set up once
+ * and run on many buffers; it is only read, so threads may share it */
+typedef struct {
+	const vita_imports_index_t *imports_index;	/* Borrowed; must outlive the converter */
+	convert_options_t options;
+	FILE *log;		/* Where options.dump goes */
+} vita_elf_converter_t;
+
+/* Also sets up libelf, so a caller needn't; log NULL means stdout */
+vita_elf_converter_t *vita_elf_converter_new(const vita_imports_index_t *imports_index,
+		const convert_options_t *options, FILE *log);
+void vita_elf_converter_free(vita_elf_converter_t *converter);
+
+/* Converts the ELF in input to a .velf in *output, which the caller frees; name
+ * becomes the module name.  Returns 0 on failure, in which case *output may still
+ * be set: as with vita-elf-create, unresolved imports are an error, but the
+ * output is made anyway.  stats may be NULL. */
+int vita_elf_converter_run(const vita_elf_converter_t *converter, const char *name,
+		const void *input, size_t input_size, void **output, size_t *output_size, convert_stats_t *stats);
+
+/* The rest of a conversion once ve is loaded, for callers that load it
+ * themselves; ve stays theirs to free, with its stubs looked up.  Charges
+ * each phase from LOOKUP_IMPORTS on to stats. */
+int vita_elf_convert_loaded(FILE *log, struct vita_elf_t *ve, const char *name,
+		const vita_imports_index_t *imports_index, const convert_options_t *options,
+		void **output, size_t *output_size, convert_stats_t *stats, stats_clock_t *clock);
+
+#endif
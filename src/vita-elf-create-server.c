@@ -0,0 +1,686 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "vita-elf-create.h"
+#include "vita-import.h"
+#include "fail-utils.h"
+#include "sha256.h"
+#include "varray.h"
+
+#if defined(_WIN32) && !defined(__CYGWIN__)
+
+int run_server(const char *socket_path, int num_threads)
+{
+	warnx("--server is not supported on this platform");
+	return 0;
+}
+
+int forward_to_server(const char *socket_path, const char *input, const char *output,
+		int extra_count, char *extra_paths[], const convert_options_t *options)
+{
+	return -1;
+}
+
+#else
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#ifdef __APPLE__
+#define st_mtim st_mtimespec
+#endif
+
+/*
+ * A request starts with REQUEST_MAGIC and the client's VITA_ELF_BUILD_ID,
+ * which the server answers with REPLY_ACCEPT or REPLY_MISMATCH before the
+ * client sends the rest: a list of strings, the client's flags (see
+ * encode_options), the module name (the input as the client spelled it), the
+ * input and output ELF and then any extra DBs.  Paths are absolute, as the
+ * server has its own working directory.  The reply is the result, the verbose
+ * log and the diagnostics.  Every number is a native uint32_t, as both ends are
+ * on the same machine; every string is its length followed by its bytes.
+ *
+ * A server built from other sources could read the request differently, so it
+ * turns the client away and the client converts locally.
+ */
+#define REQUEST_MAGIC		0x56454331	/* "VEC1" */
+#define REPLY_ACCEPT		1
+#define REPLY_MISMATCH		2
+#define REQUEST_TIMEOUT		10		/* Seconds a client gets to send its request or take the reply */
+#define ARG_FLAGS		0
+#define ARG_NAME		1
+#define ARG_INPUT		2
+#define ARG_OUTPUT		3
+#define REQUEST_FIXED_ARGS	4
+#define MAX_REQUEST_ARGS	(REQUEST_FIXED_ARGS + 1024)
+#define MAX_STRING_LENGTH	(16 * PATH_MAX)
+
+/* One parse of a DB; an index built on it keeps it alive after a reload replaces it */
+typedef struct {
+	vita_imports_t *imports;
+	int refs;
+} loaded_db_t;
+
+typedef struct {
+	char *path;		/* Canonical, so that every spelling of a file shares an entry */
+	struct timespec mtime;
+	off_t size;
+	uint8_t digest[SHA256_DIGEST_SIZE];	/* For rewrites that keep the size within the mtime's granularity */
+	loaded_db_t *db;	/* NULL until it loads */
+} cached_db_t;
+
+typedef struct {
+	vita_imports_index_t *index;
+	loaded_db_t **dbs;
+	int count;
+	int refs;		/* The server's while it is the current index, plus one per request using it */
+} shared_index_t;
+
+/* What a DB looked like when a request asked for it */
+typedef struct {
+	char path[PATH_MAX];
+	struct stat st;
+	uint8_t digest[SHA256_DIGEST_SIZE];
+} db_version_t;
+
+typedef struct {
+	int listen_fd;
+
+	pthread_mutex_t lock;	/* Guards everything below; conversions run outside it */
+	varray dbs;
+	/* The index built for the last set of DBs; build systems tend to ask for the same one */
+	shared_index_t *index;
+} server_state_t;
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return 0;
+		p += n;
+		len -= n;
+	}
+	return 1;
+}
+
+static int read_all(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = read(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return 0;
+		p += n;
+		len -= n;
+	}
+	return 1;
+}
+
+static int write_u32(int fd, uint32_t value)
+{
+	return write_all(fd, &value, sizeof(value));
+}
+
+static int read_u32(int fd, uint32_t *value)
+{
+	return read_all(fd, value, sizeof(*value));
+}
+
+static int write_string(int fd, const char *s, size_t len)
+{
+	return write_u32(fd, len) && write_all(fd, s, len);
+}
+
+static char *read_string(int fd, uint32_t max_len, uint32_t *len)
+{
+	char *s;
+
+	if (!read_u32(fd, len) || *len > max_len)
+		return NULL;
+	if ((s = malloc(*len + 1)) == NULL)
+		return NULL;
+	if (!read_all(fd, s, *len)) {
+		free(s);
+		return NULL;
+	}
+	s[*len] = '\0';
+	return s;
+}
+
+static int make_address(struct sockaddr_un *addr, const char *socket_path)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(socket_path) >= sizeof(addr->sun_path)) {
+		warnx("Socket path too long: %s", socket_path);
+		return 0;
+	}
+	strcpy(addr->sun_path, socket_path);
+	return 1;
+}
+
+static int connect_to(const char *socket_path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (!make_address(&addr, socket_path))
+		return -1;
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return -1;
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* 'S' for --strip-debug, 'G' for --gc-imports, then one letter per DUMP_* category */
+static const struct {
+	char letter;
+	unsigned dump;
+} dump_letters[] = {
+	{'z', DUMP_SIZES},
+	{'s', DUMP_STUBS},
+	{'r', DUMP_RELOCS},
+	{'g', DUMP_SEGMENTS},
+};
+
+static void encode_options(const convert_options_t *options, char *flags)
+{
+	int i;
+
+	if (options->strip_debug)
+		*flags++ = 'S';
+	if (options->gc_imports)
+		*flags++ = 'G';
+	for (i = 0; i < sizeof(dump_letters) / sizeof(dump_letters[0]); i++) {
+		if (options->dump & dump_letters[i].dump)
+			*flags++ = dump_letters[i].letter;
+	}
+	*flags = '\0';
+}
+
+static void decode_options(const char *flags, convert_options_t *options)
+{
+	int i;
+
+	memset(options, 0, sizeof(*options));
+	options->strip_debug = strchr(flags, 'S') != NULL;
+	options->gc_imports = strchr(flags, 'G') != NULL;
+	for (i = 0; i < sizeof(dump_letters) / sizeof(dump_letters[0]); i++) {
+		if (strchr(flags, dump_letters[i].letter))
+			options->dump |= dump_letters[i].dump;
+	}
+}
+
+static int hash_file(const char *path, uint8_t digest[SHA256_DIGEST_SIZE])
+{
+	uint8_t buf[64 * 1024];
+	sha256_ctx ctx;
+	ssize_t n;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		warn("Could not open %s", path);
+		return 0;
+	}
+	sha256_init(&ctx);
+	while ((n = read(fd, buf, sizeof(buf))) != 0) {
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			warn("Could not read %s", path);
+			close(fd);
+			return 0;
+		}
+		sha256_update(&ctx, buf, n);
+	}
+	close(fd);
+	sha256_final(&ctx, digest);
+	return 1;
+}
+
+/* Hashing a DB is cheaper than parsing it again, and the only check a
+ * same-size rewrite can't slip past; done before taking the lock */
+static int get_version(const char *path, db_version_t *version)
+{
+	if (realpath(path, version->path) == NULL || stat(version->path, &version->st) < 0) {
+		warn("Could not open %s", path);
+		return 0;
+	}
+	return hash_file(version->path, version->digest);
+}
+
+/* The release functions are called with the lock held */
+static void release_db(loaded_db_t *db)
+{
+	if (db == NULL || --db->refs > 0)
+		return;
+	vita_imports_free(db->imports);
+	free(db);
+}
+
+static void release_index(shared_index_t *index)
+{
+	int i;
+
+	if (index == NULL || --index->refs > 0)
+		return;
+	vita_imports_index_free(index->index);
+	for (i = 0; i < index->count; i++)
+		release_db(index->dbs[i]);
+	free(index->dbs);
+	free(index);
+}
+
+static void cached_db_destroy(void *element)
+{
+	cached_db_t *db = element;
+
+	free(db->path);
+	release_db(db->db);
+}
+
+/* Returns the loaded DB for version, reloading it if the file changed since it was read */
+static loaded_db_t *get_db(server_state_t *state, const db_version_t *version)
+{
+	cached_db_t *db = NULL;
+	loaded_db_t *loaded;
+	int i;
+
+	for (i = 0; i < state->dbs.count; i++) {
+		db = VARRAY_ELEMENT(&state->dbs, i);
+		if (strcmp(db->path, version->path) == 0)
+			break;
+	}
+	if (i == state->dbs.count) {
+		if ((db = varray_push(&state->dbs, NULL)) == NULL)
+			return NULL;
+		if ((db->path = strdup(version->path)) == NULL) {
+			varray_pop(&state->dbs);
+			return NULL;
+		}
+	} else if (db->db != NULL && db->size == version->st.st_size
+			&& db->mtime.tv_sec == version->st.st_mtim.tv_sec
+			&& db->mtime.tv_nsec == version->st.st_mtim.tv_nsec
+			&& memcmp(db->digest, version->digest, sizeof(db->digest)) == 0) {
+		return db->db;
+	}
+
+	/* Indexes built on the old copy hold their own reference to it */
+	release_db(db->db);
+	db->db = NULL;
+
+	if ((loaded = calloc(1, sizeof(*loaded))) == NULL)
+		return NULL;
+	if ((loaded->imports = vita_imports_load(version->path, 0)) == NULL) {
+		free(loaded);
+		return NULL;
+	}
+	loaded->refs = 1;
+	db->db = loaded;
+	db->mtime = version->st.st_mtim;
+	db->size = version->st.st_size;
+	memcpy(db->digest, version->digest, sizeof(db->digest));
+
+	return loaded;
+}
+
+/* Returns the index for the DBs in versions with a reference taken, which
+ * release_index drops; builds a new one if any of them changed */
+static shared_index_t *get_index(server_state_t *state, const db_version_t *versions, int count)
+{
+	shared_index_t *index = NULL;
+	vita_imports_t **imports = NULL;
+	loaded_db_t **dbs = NULL;
+	int i;
+
+	pthread_mutex_lock(&state->lock);
+
+	ASSERT(dbs = calloc(count + 1, sizeof(*dbs)));
+	for (i = 0; i < count; i++) {
+		if ((dbs[i] = get_db(state, &versions[i])) == NULL)
+			goto failure;
+	}
+
+	if (state->index == NULL || state->index->count != count
+			|| memcmp(state->index->dbs, dbs, count * sizeof(*dbs)) != 0) {
+		ASSERT(imports = calloc(count + 1, sizeof(*imports)));
+		for (i = 0; i < count; i++)
+			imports[i] = dbs[i]->imports;
+
+		ASSERT(index = calloc(1, sizeof(*index)));
+		ASSERT(index->index = vita_imports_index_new(imports, count));
+		index->dbs = dbs;
+		index->count = count;
+		index->refs = 1;
+		for (i = 0; i < count; i++)
+			dbs[i]->refs++;
+		dbs = NULL;
+
+		release_index(state->index);
+		state->index = index;
+		index = NULL;
+	}
+
+	state->index->refs++;
+	index = state->index;
+	pthread_mutex_unlock(&state->lock);
+	free(imports);
+	free(dbs);
+	return index;
+failure:
+	if (index) {
+		vita_imports_index_free(index->index);
+		free(index);
+	}
+	pthread_mutex_unlock(&state->lock);
+	free(imports);
+	free(dbs);
+	return NULL;
+}
+
+static void put_index(server_state_t *state, shared_index_t *index)
+{
+	pthread_mutex_lock(&state->lock);
+	release_index(index);
+	pthread_mutex_unlock(&state->lock);
+}
+
+/* Loads and indexes the DBs for a request and converts with them */
+static int serve_conversion(server_state_t *state, FILE *log, char *args[], int nargs)
+{
+	db_version_t *versions = NULL;
+	shared_index_t *index = NULL;
+	create_options_t options = {};
+	char **paths = NULL;
+	int count = 0;
+	int ok = 0;
+	int i;
+
+	ASSERT(paths = import_paths(nargs - REQUEST_FIXED_ARGS, args + REQUEST_FIXED_ARGS, &count));
+	ASSERT(versions = calloc(count + 1, sizeof(*versions)));
+	for (i = 0; i < count; i++) {
+		if (!get_version(paths[i], &versions[i]))
+			goto failure;
+	}
+	if ((index = get_index(state, versions, count)) == NULL)
+		goto failure;
+
+	decode_options(args[ARG_FLAGS], &options.convert);
+	ok = convert_elf(log, args[ARG_INPUT], args[ARG_NAME], args[ARG_OUTPUT], index->index, &options, NULL);
+
+failure:
+	if (index)
+		put_index(state, index);
+	free(versions);
+	free_import_paths(paths, count);
+	return ok;
+}
+
+static void serve_request(server_state_t *state, int fd)
+{
+	char *args[MAX_REQUEST_ARGS] = {};
+	uint32_t magic, nargs = 0, len;
+	char *build_id = NULL;
+	FILE *log = NULL, *diag = NULL;
+	char *log_buf = NULL, *diag_buf = NULL;
+	size_t log_len = 0, diag_len = 0;
+	int ok = 0;
+	uint32_t i;
+
+	if (!read_u32(fd, &magic) || magic != REQUEST_MAGIC
+			|| (build_id = read_string(fd, MAX_STRING_LENGTH, &len)) == NULL) {
+		warnx("Malformed request");
+		goto done;
+	}
+	if (strcmp(build_id, VITA_ELF_BUILD_ID) != 0) {
+		warnx("Turned away a client built from other sources");
+		write_u32(fd, REPLY_MISMATCH);
+		goto done;
+	}
+	if (!write_u32(fd, REPLY_ACCEPT)) {
+		warnx("Could not answer the client");
+		goto done;
+	}
+	if (!read_u32(fd, &nargs) || nargs < REQUEST_FIXED_ARGS || nargs > MAX_REQUEST_ARGS) {
+		warnx("Malformed request");
+		nargs = 0;
+		goto done;
+	}
+	for (i = 0; i < nargs; i++) {
+		if ((args[i] = read_string(fd, MAX_STRING_LENGTH, &len)) == NULL) {
+			warnx("Malformed request");
+			goto done;
+		}
+	}
+
+	/* Everything the conversion prints goes back to the client instead */
+	if ((log = open_memstream(&log_buf, &log_len)) == NULL
+			|| (diag = open_memstream(&diag_buf, &diag_len)) == NULL) {
+		warn("Could not create the reply buffers");
+		goto done;
+	}
+
+	fail_utils_redirect(diag, args[ARG_NAME]);
+	ok = serve_conversion(state, log, args, nargs);
+	fail_utils_redirect(NULL, NULL);
+
+	/* open_memstream only fills in the buffers once the stream is closed */
+	fclose(log);
+	fclose(diag);
+	log = diag = NULL;
+	if (!write_u32(fd, ok)
+			|| !write_string(fd, log_buf, log_len)
+			|| !write_string(fd, diag_buf, diag_len))
+		warnx("Could not reply for %s", args[ARG_INPUT]);
+	fprintf(stderr, "%s -> %s: %s\n", args[ARG_INPUT], args[ARG_OUTPUT], ok ? "ok" : "failed");
+
+done:
+	if (log)
+		fclose(log);
+	if (diag)
+		fclose(diag);
+	free(log_buf);
+	free(diag_buf);
+	free(build_id);
+	for (i = 0; i < nargs; i++)
+		free(args[i]);
+}
+
+static void *server_worker(void *arg)
+{
+	server_state_t *state = arg;
+	struct timeval timeout = { REQUEST_TIMEOUT, 0 };
+	int fd;
+
+	/* The timeouts keep a client that stalls from holding a worker forever */
+	for (;;) {
+		if ((fd = accept(state->listen_fd, NULL, NULL)) < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			warn("accept failed");
+			break;
+		}
+		if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0
+				|| setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) < 0) {
+			warn("Could not set a timeout on the connection");
+			close(fd);
+			continue;
+		}
+		serve_request(state, fd);
+		close(fd);
+	}
+	return NULL;
+}
+
+int run_server(const char *socket_path, int num_threads)
+{
+	server_state_t state = { .listen_fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER };
+	struct sockaddr_un addr;
+	pthread_t *threads = NULL;
+	int started = 0;
+	int fd;
+	int i;
+
+	if (!make_address(&addr, socket_path))
+		return 0;
+	if (num_threads == 0 && (num_threads = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		num_threads = 1;
+
+	/* A socket nobody answers on is left over from a server that died */
+	if ((fd = connect_to(socket_path)) >= 0) {
+		close(fd);
+		FAILX("A server is already running on %s", socket_path);
+	}
+	unlink(socket_path);
+
+	ASSERT(varray_init(&state.dbs, sizeof(cached_db_t), 8));
+	state.dbs.destroy_func = cached_db_destroy;
+
+	SYS_ASSERT(state.listen_fd = socket(AF_UNIX, SOCK_STREAM, 0));
+	SYS_ASSERT(bind(state.listen_fd, (struct sockaddr *)&addr, sizeof(addr)));
+	SYS_ASSERT(listen(state.listen_fd, 64));
+
+	/* A client going away mid-reply must not take the server with it */
+	signal(SIGPIPE, SIG_IGN);
+
+	fprintf(stderr, "Listening on %s\n", socket_path);
+
+	/* Each worker accepts and serves its own connections; they only share the DBs and the index */
+	ASSERT(threads = calloc(num_threads, sizeof(*threads)));
+	for (started = 0; started < num_threads; started++) {
+		if (pthread_create(&threads[started], NULL, server_worker, &state) != 0)
+			FAILX("Could not start server worker %d", started + 1);
+	}
+
+failure:
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	release_index(state.index);
+	if (state.dbs.data)
+		varray_destroy(&state.dbs);
+	if (state.listen_fd >= 0) {
+		close(state.listen_fd);
+		unlink(socket_path);
+	}
+	return 0;
+}
+
+/* The server has its own working directory, so paths go to it absolute; the
+ * output need not exist yet, but its directory must */
+static char *absolute_path(const char *path)
+{
+	char *copy, *slash, *dir, *abs;
+	const char *base;
+
+	if ((abs = realpath(path, NULL)) != NULL || errno != ENOENT)
+		return abs;
+
+	if ((copy = strdup(path)) == NULL)
+		return NULL;
+	if ((slash = strrchr(copy, '/')) == NULL) {
+		dir = realpath(".", NULL);
+		base = copy;
+	} else {
+		*slash = '\0';
+		dir = realpath(slash == copy ? "/" : copy, NULL);
+		base = slash + 1;
+	}
+	if (dir != NULL && (abs = malloc(strlen(dir) + strlen(base) + 2)) != NULL)
+		sprintf(abs, "%s/%s", strcmp(dir, "/") == 0 ? "" : dir, base);
+	free(dir);
+	free(copy);
+	return abs;
+}
+
+int forward_to_server(const char *socket_path, const char *input, const char *output,
+		int extra_count, char *extra_paths[], const convert_options_t *options)
+{
+	char **paths = NULL;
+	char flags[16];
+	char *log = NULL, *diag = NULL;
+	uint32_t answer, ok = 0, log_len, diag_len;
+	int count = 0;
+	int fd = -1;
+	int i;
+
+	/* A path that can't be resolved is left for the local conversion to report */
+	if ((paths = calloc(extra_count + 2, sizeof(*paths))) == NULL)
+		return -1;
+	for (count = 0; count < extra_count + 2; count++) {
+		if ((paths[count] = absolute_path(count == 0 ? input : count == 1 ? output : extra_paths[count - 2])) == NULL)
+			goto failure;
+	}
+
+	if ((fd = connect_to(socket_path)) < 0)
+		goto failure;
+
+	signal(SIGPIPE, SIG_IGN);
+
+	if (!write_u32(fd, REQUEST_MAGIC)
+			|| !write_string(fd, VITA_ELF_BUILD_ID, strlen(VITA_ELF_BUILD_ID))
+			|| !read_u32(fd, &answer))
+		FAILX("No answer from the server on %s; converting locally", socket_path);
+	if (answer != REPLY_ACCEPT) {
+		warnx("The server on %s was built from other sources; converting locally", socket_path);
+		goto failure;
+	}
+	encode_options(options, flags);
+	if (!write_u32(fd, REQUEST_FIXED_ARGS + extra_count)
+			|| !write_string(fd, flags, strlen(flags))
+			|| !write_string(fd, input, strlen(input)))
+		FAIL("Could not send the request to %s; converting locally", socket_path);
+	for (i = 0; i < count; i++) {
+		if (!write_string(fd, paths[i], strlen(paths[i])))
+			FAIL("Could not send the request to %s; converting locally", socket_path);
+	}
+
+	/* The verbose log is unbounded, so only the size field limits it */
+	if (!read_u32(fd, &ok)
+			|| (log = read_string(fd, UINT32_MAX - 1, &log_len)) == NULL
+			|| (diag = read_string(fd, UINT32_MAX - 1, &diag_len)) == NULL)
+		FAILX("No reply from the server on %s; converting locally", socket_path);
+
+	fwrite(log, 1, log_len, stdout);
+	fflush(stdout);
+	fwrite(diag, 1, diag_len, stderr);
+
+	free(log);
+	free(diag);
+	free_import_paths(paths, count);
+	close(fd);
+	return ok != 0;
+failure:
+	/* Nothing was converted, so the client can still do it itself */
+	free(log);
+	free(diag);
+	free_import_paths(paths, count);
+	if (fd >= 0)
+		close(fd);
+	return -1;
+}
+
+#endif
@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#if !defined(_WIN32) || defined(__CYGWIN__)
+#include <sys/resource.h>
+#endif
+
+#include "vita-elf-convert.h"
+
+/* Corresponds to the STATS_PHASE_* order */
+static const char *phase_names[STATS_NUM_PHASES] = {
+	"load",
+	"lookup_imports",
+	"dump",
+	"module_info",
+	"copy",
+	"discard_invalid_relocs",
+	"write_module_info",
+	"write_rela_sections",
+	"rewrite_stubs",
+	"write"
+};
+
+static void read_clocks(stats_clock_t *clock)
+{
+	clock_gettime(CLOCK_MONOTONIC, &clock->wall);
+#ifdef CLOCK_THREAD_CPUTIME_ID
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &clock->cpu);
+#else
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &clock->cpu);
+#endif
+}
+
+static double elapsed_ms(const struct timespec *from, const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1e3 + (to->tv_nsec - from->tv_nsec) / 1e6;
+}
+
+void stats_start(stats_clock_t *clock)
+{
+	read_clocks(clock);
+}
+
+void stats_phase(convert_stats_t *stats, int phase, stats_clock_t *clock)
+{
+	stats_clock_t now;
+
+	if (stats == NULL)
+		return;
+
+	read_clocks(&now);
+	stats->wall_ms[phase] += elapsed_ms(&clock->wall, &now.wall);
+	stats->cpu_ms[phase] += elapsed_ms(&clock->cpu, &now.cpu);
+	*clock = now;
+}
+
+long stats_peak_rss(void)
+{
+#if !defined(_WIN32) || defined(__CYGWIN__)
+	struct rusage usage;
+
+	if (getrusage(RUSAGE_SELF, &usage) < 0)
+		return -1;
+#ifdef __APPLE__
+	return usage.ru_maxrss / 1024;	/* Bytes there, KiB everywhere else */
+#else
+	return usage.ru_maxrss;
+#endif
+#else
+	return -1;
+#endif
+}
+
+void stats_print(FILE *fp, const convert_stats_t *stats)
+{
+	double wall = 0, cpu = 0;
+	int i;
+
+	fprintf(fp, "Stats for %s -> %s (%s%s):\n", stats->input, stats->output,
+			stats->ok ? "ok" : "failed", stats->cached ? ", cached" : "");
+	if (stats->cached)
+		return;
+
+	for (i = 0; i < STATS_NUM_PHASES; i++) {
+		fprintf(fp, "  %-24s %10.3f ms wall %10.3f ms cpu\n",
+				phase_names[i], stats->wall_ms[i], stats->cpu_ms[i]);
+		wall += stats->wall_ms[i];
+		cpu += stats->cpu_ms[i];
+	}
+	fprintf(fp, "  %-24s %10.3f ms wall %10.3f ms cpu\n", "total", wall, cpu);
+	fprintf(fp, "  %d symbols, %d relocs, %d function stubs, %d variable stubs, %d modules\n",
+			stats->num_symbols, stats->num_relocs, stats->num_fstubs, stats->num_vstubs, stats->num_modules);
+	fprintf(fp, "  .sce.rel: %d short, %d long, %d bytes\n",
+			stats->rel.num_short, stats->rel.num_long, stats->rel.size);
+}
+
+static void write_json_string(FILE *fp, const char *s)
+{
+	fputc('"', fp);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(fp, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(fp, "\\u%04x", (unsigned char)*s);
+		else
+			fputc(*s, fp);
+	}
+	fputc('"', fp);
+}
+
+void stats_write_json(FILE *fp, const convert_stats_t *stats, int count)
+{
+	const convert_stats_t *st;
+	int i, j;
+
+	fprintf(fp, "{\n  \"peak_rss_kib\": %ld,\n  \"files\": [", stats_peak_rss());
+	for (i = 0, st = stats; i < count; i++, st++) {
+		fprintf(fp, "%s\n    {\n      \"input\": ", i ? "," : "");
+		write_json_string(fp, st->input);
+		fprintf(fp, ",\n      \"output\": ");
+		write_json_string(fp, st->output);
+		fprintf(fp, ",\n      \"ok\": %s,\n      \"cached\": %s,\n      \"phases\": {",
+				st->ok ? "true" : "false", st->cached ? "true" : "false");
+		for (j = 0; j < STATS_NUM_PHASES; j++)
+			fprintf(fp, "%s\n        \"%s\": { \"wall_ms\": %.3f, \"cpu_ms\": %.3f }",
+					j ? "," : "", phase_names[j], st->wall_ms[j], st->cpu_ms[j]);
+		fprintf(fp, "\n      },\n");
+		fprintf(fp, "      \"symbols\": %d,\n      \"relocs\": %d,\n"
+				"      \"function_stubs\": %d,\n      \"variable_stubs\": %d,\n      \"modules\": %d,\n",
+				st->num_symbols, st->num_relocs, st->num_fstubs, st->num_vstubs, st->num_modules);
+		fprintf(fp, "      \"sce_rel\": { \"short\": %d, \"long\": %d, \"size\": %d }\n    }",
+				st->rel.num_short, st->rel.num_long, st->rel.size);
+	}
+	fprintf(fp, "%s]\n}\n", count ? "\n  " : "");
+}
@@ -4,97 +4,18 @@
 #include <string.h>
 
 #include <limits.h>
+#include <getopt.h>
+#include <pthread.h>
 
 #include <libelf.h>
 #include <gelf.h>
 
 #include "vita-elf.h"
 #include "vita-import.h"
-#include "elf-defs.h"
-#include "sce-elf.h"
-#include "elf-utils.h"
 #include "fail-utils.h"
-
-void print_stubs(vita_elf_stub_t *stubs, int num_stubs)
-{
-	int i;
-
-	for (i = 0; i < num_stubs; i++) {
-		printf("  0x%06x (%s):\n", stubs[i].addr, stubs[i].symbol ? stubs[i].symbol->name : "unreferenced stub");
-		printf("    Library: %u (%s)\n", stubs[i].library_nid, stubs[i].library ? stubs[i].library->name : "not found");
-		printf("    Module : %u (%s)\n", stubs[i].module_nid, stubs[i].module ? stubs[i].module->name : "not found");
-		printf("    NID    : %u (%s)\n", stubs[i].target_nid, stubs[i].target ? stubs[i].target->name : "not found");
-	}
-}
-
-const char *get_scn_name(vita_elf_t *ve, Elf_Scn *scn)
-{
-	size_t shstrndx;
-	GElf_Shdr shdr;
-
-	elf_getshdrstrndx(ve->elf, &shstrndx);
-	gelf_getshdr(scn, &shdr);
-	return elf_strptr(ve->elf, shstrndx, shdr.sh_name);
-}
-
-const char *get_scndx_name(vita_elf_t *ve, int scndx)
-{
-	return get_scn_name(ve, elf_getscn(ve->elf, scndx));
-}
-
-void print_rtable(vita_elf_rela_table_t *rtable)
-{
-	vita_elf_rela_t *rela;
-	int num_relas;
-
-	for (num_relas = rtable->num_relas, rela = rtable->relas; num_relas; num_relas--, rela++) {
-		if (rela->symbol) {
-			printf("    offset %06x: type %s, %s%+d\n",
-					rela->offset,
-					elf_decode_r_type(rela->type),
-					rela->symbol->name, rela->addend);
-		} else if (rela->offset) {
-			printf("    offset %06x: type %s, absolute %06x\n",
-					rela->offset,
-					elf_decode_r_type(rela->type),
-					(uint32_t)rela->addend);
-		}
-	}
-}
-
-void list_rels(vita_elf_t *ve)
-{
-	vita_elf_rela_table_t *rtable;
-
-	for (rtable = ve->rela_tables; rtable; rtable = rtable->next) {
-		printf("  Relocations for section %d: %s\n",
-				rtable->target_ndx, get_scndx_name(ve, rtable->target_ndx));
-		print_rtable(rtable);
-
-	}
-}
-
-void list_segments(vita_elf_t *ve)
-{
-	int i;
-
-	for (i = 0; i < ve->num_segments; i++) {
-		printf("  Segment %d: vaddr %06x, size 0x%x\n",
-				i, ve->segments[i].vaddr, ve->segments[i].memsz);
-		if (ve->segments[i].memsz) {
-			printf("    Host address region: %p - %p\n",
-					ve->segments[i].vaddr_top, ve->segments[i].vaddr_bottom);
-			printf("    4 bytes into segment (%p): %x\n",
-					ve->segments[i].vaddr_top + 4, vita_elf_host_to_vaddr(ve, ve->segments[i].vaddr_top + 4));
-			printf("    addr of 8 bytes into segment (%x): %p\n",
-					ve->segments[i].vaddr + 8, vita_elf_vaddr_to_host(ve, ve->segments[i].vaddr + 8));
-			printf("    12 bytes into segment offset (%p): %d\n",
-					ve->segments[i].vaddr_top + 12, vita_elf_host_to_segoffset(ve, ve->segments[i].vaddr_top + 12, i));
-			printf("    addr of 16 bytes into segment (%d): %p\n",
-					16, vita_elf_segoffset_to_host(ve, i, 16));
-		}
-	}
-}
+#include "varray.h"
+#include "vita-elf-create.h"
+#include "vita-elf-cache.h"
 
 #if defined(_WIN32) && !defined(__CYGWIN__)
 #define WIN32_LEAN_AND_MEAN
@@ -139,151 +60,1019 @@ void get_binary_directory(char *out, size_t n)
 
 // The format is path1:path2:path3 where all pathes are relative to the binary directory
 #ifdef DEFAULT_JSON
-char default_json[] = DEFAULT_JSON;
+static const char default_json[] = DEFAULT_JSON;
 #else
-char default_json[] = "";
+static const char default_json[] = "";
 #endif
 
-vita_imports_t **load_imports(int argc, char *argv[], int *imports_count)
+/* The default DBs next to the binary, then the user's, in lookup priority order */
+char **import_paths(int user_count, char *user_paths[], int *paths_count)
 {
-	vita_imports_t **imports = NULL;
-	int user_count = argc - 3;
+	char **paths = NULL;
 	int default_count = 0;
-	int loaded = 0;
+	int filled = 0;
 	char path[PATH_MAX] = { 0 };
+	/* strtok_r writes into the string, so split a copy */
+	char default_paths[sizeof(default_json)];
 	int i;
+	const char *c;
 	char *s;
 	char *saveptr;
 	int count;
 	int base_length;
 
-	for (s = default_json; *s; ++s)
-		if (*s == ':')
+	for (c = default_json; *c; ++c)
+		if (*c == ':')
 			++default_count;
 	// Only way we get 0 is when default_json is empty
 	if (*default_json)
 		++default_count;
 
 	count = user_count + default_count;
-	imports = calloc(count, sizeof(*imports));
-	if (!imports)
-		goto failure;
+	paths = calloc(count + 1, sizeof(*paths));
+	if (!paths)
+		return NULL;
 
-	// First, load default imports
 	get_binary_directory(path, sizeof(path));
 	base_length = strlen(path);
 
-	s = strtok_r(default_json, ":", &saveptr);
+	memcpy(default_paths, default_json, sizeof(default_json));
+	s = strtok_r(default_paths, ":", &saveptr);
 	while (s) {
 		strncpy(path + base_length, s, sizeof(path) - base_length - 1);
-		if ((imports[loaded++] = vita_imports_load(path, 0)) == NULL)
+		if ((paths[filled++] = strdup(path)) == NULL)
 			goto failure;
 		s = strtok_r(NULL, ":", &saveptr);
 	}
 
-	// Load imports specified by the user
 	for (i = 0; i < user_count; i++) {
-		if ((imports[loaded++] = vita_imports_load(argv[i + 3], 0)) == NULL)
+		if ((paths[filled++] = strdup(user_paths[i])) == NULL)
 			goto failure;
 	}
+	*paths_count = count;
+	return paths;
+failure:
+	free_import_paths(paths, count);
+	return NULL;
+}
+
+void free_import_paths(char **paths, int count)
+{
+	int i;
+
+	if (paths == NULL)
+		return;
+	for (i = 0; i < count; i++)
+		free(paths[i]);
+	free(paths);
+}
+
+vita_imports_t **load_imports(int user_count, char *user_paths[], int *imports_count)
+{
+	vita_imports_t **imports = NULL;
+	char **paths;
+	int count;
+	int i;
+
+	if ((paths = import_paths(user_count, user_paths, &count)) == NULL)
+		return NULL;
+
+	imports = calloc(count + 1, sizeof(*imports));
+	if (!imports)
+		goto failure;
+
+	for (i = 0; i < count; i++) {
+		if ((imports[i] = vita_imports_load(paths[i], 0)) == NULL)
+			goto failure;
+	}
+	free_import_paths(paths, count);
 	*imports_count = count;
 	return imports;
 failure:
-	for (i = 0; i < count; ++i)
-		vita_imports_free(imports[i]);
+	if (imports) {
+		for (i = 0; i < count; ++i)
+			vita_imports_free(imports[i]);
+	}
 	free(imports);
+	free_import_paths(paths, count);
 	return NULL;
 }
 
-int main(int argc, char *argv[])
+#ifndef NT_GNU_BUILD_ID
+#define NT_GNU_BUILD_ID 3
+#endif
+
+/* Hex of the GNU build-id note in e, if it has one */
+static int get_build_id(Elf *e, char *hex, size_t size)
+{
+	static const char digits[] = "0123456789abcdef";
+	Elf_Scn *scn;
+	GElf_Shdr shdr;
+	Elf_Data *data;
+	const uint8_t *p, *end, *desc;
+	uint32_t namesz, descsz, type;
+	size_t i;
+
+	scn = NULL;
+	while ((scn = elf_nextscn(e, scn)) != NULL) {
+		if (gelf_getshdr(scn, &shdr) == NULL || shdr.sh_type != SHT_NOTE)
+			continue;
+		if ((data = elf_getdata(scn, NULL)) == NULL || data->d_buf == NULL)
+			continue;
+
+		/* The headers come back in host order; names and descriptors are padded to 4 */
+		p = data->d_buf;
+		end = p + data->d_size;
+		while (end - p >= 12) {
+			memcpy(&namesz, p, 4);
+			memcpy(&descsz, p + 4, 4);
+			memcpy(&type, p + 8, 4);
+			p += 12;
+			if (namesz > end - p || ((namesz + 3) & ~3) + (uint64_t)descsz > end - p)
+				break;
+			desc = p + ((namesz + 3) & ~3);
+			if (type == NT_GNU_BUILD_ID && namesz == 4 && memcmp(p, "GNU", 4) == 0) {
+				if (descsz * 2 + 1 > size)
+					return 0;
+				for (i = 0; i < descsz; i++) {
+					hex[i * 2] = digits[desc[i] >> 4];
+					hex[i * 2 + 1] = digits[desc[i] & 0xf];
+				}
+				hex[descsz * 2] = '\0';
+				return 1;
+			}
+			p = desc + ((descsz + 3) & ~3);
+		}
+	}
+	return 0;
+}
+
+static pthread_mutex_t build_id_map_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Lets a symbolizer get from the output's build-id back to the unstripped input */
+static int record_build_id(const char *map, const char *input, Elf *e)
+{
+	char build_id[256];
+	char path[PATH_MAX];
+	FILE *fp;
+	int ok = 1;
+
+	if (!get_build_id(e, build_id, sizeof(build_id))) {
+		warnx("%s has no build-id; link with --build-id to map it", input);
+		return 1;
+	}
+#ifdef __MINGW32__
+	if (_fullpath(path, input, sizeof(path)) == NULL)
+#else
+	if (realpath(input, path) == NULL)
+#endif
+		snprintf(path, sizeof(path), "%s", input);
+
+	/* Whole lines only, whichever worker gets there first */
+	pthread_mutex_lock(&build_id_map_lock);
+	if ((fp = fopen(map, "a")) == NULL) {
+		warn("Could not open %s", map);
+		ok = 0;
+	} else {
+		fprintf(fp, "%s %s\n", build_id, path);
+		if (fclose(fp) != 0) {
+			warn("Could not write %s", map);
+			ok = 0;
+		}
+	}
+	pthread_mutex_unlock(&build_id_map_lock);
+	return ok;
+}
+
+/* For cache hits, where the input was never loaded; the note is in the output too */
+static int record_build_id_of(const char *map, const char *input, const char *output)
+{
+	FILE *fp;
+	Elf *e;
+	int ok = 0;
+
+	if ((fp = fopen(output, "rb")) == NULL) {
+		warn("Could not open %s", output);
+		return 0;
+	}
+	if ((e = elf_begin(fileno(fp), ELF_C_READ, NULL)) == NULL) {
+		warnx("Could not read %s: %s", output, elf_errmsg(-1));
+	} else {
+		ok = record_build_id(map, input, e);
+		elf_end(e);
+	}
+	fclose(fp);
+	return ok;
+}
+
+static pthread_mutex_t import_manifest_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int push_string(varray *lines, const char *s)
+{
+	return *s == '\0' || varray_push_many(lines, s, strlen(s)) != NULL;
+}
+
+static int format_manifest_stubs(varray *lines, const vita_elf_stub_t *stubs, int num_stubs, const char *kind)
+{
+	char nids[64];
+	int i;
+
+	for (i = 0; i < num_stubs; i++) {
+		snprintf(nids, sizeof(nids), "\t0x%08x 0x%08x %s 0x%08x ",
+				stubs[i].library_nid, stubs[i].module_nid, kind, stubs[i].target_nid);
+		if (!push_string(lines, nids)
+				|| !push_string(lines, stubs[i].library ? stubs[i].library->name : "-")
+				|| !push_string(lines, " ")
+				|| !push_string(lines, stubs[i].module ? stubs[i].module->name : "-")
+				|| !push_string(lines, " ")
+				|| !push_string(lines, stubs[i].target ? stubs[i].target->name : "-")
+				|| !push_string(lines, "\n"))
+			return 0;
+	}
+	return 1;
+}
+
+/* One line per stub into lines, a varray of char; these are also what the cache keeps */
+static int format_imports(varray *lines, const vita_elf_t *ve)
+{
+	if (!format_manifest_stubs(lines, ve->fstubs, ve->num_fstubs, "function")
+			|| !format_manifest_stubs(lines, ve->vstubs, ve->num_vstubs, "variable")) {
+		warnx("Out of memory listing the imports");
+		return 0;
+	}
+	return 1;
+}
+
+/* Appends an "input:" line and then one line per stub, so that a DB change
+ * which touches none of them can be told not to matter to this ELF */
+static int record_imports(const char *manifest, const char *input, const char *lines, size_t size)
+{
+	FILE *fp;
+	int ok = 1;
+
+	/* Whole entries only, whichever worker gets there first */
+	pthread_mutex_lock(&import_manifest_lock);
+	if ((fp = fopen(manifest, "a")) == NULL) {
+		warn("Could not open %s", manifest);
+		ok = 0;
+	} else {
+		fprintf(fp, "%s:\n", input);
+		if (size)
+			fwrite(lines, size, 1, fp);
+		if (fclose(fp) != 0) {
+			warn("Could not write %s", manifest);
+			ok = 0;
+		}
+	}
+	pthread_mutex_unlock(&import_manifest_lock);
+	return ok;
+}
+
+/* Starts the manifest afresh for this run; the conversions append to it */
+static int start_import_manifest(const char *manifest)
+{
+	FILE *fp;
+
+	if ((fp = fopen(manifest, "w")) == NULL) {
+		warn("Could not open %s for writing", manifest);
+		return 0;
+	}
+	fprintf(fp, "# For each input: library NID, module NID, kind, NID, then the library,\n"
+			"# module and symbol names they resolved to, or - where they didn't\n");
+	if (fclose(fp) != 0) {
+		warn("Could not write %s", manifest);
+		return 0;
+	}
+	return 1;
+}
+
+/* With --import-manifest, also leaves the manifest lines for input in imports */
+static int convert_listing(FILE *log, const char *input, const char *name, const char *output,
+		const vita_imports_index_t *imports_index, const create_options_t *options, convert_stats_t *stats,
+		varray *imports)
 {
 	vita_elf_t *ve;
-	vita_imports_t **imports;
-	sce_module_info_t *module_info;
-	sce_section_sizes_t section_sizes;
-	void *encoded_modinfo;
-	vita_elf_rela_table_t rtable = {};
-	int imports_count;
-
-	int status = EXIT_SUCCESS;
-
-	if (argc < 3)
-		errx(EXIT_FAILURE,"Usage: vita-elf-create input-elf output-elf [extra.json ...]");
-
-	if ((ve = vita_elf_load(argv[1])) == NULL)
-		return EXIT_FAILURE;
-
-	if (!(imports = load_imports(argc, argv, &imports_count)))
-		return EXIT_FAILURE;
-
-	if (!vita_elf_lookup_imports(ve, imports, imports_count))
-		status = EXIT_FAILURE;
-
-	if (ve->fstubs_ndx) {
-		printf("Function stubs in section %d:\n", ve->fstubs_ndx);
-		print_stubs(ve->fstubs, ve->num_fstubs);
-	}
-	if (ve->vstubs_ndx) {
-		printf("Variable stubs in section %d:\n", ve->vstubs_ndx);
-		print_stubs(ve->vstubs, ve->num_vstubs);
-	}
-
-	printf("Relocations:\n");
-	list_rels(ve);
-
-	printf("Segments:\n");
-	list_segments(ve);
-
-	module_info = sce_elf_module_info_create(ve);
-
-	int total_size = sce_elf_module_info_get_size(module_info, &section_sizes);
-	int curpos = 0;
-	printf("Total SCE data size: %d / %x\n", total_size, total_size);
-#define PRINTSEC(name) printf("  .%.*s.%s: %d (%x @ %x)\n", (int)strcspn(#name,"_"), #name, strchr(#name,'_')+1, section_sizes.name, section_sizes.name, curpos+ve->segments[0].vaddr+ve->segments[0].memsz); curpos += section_sizes.name
-	PRINTSEC(sceModuleInfo_rodata);
-	PRINTSEC(sceLib_ent);
-	PRINTSEC(sceExport_rodata);
-	PRINTSEC(sceLib_stubs);
-	PRINTSEC(sceImport_rodata);
-	PRINTSEC(sceFNID_rodata);
-	PRINTSEC(sceFStub_rodata);
-	PRINTSEC(sceVNID_rodata);
-	PRINTSEC(sceVStub_rodata);
-
-	strncpy(module_info->name, argv[1], sizeof(module_info->name) - 1);
-
-	encoded_modinfo = sce_elf_module_info_encode(
-			module_info, ve, &section_sizes, &rtable);
-
-	printf("Relocations from encoded modinfo:\n");
-	print_rtable(&rtable);
-
-	FILE *outfile;
-	Elf *dest;
-	ASSERT(dest = elf_utils_copy_to_file(argv[2], ve->elf, &outfile));
-	ASSERT(elf_utils_duplicate_shstrtab(dest));
-	ASSERT(sce_elf_discard_invalid_relocs(ve, ve->rela_tables));
-	ASSERT(sce_elf_write_module_info(dest, ve, &section_sizes, encoded_modinfo));
-	rtable.next = ve->rela_tables;
-	ASSERT(sce_elf_write_rela_sections(dest, ve, &rtable));
-	ASSERT(sce_elf_rewrite_stubs(dest, ve));
-	ELF_ASSERT(elf_update(dest, ELF_C_WRITE) >= 0);
-	elf_end(dest);
-	ASSERT(sce_elf_set_headers(outfile, ve));
-	fclose(outfile);
-
-
-	sce_elf_module_info_free(module_info);
+	void *image = NULL;
+	size_t image_size;
+	FILE *outfile = NULL;
+	Elf *e;
+	stats_clock_t clock;
+	int ok;
+
+	if (stats) {
+		memset(stats, 0, sizeof(*stats));
+		stats->input = input;
+		stats->output = output;
+	}
+	stats_start(&clock);
+
+	ve = vita_elf_load(input, options->convert.strip_debug, options->convert.reloc_threads);
+	stats_phase(stats, STATS_PHASE_LOAD, &clock);
+	if (ve == NULL)
+		return 0;
+
+	ok = vita_elf_convert_loaded(log, ve, name, imports_index, &options->convert, &image, &image_size, stats, &clock);
+	/* Unresolved stubs are recorded too, so that the DB change adding them is seen */
+	if (options->import_manifest && (!format_imports(imports, ve)
+			|| !record_imports(options->import_manifest, input, imports->data, imports->count)))
+		ok = 0;
 	vita_elf_free(ve);
+	/* Written even when imports are missing, which still counts as a failure */
+	if (image == NULL)
+		goto failure;
+
+	if ((outfile = fopen(output, "wb")) == NULL)
+		FAIL("Could not open %s for writing", output);
+	if (fwrite(image, image_size, 1, outfile) != 1)
+		FAIL("Could not write output");
+	if (fclose(outfile) != 0) {
+		outfile = NULL;
+		FAIL("Could not write output");
+	}
+	outfile = NULL;
+	stats_phase(stats, STATS_PHASE_WRITE, &clock);
+
+	/* The note is copied to the output as it is */
+	if (options->build_id_map) {
+		if ((e = elf_memory(image, image_size)) == NULL) {
+			warnx("Could not read %s: %s", output, elf_errmsg(-1));
+			ok = 0;
+		} else {
+			if (!record_build_id(options->build_id_map, input, e))
+				ok = 0;
+			elf_end(e);
+		}
+	}
+
+	goto cleanup;
+failure:
+	ok = 0;
+cleanup:
+	if (outfile)
+		fclose(outfile);
+	free(image);
+	if (stats)
+		stats->ok = ok;
+	return ok;
+}
+
+/* Converts one ELF, naming the module name; returns 0 if anything failed, even when
+ * an output was still written */
+int convert_elf(FILE *log, const char *input, const char *name, const char *output,
+		const vita_imports_index_t *imports_index, const create_options_t *options, convert_stats_t *stats)
+{
+	varray imports;
+	int ok;
+
+	if (varray_init(&imports, 1, 4096) == NULL)
+		return 0;
+	ok = convert_listing(log, input, name, output, imports_index, options, stats, &imports);
+	varray_destroy(&imports);
+	return ok;
+}
+
+/* "-" is stdout */
+static int write_stats_json(const char *path, const convert_stats_t *stats, int count)
+{
+	FILE *fp;
+
+	if (strcmp(path, "-") == 0) {
+		stats_write_json(stdout, stats, count);
+		fflush(stdout);
+		return 1;
+	}
+	if ((fp = fopen(path, "w")) == NULL) {
+		warn("Could not open %s for writing", path);
+		return 0;
+	}
+	stats_write_json(fp, stats, count);
+	if (fclose(fp) != 0) {
+		warn("Could not write %s", path);
+		return 0;
+	}
+	return 1;
+}
+
+static int cache_flags(const convert_options_t *options)
+{
+	return (options->strip_debug ? VITA_ELF_CACHE_FLAG_STRIP_DEBUG : 0)
+		| (options->gc_imports ? VITA_ELF_CACHE_FLAG_GC_IMPORTS : 0);
+}
+
+/* Returns 1 if input's entry was copied to output, or -1 if it was but its
+ * build-id or imports couldn't be recorded, filling in stats (if not NULL) for
+ * a conversion that timed nothing.  With --import-manifest, an entry stored
+ * without its lines can't be used, and misses.  Otherwise, 0: key names the entry to store the
+ * conversion under, or is empty if input can't be cached; a NULL cache never
+ * hits. */
+static int fetch_cached(FILE *log, vita_elf_cache_t *cache, const char *input, const char *output,
+		const create_options_t *options, vita_elf_cache_key_t key, convert_stats_t *stats)
+{
+	char *imports = NULL;
+	size_t imports_size;
+	int ok;
+
+	if (cache == NULL || !vita_elf_cache_key(cache, input, cache_flags(&options->convert), key)) {
+		key[0] = '\0';
+		return 0;
+	}
+	if (!vita_elf_cache_fetch(cache, key, output, options->import_manifest ? &imports : NULL, &imports_size))
+		return 0;
+	if (options->convert.dump)
+		fprintf(log, "%s: cached as %s\n", input, key);
+	ok = !options->build_id_map || record_build_id_of(options->build_id_map, input, output);
+	if (imports && !record_imports(options->import_manifest, input, imports, imports_size))
+		ok = 0;
+	free(imports);
+	if (stats) {
+		memset(stats, 0, sizeof(*stats));
+		stats->input = input;
+		stats->output = output;
+		stats->ok = ok;
+		stats->cached = 1;
+	}
+	return ok ? 1 : -1;
+}
+
+/* Converts after fetch_cached missed, then fills in the entry.  Conversions
+ * with warnings are left out, so that they are seen again next time. */
+static int convert_missed(FILE *log, const char *input, const char *output,
+		const vita_imports_index_t *imports_index, const create_options_t *options,
+		vita_elf_cache_t *cache, const vita_elf_cache_key_t key, convert_stats_t *stats)
+{
+	varray imports;
+	int ok;
+
+	if (varray_init(&imports, 1, 4096) == NULL)
+		return 0;
+	ok = convert_listing(log, input, input, output, imports_index, options, stats, &imports);
+	if (ok && cache != NULL && key[0] != '\0' && vita_elf_cache_store(cache, key, output)
+			&& options->import_manifest)
+		vita_elf_cache_store_imports(cache, key, imports.data, imports.count);
+	varray_destroy(&imports);
+	return ok;
+}
+
+/* With a cache, a hit skips loading and encoding the ELF altogether */
+static int convert_cached(FILE *log, const char *input, const char *output,
+		const vita_imports_index_t *imports_index, const create_options_t *options, vita_elf_cache_t *cache,
+		convert_stats_t *stats)
+{
+	vita_elf_cache_key_t key;
+	int hit;
+
+	if ((hit = fetch_cached(log, cache, input, output, options, key, stats)) != 0)
+		return hit > 0;
+	return convert_missed(log, input, output, imports_index, options, cache, key, stats);
+}
+
+typedef struct {
+	char *input;
+	char *output;
+} batch_job_t;
+
+typedef struct {
+	const batch_job_t *jobs;
+	int num_jobs;
+	const vita_imports_index_t *imports_index;
+	const create_options_t *options;
+	int verbose;
+	vita_elf_cache_t *cache;
+	convert_stats_t *stats;	/* One per job, if wanted */
+	int print_stats;
+	int buffer_logs;
+
+	pthread_mutex_t lock;	/* Guards everything below, and stdout/stderr while a log is flushed */
+	int next_job;
+	int converted;
+	int failed;
+} batch_t;
+
+static void batch_job_free(void *element)
+{
+	batch_job_t *job = element;
+	free(job->input);
+	free(job->output);
+}
+
+/* Escapes what make would otherwise read as a separator, comment or variable */
+static void print_make_path(FILE *fp, const char *path)
+{
+	for (; *path; path++) {
+		if (*path == ' ' || *path == '\t' || *path == '#')
+			fputc('\\', fp);
+		else if (*path == '$')
+			fputc('$', fp);
+		fputc(*path, fp);
+	}
+}
+
+/* A make rule per output on its input and every DB loaded, since any of them
+ * can change how an import resolves; as with -MP, each DB also gets an empty
+ * rule so that removing one doesn't break the build */
+static int write_depfile(const char *depfile, const batch_job_t *jobs, int count, char **db_paths, int db_count)
+{
+	FILE *fp;
+	int i, j;
+
+	if ((fp = fopen(depfile, "w")) == NULL) {
+		warn("Could not open %s for writing", depfile);
+		return 0;
+	}
+	for (i = 0; i < count; i++) {
+		print_make_path(fp, jobs[i].output);
+		fputs(": ", fp);
+		print_make_path(fp, jobs[i].input);
+		for (j = 0; j < db_count; j++) {
+			fputs(" \\\n ", fp);
+			print_make_path(fp, db_paths[j]);
+		}
+		fputs("\n", fp);
+	}
+	for (j = 0; j < db_count; j++) {
+		fputs("\n", fp);
+		print_make_path(fp, db_paths[j]);
+		fputs(":\n", fp);
+	}
+	if (fclose(fp) != 0) {
+		warn("Could not write %s", depfile);
+		return 0;
+	}
+	return 1;
+}
+
+/* Each non-empty line of the manifest is "input-elf output-elf"; '#' starts a comment line */
+static int read_manifest(const char *manifest, varray *jobs)
+{
+	FILE *fp;
+	char line[2 * PATH_MAX + 2];
+	char *input, *output, *saveptr;
+	batch_job_t job;
+	int lineno = 0, ok = 1;
+
+	if ((fp = fopen(manifest, "r")) == NULL) {
+		warn("Could not open %s", manifest);
+		return 0;
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		lineno++;
+		input = strtok_r(line, " \t\r\n", &saveptr);
+		if (input == NULL || input[0] == '#')
+			continue;
+		output = strtok_r(NULL, " \t\r\n", &saveptr);
+		if (output == NULL || strtok_r(NULL, " \t\r\n", &saveptr) != NULL) {
+			warnx("%s:%d: expected \"input-elf output-elf\"", manifest, lineno);
+			ok = 0;
+			continue;
+		}
+		job.input = strdup(input);
+		job.output = strdup(output);
+		if (job.input == NULL || job.output == NULL || varray_push(jobs, &job) == NULL) {
+			batch_job_free(&job);
+			warnx("Out of memory reading %s", manifest);
+			ok = 0;
+			break;
+		}
+	}
+	if (ferror(fp)) {
+		warn("Could not read %s", manifest);
+		ok = 0;
+	}
+	fclose(fp);
+
+	return ok;
+}
+
+/* With several workers, each job's verbose output and diagnostics are held
+ * back and printed in one piece with its status line */
+typedef struct {
+	FILE *fp;
+	char *buf;
+	size_t size;
+} job_stream_t;
+
+static int open_job_stream(job_stream_t *stream)
+{
+#ifdef __MINGW32__
+	stream->fp = tmpfile();
+#else
+	stream->fp = open_memstream(&stream->buf, &stream->size);
+#endif
+	return stream->fp != NULL;
+}
+
+/* open_memstream only fills in buf and size once the stream is closed */
+static void flush_job_stream(job_stream_t *stream, FILE *dest)
+{
+#ifdef __MINGW32__
+	char chunk[4096];
+	size_t n;
+
+	rewind(stream->fp);
+	while ((n = fread(chunk, 1, sizeof(chunk), stream->fp)) > 0)
+		fwrite(chunk, 1, n, dest);
+	fclose(stream->fp);
+#else
+	fclose(stream->fp);
+	fwrite(stream->buf, 1, stream->size, dest);
+	free(stream->buf);
+	stream->buf = NULL;
+#endif
+	stream->fp = NULL;
+	fflush(dest);
+}
+
+static void *batch_worker(void *arg)
+{
+	batch_t *batch = arg;
+	const batch_job_t *job;
+	job_stream_t log = {0}, diag = {0};
+	convert_stats_t *stats;
+	int ok;
 
+	for (;;) {
+		pthread_mutex_lock(&batch->lock);
+		job = batch->next_job < batch->num_jobs ? &batch->jobs[batch->next_job++] : NULL;
+		pthread_mutex_unlock(&batch->lock);
+		if (job == NULL)
+			break;
+
+		if (batch->buffer_logs) {
+			if (!open_job_stream(&log))
+				warn("Could not buffer the log for %s", job->input);
+			/* Warnings name the job as well, in case they cannot be held back */
+			if (open_job_stream(&diag))
+				fail_utils_redirect(diag.fp, job->input);
+			else
+				fail_utils_redirect(stderr, job->input);
+		}
+
+		stats = batch->stats ? &batch->stats[job - batch->jobs] : NULL;
+		ok = convert_cached(log.fp ? log.fp : stdout, job->input, job->output, batch->imports_index,
+				batch->options, batch->cache, stats);
+
+		fail_utils_redirect(NULL, NULL);
+
+		pthread_mutex_lock(&batch->lock);
+		if (log.fp)
+			flush_job_stream(&log, stdout);
+		if (diag.fp)
+			flush_job_stream(&diag, stderr);
+		if (batch->verbose || !ok)
+			fprintf(stderr, "%s -> %s: %s\n", job->input, job->output, ok ? "ok" : "failed");
+		if (stats && batch->print_stats)
+			stats_print(stderr, stats);
+		if (ok)
+			batch->converted++;
+		else
+			batch->failed++;
+		pthread_mutex_unlock(&batch->lock);
+	}
+
+	return NULL;
+}
+
+static int convert_batch(const char *manifest, int num_threads,
+		const vita_imports_index_t *imports_index, const create_options_t *options, int verbose,
+		vita_elf_cache_t *cache, int print_stats, const char *stats_json,
+		const char *depfile, char **db_paths, int db_count)
+{
+	varray jobs;
+	batch_t batch = {};
+	pthread_t *threads = NULL;
+	int started = 0;
+	int ok;
+	int i;
+
+	if (varray_init(&jobs, sizeof(batch_job_t), 16) == NULL)
+		return 0;
+	jobs.destroy_func = batch_job_free;
+
+	ok = read_manifest(manifest, &jobs);
+
+	batch.jobs = jobs.data;
+	batch.num_jobs = jobs.count;
+	batch.imports_index = imports_index;
+	batch.options = options;
+	batch.verbose = verbose;
+	batch.cache = cache;
+	batch.print_stats = print_stats;
+	if ((print_stats || stats_json) && batch.num_jobs
+			&& (batch.stats = calloc(batch.num_jobs, sizeof(convert_stats_t))) == NULL)
+		warnx("Out of memory; no stats will be kept");
+	if (num_threads > batch.num_jobs)
+		num_threads = batch.num_jobs;
+	batch.buffer_logs = num_threads > 1;
+	pthread_mutex_init(&batch.lock, NULL);
+
+	/* The calling thread is always one of the workers */
+	if (num_threads > 1 && (threads = calloc(num_threads - 1, sizeof(pthread_t))) == NULL)
+		num_threads = 1;
+	for (i = 0; i < num_threads - 1; i++) {
+		if (pthread_create(&threads[i], NULL, batch_worker, &batch) != 0) {
+			warnx("Could not start worker thread %d", i + 1);
+			break;
+		}
+		started++;
+	}
+	batch_worker(&batch);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	pthread_mutex_destroy(&batch.lock);
+
+	if (verbose || batch.failed)
+		fprintf(stderr, "%d converted, %d failed\n", batch.converted, batch.failed);
+	if (batch.failed)
+		ok = 0;
+
+	if (print_stats)
+		fprintf(stderr, "Peak RSS: %ld KiB\n", stats_peak_rss());
+	if (stats_json && !write_stats_json(stats_json, batch.stats, batch.stats ? batch.num_jobs : 0))
+		ok = 0;
+	free(batch.stats);
+	if (depfile && !write_depfile(depfile, batch.jobs, batch.num_jobs, db_paths, db_count))
+		ok = 0;
+
+	varray_destroy(&jobs);
+	return ok;
+}
+
+static int parse_dump(const char *list, unsigned *dump)
+{
+	static const struct {
+		const char *name;
+		unsigned flag;
+	} names[] = {
+		{"sizes", DUMP_SIZES},
+		{"stubs", DUMP_STUBS},
+		{"relocs", DUMP_RELOCS},
+		{"segments", DUMP_SEGMENTS},
+		{"all", DUMP_ALL},
+	};
+	size_t len;
+	int i;
+
+	while (*list) {
+		len = strcspn(list, ",");
+		for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+			if (strlen(names[i].name) == len && strncmp(names[i].name, list, len) == 0)
+				break;
+		}
+		if (i == sizeof(names) / sizeof(names[0])) {
+			warnx("Unknown --dump category: %.*s", (int)len, list);
+			return 0;
+		}
+		*dump |= names[i].flag;
+		list += len;
+		if (*list == ',')
+			list++;
+	}
+	return 1;
+}
+
+static const struct option long_options[] = {
+	{"verbose", no_argument, NULL, 'v'},
+	{"dump", required_argument, NULL, 'd'},
+	{"strip-debug", no_argument, NULL, 'g'},
+	{"gc-imports", no_argument, NULL, 'G'},
+	{"build-id-map", required_argument, NULL, 'B'},
+	{"depfile", required_argument, NULL, 'M'},
+	{"import-manifest", required_argument, NULL, 'I'},
+	{"batch", required_argument, NULL, 'b'},
+	{"jobs", required_argument, NULL, 'j'},
+	{"reloc-threads", required_argument, NULL, 'r'},
+	{"server", required_argument, NULL, 's'},
+	{"cache", required_argument, NULL, 'c'},
+	{"cache-size", required_argument, NULL, 'C'},
+	{"stats", no_argument, NULL, 't'},
+	{"stats-json", required_argument, NULL, 'T'},
+	{NULL, 0, NULL, 0}
+};
+
+/* Whether this run goes to the server named by VITA_ELF_CREATE_SOCKET, which it
+ * sets socket_path to.  It converts locally instead:
+ * - when the variable is unset or empty,
+ * - for a batch, which loads the DBs only once anyway,
+ * - with --cache, which the server doesn't look in,
+ * - with --stats or --stats-json, which would time the server's side only,
+ * - with --build-id-map, which the server would have to append to. */
+static int can_forward(const char *manifest, const char *cache_dir, int want_stats, const char *depfile,
+		const create_options_t *options, const char **socket_path)
+{
+	*socket_path = getenv(VITA_ELF_CREATE_SOCKET_ENV);
+	if (*socket_path == NULL || **socket_path == '\0')
+		return 0;
+	if (manifest)
+		return 0;
+	if (cache_dir)
+		return 0;
+	if (want_stats)
+		return 0;
+	if (options->build_id_map)
+		return 0;
+	if (depfile || options->import_manifest)
+		return 0;
+	return 1;
+}
+
+int main(int argc, char *argv[])
+{
+	vita_imports_t **imports = NULL;
+	vita_imports_index_t *imports_index = NULL;
+	const char *manifest = NULL;
+	const char *server_socket = NULL;
+	const char *socket_path;
+	const char *cache_dir = NULL;
+	uint64_t cache_size = 1024;
+	vita_elf_cache_t *cache = NULL;
+	vita_elf_cache_key_t key;
+	char **db_paths = NULL;
+	int db_count = 0;
+	const char *depfile = NULL;
+	batch_job_t job;
+	int user_count;
+	char **user_paths;
+	int print_stats = 0;
+	const char *stats_json = NULL;
+	convert_stats_t stats;
+	int num_threads = 0;	/* Not given */
+	char *end;
+	int imports_count = 0;
+	create_options_t options = {};
+	int verbose = 0;
+	int opt;
+	int ok = 0;
+	int hit;
 	int i;
-	for (i = 0; i < imports_count; i++) {
-		vita_imports_free(imports[i]);
+
+	while ((opt = getopt_long(argc, argv, "+j:v", long_options, NULL)) != -1) {
+		switch (opt) {
+			case 'g':
+				options.convert.strip_debug = 1;
+				break;
+			case 'G':
+				options.convert.gc_imports = 1;
+				break;
+			case 'B':
+				options.build_id_map = optarg;
+				break;
+			case 'M':
+				depfile = optarg;
+				break;
+			case 'I':
+				options.import_manifest = optarg;
+				break;
+			case 'v':
+				verbose++;
+				break;
+			case 'd':
+				if (!parse_dump(optarg, &options.convert.dump))
+					return EXIT_FAILURE;
+				break;
+			case 'b':
+				manifest = optarg;
+				break;
+			case 's':
+				server_socket = optarg;
+				break;
+			case 'c':
+				cache_dir = optarg;
+				break;
+			case 'C':
+				cache_size = strtoull(optarg, &end, 10);
+				if (*end != '\0')
+					errx(EXIT_FAILURE, "Invalid cache size: %s", optarg);
+				break;
+			case 't':
+				print_stats = 1;
+				break;
+			case 'T':
+				stats_json = optarg;
+				break;
+			case 'j':
+				num_threads = strtol(optarg, &end, 10);
+				if (*end != '\0' || num_threads < 1)
+					errx(EXIT_FAILURE, "Invalid job count: %s", optarg);
+				break;
+			case 'r':
+				options.convert.reloc_threads = strtol(optarg, &end, 10);
+				if (*end != '\0' || options.convert.reloc_threads < 1)
+					errx(EXIT_FAILURE, "Invalid thread count: %s", optarg);
+				break;
+			default:
+				return EXIT_FAILURE;
+		}
+	}
+	/* Keep the positional arguments at argv[1] onwards */
+	argc -= optind - 1;
+	argv += optind - 1;
+
+	if (server_socket) {
+		if (elf_version(EV_CURRENT) == EV_NONE)
+			errx(EXIT_FAILURE, "ELF library initialization failed: %s", elf_errmsg(-1));
+		return run_server(server_socket, num_threads) ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	if (!manifest && argc < 3)
+		errx(EXIT_FAILURE,"Usage: vita-elf-create [options] input-elf output-elf [extra.json ...]\n"
+				"       vita-elf-create [options] [-j jobs] --batch manifest [extra.json ...]\n"
+				"       vita-elf-create [-j jobs] --server socket\n"
+				"Options: --cache dir, --cache-size megabytes (default 1024),\n"
+				"         --strip-debug, --build-id-map file (build-id to input, for symbolizing),\n"
+				"         --gc-imports (leave out stubs nothing refers to),\n"
+				"         --depfile file (make rules on the DBs), --import-manifest file (NIDs each ELF imports),\n"
+				"         --reloc-threads n (decode and encode relocations in parallel),\n"
+				"         --stats, --stats-json file (- for stdout),\n"
+				"         -v (sizes and per-file status), -vv (everything),\n"
+				"         --dump sizes,stubs,relocs,segments,all");
+
+	/* Silent apart from warnings unless asked */
+	if (verbose >= 1)
+		options.convert.dump |= DUMP_SIZES;
+	if (verbose >= 2)
+		options.convert.dump |= DUMP_ALL;
+	/* The dumps are many small writes; batch them up, whatever stdout is */
+	if (options.convert.dump)
+		setvbuf(stdout, NULL, _IOFBF, 64 * 1024);
+
+	if (manifest) {
+		user_count = argc - 1;
+		user_paths = argv + 1;
+	} else {
+		user_count = argc - 3;
+		user_paths = argv + 3;
+	}
+
+	/* A running server already has the DBs loaded */
+	if (can_forward(manifest, cache_dir, print_stats || stats_json, depfile, &options, &socket_path)) {
+		ok = forward_to_server(socket_path, argv[1], argv[2], user_count, user_paths, &options.convert);
+		if (ok >= 0)
+			return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	/* Not safe to race on from the workers, so do it before any start */
+	if (elf_version(EV_CURRENT) == EV_NONE)
+		errx(EXIT_FAILURE, "ELF library initialization failed: %s", elf_errmsg(-1));
+
+	if (cache_dir || depfile) {
+		if ((db_paths = import_paths(user_count, user_paths, &db_count)) == NULL)
+			return EXIT_FAILURE;
+	}
+	if (cache_dir && (cache = vita_elf_cache_open(cache_dir, cache_size * 1024 * 1024, db_paths, db_count)) == NULL)
+		warnx("Not using the cache in %s", cache_dir);
+
+	if (options.import_manifest && !start_import_manifest(options.import_manifest))
+		goto cleanup;
+
+	job.input = argv[1];
+	job.output = argv[2];
+
+	/* A single hit doesn't need the DBs at all */
+	if (!manifest && (hit = fetch_cached(stdout, cache, argv[1], argv[2], &options, key, &stats)) != 0) {
+		ok = hit > 0;
+	} else {
+		/* The import DBs are loaded and indexed once, however many ELFs follow */
+		if (!(imports = load_imports(user_count, user_paths, &imports_count)))
+			goto cleanup;
+
+		if (!(imports_index = vita_imports_index_new(imports, imports_count)))
+			goto cleanup;
+
+		if (manifest)
+			ok = convert_batch(manifest, num_threads ? num_threads : 1, imports_index, &options, verbose,
+					cache, print_stats, stats_json, depfile, db_paths, db_count);
+		else
+			ok = convert_missed(stdout, argv[1], argv[2], imports_index, &options, cache, key,
+					print_stats || stats_json ? &stats : NULL);
+	}
+
+	/* A batch reports its own */
+	if (!manifest) {
+		if (print_stats) {
+			stats_print(stderr, &stats);
+			fprintf(stderr, "Peak RSS: %ld KiB\n", stats_peak_rss());
+		}
+		if (stats_json && !write_stats_json(stats_json, &stats, 1))
+			ok = 0;
+		if (depfile && !write_depfile(depfile, &job, 1, db_paths, db_count))
+			ok = 0;
+	}
+
+cleanup:
+	free_import_paths(db_paths, db_count);
+	vita_elf_cache_close(cache, verbose ? stderr : NULL);
+	vita_imports_index_free(imports_index);
+
+	if (imports) {
+		for (i = 0; i < imports_count; i++) {
+			vita_imports_free(imports[i]);
+		}
 	}
 
 	free(imports);
 
-	return status;
-failure:
-	return EXIT_FAILURE;
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
 }
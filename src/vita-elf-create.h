@@ -0,0 +1,46 @@
+#ifndef VITA_ELF_CREATE_H
+#define VITA_ELF_CREATE_H
+
+#include <stdio.h>
+
+#include "vita-import.h"
+#include "vita-elf-convert.h"
+
+/* When set to the socket of a running "vita-elf-create --server", conversions are forwarded to it */
+#define VITA_ELF_CREATE_SOCKET_ENV	"VITA_ELF_CREATE_SOCKET"
+
+/* CMake bakes in a digest of the sources, so that a rebuilt converter can tell
+ * it isn't talking to the one it replaced.  Elsewhere the build time stands in,
+ * which at worst sends a client to convert locally when it needn't. */
+#ifndef VITA_ELF_BUILD_ID
+#define VITA_ELF_BUILD_ID	__DATE__ " " __TIME__
+#endif
+
+/* Returns a malloc'ed list of every DB path to load, defaults first */
+char **import_paths(int user_count, char *user_paths[], int *paths_count);
+void free_import_paths(char **paths, int count);
+
+vita_imports_t **load_imports(int user_count, char *user_paths[], int *imports_count);
+
+/* What vita-elf-create does around the conversion itself, which a server or an
+ * embedder never sees */
+typedef struct {
+	convert_options_t convert;
+	const char *build_id_map;	/* Appended "build-id input" for each converted ELF, if set */
+	const char *import_manifest;	/* Each converted ELF's imported NIDs are appended here, if set */
+} create_options_t;
+
+/* stats may be NULL */
+int convert_elf(FILE *log, const char *input, const char *name, const char *output,
+		const vita_imports_index_t *imports_index, const create_options_t *options, convert_stats_t *stats);
+
+/* Serves conversion requests on socket_path, num_threads at a time (0 for one per
+ * CPU), until killed; only returns on failure */
+int run_server(const char *socket_path, int num_threads);
+
+/* Returns -1 if no server on socket_path did the conversion, including one built from other
+ * sources, which might read the request differently; otherwise whether it succeeded */
+int forward_to_server(const char *socket_path, const char *input, const char *output,
+		int extra_count, char *extra_paths[], const convert_options_t *options);
+
+#endif
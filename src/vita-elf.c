@@ -1,5 +1,9 @@
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <pthread.h>
 
 #include <libelf.h>
 #include <gelf.h>
@@ -28,7 +32,9 @@
 #include "elf-defs.h"
 #include "fail-utils.h"
 #include "endian-utils.h"
+#include "varray.h"
 
+static vita_elf_rela_table_t *rela_table_new(int capacity);
 static void free_rela_table(vita_elf_rela_table_t *rtable);
 
 static int load_stubs(Elf_Scn *scn, int *num_stubs, vita_elf_stub_t **stubs)
@@ -189,95 +195,206 @@ static int get_rel_handling(int type)
 	return REL_HANDLE_INVALID;
 }
 
-static int load_rel_table(vita_elf_t *ve, Elf_Scn *scn)
+/* What decoding one SHT_REL section needs from libelf, fetched on the loading
+ * thread, as libelf can't be called from several threads at once */
+typedef struct {
+	GElf_Shdr shdr;
+	GElf_Shdr text_shdr;
+	Elf_Data *data;
+	Elf_Data *text_data;
+	vita_elf_rela_table_t *rtable;
+	int ok;
+} rel_section_t;
+
+static int prepare_rel_section(vita_elf_t *ve, Elf_Scn *scn, rel_section_t *sec)
 {
 	Elf_Scn *text_scn;
-	GElf_Shdr shdr, text_shdr;
-	Elf_Data *data, *text_data;
-	GElf_Rel rel;
-	int relndx;
-
-	int rel_sym;
-	int handling;
-
-	vita_elf_rela_table_t *rtable = NULL;
-	vita_elf_rela_t *currela = NULL;
-	uint32_t insn, target = 0;
 
-	gelf_getshdr(scn, &shdr);
+	memset(sec, 0, sizeof(*sec));
+	gelf_getshdr(scn, &sec->shdr);
 
-	if (!load_symbols(ve, elf_getscn(ve->elf, shdr.sh_link)))
+	if (!load_symbols(ve, elf_getscn(ve->elf, sec->shdr.sh_link)))
 		goto failure;
 
-	rtable = calloc(1, sizeof(vita_elf_rela_table_t));
-	ASSERT(rtable != NULL);
-	rtable->num_relas = shdr.sh_size / shdr.sh_entsize;
-	rtable->relas = calloc(rtable->num_relas, sizeof(vita_elf_rela_t));
-	ASSERT(rtable->relas != NULL);
+	if (sec->shdr.sh_entsize != sizeof(Elf32_Rel))
+		FAILX("REL section has entries of %d bytes", (int)sec->shdr.sh_entsize);
 
-	rtable->target_ndx = shdr.sh_info;
-	text_scn = elf_getscn(ve->elf, shdr.sh_info);
-	gelf_getshdr(text_scn, &text_shdr);
-	text_data = elf_getdata(text_scn, NULL);
+	text_scn = elf_getscn(ve->elf, sec->shdr.sh_info);
+	gelf_getshdr(text_scn, &sec->text_shdr);
+	sec->text_data = elf_getdata(text_scn, NULL);
 
 	/* We're blatantly assuming here that both of these sections will store
 	 * the entirety of their data in one Elf_Data item.  This seems to be true
 	 * so far in my testing, and from the libelf source it looks like it's
 	 * unlikely to allocate multiple data items on initial file read, but
 	 * should be fixed someday. */
-	data = elf_getdata(scn, NULL);
-	for (relndx = 0; relndx < data->d_size / shdr.sh_entsize; relndx++) {
-		if (gelf_getrel(data, relndx, &rel) != &rel)
-			FAILX("gelf_getrel() failed");
+	ELF_ASSERT(sec->data = elf_getdata(scn, NULL));
+
+	return 1;
+failure:
+	return 0;
+}
 
-		currela = rtable->relas + relndx;
-		currela->type = GELF_R_TYPE(rel.r_info);
+/* Only reads ve, so tables can be decoded side by side */
+static vita_elf_rela_table_t *decode_rel_table(const vita_elf_t *ve, const rel_section_t *sec)
+{
+	const Elf32_Rel *rel;
+	int relndx, num_rels, n = 0;
+
+	uint32_t rel_sym;
+	int type;
+	int handling;
+
+	vita_elf_rela_table_t *rtable = NULL;
+	Elf32_Addr symvalue;
+	Elf32_Sword addend;
+	uint32_t insn, target = 0;
+
+	num_rels = sec->data->d_size / sizeof(Elf32_Rel);
+	ASSERT(rtable = rela_table_new(num_rels));
+	rtable->target_ndx = sec->shdr.sh_info;
+
+	/* libelf has already put the entries in host byte order */
+	for (relndx = 0, rel = sec->data->d_buf; relndx < num_rels; relndx++, rel++) {
+		type = ELF32_R_TYPE(rel->r_info);
 		/* R_ARM_THM_JUMP24 is functionally the same as R_ARM_THM_CALL, however Vita only supports the second one */
-		if (currela->type == R_ARM_THM_JUMP24)
-			currela->type = R_ARM_THM_CALL;
+		if (type == R_ARM_THM_JUMP24)
+			type = R_ARM_THM_CALL;
 		/* This one comes from libstdc++.
 		 * Should be safe to ignore because it's pc-relative and already encoded in the file. */
-		if (currela->type == R_ARM_THM_PC11)
+		if (type == R_ARM_THM_PC11)
 			continue;
-		currela->offset = rel.r_offset;
-
-		insn = le32toh(*((uint32_t*)(text_data->d_buf+(rel.r_offset - text_shdr.sh_addr))));
 
-		handling = get_rel_handling(currela->type);
+		handling = get_rel_handling(type);
 
 		if (handling == REL_HANDLE_IGNORE)
 			continue;
 		else if (handling == REL_HANDLE_INVALID)
-			FAILX("Invalid relocation type %d!", currela->type);
+			FAILX("Invalid relocation type %d!", type);
 
-		rel_sym = GELF_R_SYM(rel.r_info);
+		rel_sym = ELF32_R_SYM(rel->r_info);
 		if (rel_sym >= ve->num_symbols)
-			FAILX("REL entry tried to access symbol %d, but only %d symbols loaded", rel_sym, ve->num_symbols);
+			FAILX("REL entry tried to access symbol %u, but only %d symbols loaded", rel_sym, ve->num_symbols);
+		symvalue = ve->symtab[rel_sym].value;
 
-		currela->symbol = ve->symtab + rel_sym;
-
-		target = decode_rel_target(insn, currela->type, rel.r_offset);
+		insn = le32toh(*((uint32_t*)(sec->text_data->d_buf+(rel->r_offset - sec->text_shdr.sh_addr))));
+		target = decode_rel_target(insn, type, rel->r_offset);
 
 		/* From some testing the added for MOVT/MOVW should actually always be 0 */
-		if (currela->type == R_ARM_MOVT_ABS || currela->type == R_ARM_THM_MOVT_ABS)
-			currela->addend = target - (currela->symbol->value & 0xFFFF0000);
-		else if (currela->type == R_ARM_MOVW_ABS_NC || currela->type == R_ARM_THM_MOVW_ABS_NC)
-			currela->addend = target - (currela->symbol->value & 0xFFFF);
+		if (type == R_ARM_MOVT_ABS || type == R_ARM_THM_MOVT_ABS)
+			addend = target - (symvalue & 0xFFFF0000);
+		else if (type == R_ARM_MOVW_ABS_NC || type == R_ARM_THM_MOVW_ABS_NC)
+			addend = target - (symvalue & 0xFFFF);
 		/* Symbol value could be OR'ed with 1 if the function is compiled in Thumb mode,
 		 * however for the relocation addend we need the actual address. */
-		else if (currela->type == R_ARM_THM_CALL)
-			currela->addend = target - (currela->symbol->value & 0xFFFFFFFE);
+		else if (type == R_ARM_THM_CALL)
+			addend = target - (symvalue & 0xFFFFFFFE);
 		else
-			currela->addend = target - currela->symbol->value;
+			addend = target - symvalue;
+
+		/* Skipped entries leave no holes */
+		rtable->offsets[n] = rel->r_offset;
+		rtable->addends[n] = addend;
+		rtable->symbols[n] = rel_sym;
+		rtable->types[n] = type;
+		n++;
 	}
+	rtable->num_relas = n;
+
+	return rtable;
+failure:
+	free_rela_table(rtable);
+	return NULL;
+}
+
+static int load_rel_table(vita_elf_t *ve, Elf_Scn *scn)
+{
+	rel_section_t sec;
+	vita_elf_rela_table_t *rtable;
+
+	if (!prepare_rel_section(ve, scn, &sec))
+		return 0;
+	if ((rtable = decode_rel_table(ve, &sec)) == NULL)
+		return 0;
 
 	rtable->next = ve->rela_tables;
 	ve->rela_tables = rtable;
-
 	return 1;
-failure:
-	free_rela_table(rtable);
-	return 0;
+}
+
+typedef struct {
+	const vita_elf_t *ve;
+	rel_section_t *sections;
+	int num_sections;
+	pthread_mutex_t lock;
+	int next_section;
+} rel_queue_t;
+
+static void *rel_worker(void *arg)
+{
+	rel_queue_t *queue = arg;
+	rel_section_t *sec;
+	int i;
+
+	for (;;) {
+		pthread_mutex_lock(&queue->lock);
+		i = queue->next_section < queue->num_sections ? queue->next_section++ : -1;
+		pthread_mutex_unlock(&queue->lock);
+		if (i < 0)
+			break;
+
+		sec = queue->sections + i;
+		sec->rtable = decode_rel_table(queue->ve, sec);
+		sec->ok = sec->rtable != NULL;
+	}
+
+	return NULL;
+}
+
+/* Decodes the sections prepare_rel_section set up on num_threads threads,
+ * then chains them up in the order load_rel_table would have */
+static int decode_rel_sections(vita_elf_t *ve, varray *sections, int num_threads)
+{
+	rel_queue_t queue;
+	rel_section_t *sec;
+	pthread_t *threads = NULL;
+	int started = 0;
+	int i, ok = 1;
+
+	queue.ve = ve;
+	queue.sections = sections->data;
+	queue.num_sections = sections->count;
+	queue.next_section = 0;
+	pthread_mutex_init(&queue.lock, NULL);
+
+	if (num_threads > sections->count)
+		num_threads = sections->count;
+	if (num_threads > 1 && (threads = calloc(num_threads - 1, sizeof(pthread_t))) == NULL)
+		num_threads = 1;
+	for (i = 0; i < num_threads - 1; i++) {
+		if (pthread_create(&threads[i], NULL, rel_worker, &queue) != 0) {
+			warnx("Could not start worker thread %d", i + 1);
+			break;
+		}
+		started++;
+	}
+	rel_worker(&queue);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	pthread_mutex_destroy(&queue.lock);
+
+	for (i = 0; i < sections->count; i++) {
+		sec = VARRAY_ELEMENT(sections, i);
+		if (!sec->ok) {
+			ok = 0;
+			continue;
+		}
+		sec->rtable->next = ve->rela_tables;
+		ve->rela_tables = sec->rtable;
+	}
+
+	return ok;
 }
 
 static int load_rela_table(vita_elf_t *ve, Elf_Scn *scn)
@@ -286,11 +403,59 @@ static int load_rela_table(vita_elf_t *ve, Elf_Scn *scn)
 	return 0;
 }
 
+/* Stubs are 16 bytes apart starting at the section address, so the slot can
+ * usually be computed directly; otherwise binary search, as load_stubs keeps
+ * them in address order. */
+static vita_elf_stub_t *find_stub(vita_elf_stub_t *stubs, int num_stubs, Elf32_Addr addr)
+{
+	int lo, hi, mid;
+	Elf32_Addr slot;
+
+	if (num_stubs == 0 || addr < stubs[0].addr)
+		return NULL;
+
+	slot = (addr - stubs[0].addr) / 16;
+	if (slot < num_stubs && stubs[slot].addr == addr)
+		return stubs + slot;
+
+	lo = 0;
+	hi = num_stubs - 1;
+	while (lo <= hi) {
+		mid = lo + (hi - lo) / 2;
+		if (stubs[mid].addr == addr)
+			return stubs + mid;
+		if (stubs[mid].addr < addr)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+
+	return NULL;
+}
+
+/* The stub whose 16 bytes hold addr, if any */
+static vita_elf_stub_t *find_stub_containing(vita_elf_stub_t *stubs, int num_stubs, Elf32_Addr addr)
+{
+	int lo = 0, hi = num_stubs - 1, mid;
+
+	while (lo <= hi) {
+		mid = lo + (hi - lo) / 2;
+		if (addr < stubs[mid].addr)
+			hi = mid - 1;
+		else if (addr - stubs[mid].addr >= 16)
+			lo = mid + 1;
+		else
+			return stubs + mid;
+	}
+
+	return NULL;
+}
+
 static int lookup_stub_symbols(vita_elf_t *ve, int num_stubs, vita_elf_stub_t *stubs, int stubs_ndx, int sym_type)
 {
 	int symndx;
 	vita_elf_symbol_t *cursym;
-	int stub;
+	vita_elf_stub_t *stub;
 
 	for (symndx = 0; symndx < ve->num_symbols; symndx++) {
 		cursym = ve->symtab + symndx;
@@ -306,19 +471,14 @@ static int lookup_stub_symbols(vita_elf_t *ve, int num_stubs, vita_elf_stub_t *s
 			FAILX("Global symbol %s in section %d expected to have type %s; instead has type %s",
 					cursym->name, stubs_ndx, elf_decode_st_type(sym_type), elf_decode_st_type(cursym->type));
 
-		for (stub = 0; stub < num_stubs; stub++) {
-			if (stubs[stub].addr != cursym->value)
-				continue;
-			if (stubs[stub].symbol != NULL)
-				FAILX("Stub at %06x in section %d has duplicate symbols: %s, %s",
-						cursym->value, stubs_ndx, stubs[stub].symbol->name, cursym->name);
-			stubs[stub].symbol = cursym;
-			break;
-		}
-
-		if (stub == num_stubs)
+		stub = find_stub(stubs, num_stubs, cursym->value);
+		if (stub == NULL)
 			FAILX("Global symbol %s in section %d not pointing to a valid stub",
 					cursym->name, cursym->shndx);
+		if (stub->symbol != NULL)
+			FAILX("Stub at %06x in section %d has duplicate symbols: %s, %s",
+					cursym->value, stubs_ndx, stub->symbol->name, cursym->name);
+		stub->symbol = cursym;
 	}
 
 	return 1;
@@ -327,11 +487,201 @@ failure:
 	return 0;
 }
 
+/* A MOVW or MOVT holds only half of the address, so against the stub section's
+ * own symbol the addend alone can't say which stub is meant.  The MOVW's low
+ * half gives the full target when every stub sits in the same 64 KiB; otherwise
+ * all of them are kept.  The MOVT adds nothing its MOVW didn't. */
+static void ref_stubs_by_halves(vita_elf_stub_t *stubs, int num_stubs, int type, Elf32_Addr addr)
+{
+	vita_elf_stub_t *stub;
+	int i;
+
+	if (num_stubs == 0 || type == R_ARM_MOVT_ABS || type == R_ARM_THM_MOVT_ABS)
+		return;
+
+	if ((stubs[0].addr >> 16) == ((stubs[num_stubs - 1].addr + 15) >> 16)) {
+		stub = find_stub_containing(stubs, num_stubs, (stubs[0].addr & 0xFFFF0000) | (addr & 0xFFFF));
+		if (stub)
+			stub->num_refs++;
+		return;
+	}
+
+	for (i = 0; i < num_stubs; i++)
+		stubs[i].num_refs++;
+}
+
+int vita_elf_count_stub_refs(vita_elf_t *ve)
+{
+	const vita_elf_rela_table_t *rtable;
+	const vita_elf_symbol_t *symbol;
+	vita_elf_stub_t *stubs, *stub;
+	Elf32_Addr addr;
+	int i, num_stubs, unreferenced = 0;
+
+	for (i = 0; i < ve->num_fstubs; i++)
+		ve->fstubs[i].num_refs = 0;
+	for (i = 0; i < ve->num_vstubs; i++)
+		ve->vstubs[i].num_refs = 0;
+
+	for (rtable = ve->rela_tables; rtable; rtable = rtable->next) {
+		for (i = 0; i < rtable->num_relas; i++) {
+			if (rtable->types[i] == R_ARM_NONE || (symbol = VITA_ELF_RELA_SYMBOL(ve, rtable, i)) == NULL)
+				continue;
+			if (symbol->shndx == 0 || (symbol->shndx != ve->fstubs_ndx && symbol->shndx != ve->vstubs_ndx))
+				continue;
+
+			if (symbol->shndx == ve->fstubs_ndx) {
+				stubs = ve->fstubs;
+				num_stubs = ve->num_fstubs;
+			} else {
+				stubs = ve->vstubs;
+				num_stubs = ve->num_vstubs;
+			}
+
+			/* Against the section itself the addend says which stub; a stray
+			 * match only keeps a stub that could have gone */
+			if (symbol->type == STT_SECTION) {
+				addr = symbol->value + rtable->addends[i];
+				switch (rtable->types[i]) {
+					case R_ARM_MOVW_ABS_NC:
+					case R_ARM_THM_MOVW_ABS_NC:
+					case R_ARM_MOVT_ABS:
+					case R_ARM_THM_MOVT_ABS:
+						ref_stubs_by_halves(stubs, num_stubs, rtable->types[i], addr);
+						continue;
+				}
+			} else {
+				addr = symbol->value & ~1;
+			}
+
+			if ((stub = find_stub_containing(stubs, num_stubs, addr)) != NULL)
+				stub->num_refs++;
+		}
+	}
+
+	for (i = 0; i < ve->num_fstubs; i++)
+		unreferenced += ve->fstubs[i].num_refs == 0;
+	for (i = 0; i < ve->num_vstubs; i++)
+		unreferenced += ve->vstubs[i].num_refs == 0;
+	return unreferenced;
+}
+
+/* Segment counts are tiny, so insertion sort is all we need here */
+static void build_segment_tables(vita_elf_t *ve)
+{
+	vita_elf_segment_info_t *seg;
+	int i, j, n;
+
+	n = 0;
+	for (i = 0, seg = ve->segments; i < ve->num_segments; i++, seg++) {
+		/* See vita_elf_vaddr_to_segndx for why EXIDX is skipped */
+		if (seg->type == SHT_ARM_EXIDX || seg->memsz == 0)
+			continue;
+		for (j = n; j > 0 && ve->segments[ve->segs_by_vaddr[j - 1]].vaddr > seg->vaddr; j--)
+			ve->segs_by_vaddr[j] = ve->segs_by_vaddr[j - 1];
+		ve->segs_by_vaddr[j] = i;
+		n++;
+	}
+	ve->num_segs_by_vaddr = n;
+
+	ve->segs_overlap = 0;
+	for (i = 1; i < n; i++) {
+		const vita_elf_segment_info_t *prev = ve->segments + ve->segs_by_vaddr[i - 1];
+		if (prev->vaddr + prev->memsz > ve->segments[ve->segs_by_vaddr[i]].vaddr)
+			ve->segs_overlap = 1;
+	}
+
+	n = 0;
+	for (i = 0, seg = ve->segments; i < ve->num_segments; i++, seg++) {
+		if (seg->vaddr_top == NULL)
+			continue;
+		for (j = n; j > 0 && ve->segments[ve->segs_by_host[j - 1]].vaddr_top > seg->vaddr_top; j--)
+			ve->segs_by_host[j] = ve->segs_by_host[j - 1];
+		ve->segs_by_host[j] = i;
+		n++;
+	}
+	ve->num_segs_by_host = n;
+}
+
+/* Maps the input copy-on-write so libelf can hand out pointers into the pages
+ * instead of reading every section into the heap; stub rewriting later writes
+ * through those pointers, which only copies the pages it touches. */
+static void *map_input(const char *filename, size_t *size)
+{
+	int fd;
+	struct stat st;
+	void *map = NULL;
+
+	if ((fd = open(filename, O_RDONLY)) < 0)
+		return NULL;
+
+	if (fstat(fd, &st) < 0 || st.st_size == 0)
+		goto done;
+
+	*size = st.st_size;
+#ifndef __MINGW32__
+	map = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		map = NULL;
+#else
+	if ((map = malloc(*size)) != NULL && read(fd, map, *size) != *size) {
+		free(map);
+		map = NULL;
+	}
+#endif
+
+done:
+	close(fd);
+	return map;
+}
+
+static void free_image(void *image, size_t size, int heap)
+{
+	if (heap)
+		free(image);
+	else
+		munmap(image, size);
+}
+
 const char *debug_sections[] = { ".rel.debug_info", ".rel.debug_arange", ".rel.debug_line", ".rel.debug_frame", NULL };
 
-vita_elf_t *vita_elf_load(const char *filename)
+/* What "strip -g" would remove */
+static int is_debug_section(const char *name)
+{
+	static const char *prefixes[] = { ".debug", ".zdebug", ".stab", ".line", NULL };
+	const char **prefix;
+
+	for (prefix = &prefixes[0]; *prefix; ++prefix)
+		if (strncmp(name, *prefix, strlen(*prefix)) == 0)
+			return 1;
+	return 0;
+}
+
+/* A debug section, or the relocations for one */
+static int is_stripped_section(vita_elf_t *ve, size_t shstrndx, GElf_Shdr *shdr, const char *name)
+{
+	Elf_Scn *target_scn;
+	GElf_Shdr target_shdr;
+	const char *target_name;
+
+	if (is_debug_section(name))
+		return 1;
+	if (shdr->sh_type != SHT_REL && shdr->sh_type != SHT_RELA)
+		return 0;
+	if ((target_scn = elf_getscn(ve->elf, shdr->sh_info)) == NULL || gelf_getshdr(target_scn, &target_shdr) == NULL)
+		return 0;
+	if ((target_name = elf_strptr(ve->elf, shstrndx, target_shdr.sh_name)) == NULL)
+		return 0;
+	return is_debug_section(target_name);
+}
+
+/* Takes over image, which is freed with ve whether or not loading works */
+static vita_elf_t *load_image(const char *filename, void *image, size_t image_size, int image_heap,
+		int strip_debug, int num_threads)
 {
 	vita_elf_t *ve = NULL;
+	varray rel_sections;
+	rel_section_t *sec;
 	GElf_Ehdr ehdr;
 	Elf_Scn *scn;
 	GElf_Shdr shdr;
@@ -341,19 +691,23 @@ vita_elf_t *vita_elf_load(const char *filename)
 
 	GElf_Phdr phdr;
 	size_t segment_count, segndx;
+	size_t section_count;
 	vita_elf_segment_info_t *curseg;
 
-
-	if (elf_version(EV_CURRENT) == EV_NONE)
-		FAILX("ELF library initialization failed: %s", elf_errmsg(-1));
+	/* Only filled when decoding on several threads */
+	if (varray_init(&rel_sections, sizeof(rel_section_t), 16) == NULL)
+		return NULL;
 
 	ve = calloc(1, sizeof(vita_elf_t));
-	ASSERT(ve != NULL);
-
-	if ((ve->file = fopen(filename, "rb")) == NULL)
-		FAIL("open %s failed", filename);
+	if (ve == NULL) {
+		free_image(image, image_size, image_heap);
+		FAILX("Assertion failed: (ve != NULL)");
+	}
+	ve->image = image;
+	ve->image_size = image_size;
+	ve->image_heap = image_heap;
 
-	ELF_ASSERT(ve->elf = elf_begin(fileno(ve->file), ELF_C_READ, NULL));
+	ELF_ASSERT(ve->elf = elf_memory(ve->image, ve->image_size));
 
 	if (elf_kind(ve->elf) != ELF_K_ELF)
 		FAILX("%s is not an ELF file", filename);
@@ -368,6 +722,11 @@ vita_elf_t *vita_elf_load(const char *filename)
 
 	ELF_ASSERT(elf_getshdrstrndx(ve->elf, &shstrndx) == 0);
 
+	if (strip_debug) {
+		ELF_ASSERT(elf_getshdrnum(ve->elf, &section_count) == 0);
+		ASSERT(ve->stripped = calloc(section_count ? section_count : 1, 1));
+	}
+
 	scn = NULL;
 
 	while ((scn = elf_nextscn(ve->elf, scn)) != NULL) {
@@ -375,6 +734,13 @@ vita_elf_t *vita_elf_load(const char *filename)
 
 		ELF_ASSERT(name = elf_strptr(ve->elf, shstrndx, shdr.sh_name));
 
+		/* Left out of the output, so their relocations aren't even decoded */
+		if (strip_debug && is_stripped_section(ve, shstrndx, &shdr, name)) {
+			ve->stripped[elf_ndxscn(scn)] = 1;
+			ve->num_stripped++;
+			continue;
+		}
+
 		if (shdr.sh_type == SHT_PROGBITS && strcmp(name, ".vitalink.fstubs") == 0) {
 			if (ve->fstubs_ndx != 0)
 				FAILX("Multiple .vitalink.fstubs sections in binary");
@@ -391,11 +757,15 @@ vita_elf_t *vita_elf_load(const char *filename)
 
 		for (debug_name = &debug_sections[0]; *debug_name; ++debug_name)
 			if (strcmp(name, *debug_name) == 0)
-				FAILX("Your binary contains debugging information. This is known to cause issues. Please run 'arm-vita-eabi-strip -g homebrew.elf'.");
+				FAILX("Your binary contains debugging information. This is known to cause issues. Please use --strip-debug or run 'arm-vita-eabi-strip -g homebrew.elf'.");
 
 		if (shdr.sh_type == SHT_SYMTAB) {
 			if (!load_symbols(ve, scn))
 				goto failure;
+		} else if (shdr.sh_type == SHT_REL && num_threads > 1) {
+			ASSERT(sec = varray_push(&rel_sections, NULL));
+			if (!prepare_rel_section(ve, scn, sec))
+				goto failure;
 		} else if (shdr.sh_type == SHT_REL) {
 			if (!load_rel_table(ve, scn))
 				goto failure;
@@ -411,6 +781,9 @@ vita_elf_t *vita_elf_load(const char *filename)
 	if (ve->symtab == NULL)
 		FAILX("No symbol table in binary, perhaps stripped out");
 
+	if (rel_sections.count && !decode_rel_sections(ve, &rel_sections, num_threads))
+		goto failure;
+
 	if (ve->rela_tables == NULL)
 		FAILX("No relocation sections in binary; use -Wl,-q while compiling");
 
@@ -444,18 +817,92 @@ vita_elf_t *vita_elf_load(const char *filename)
 		}
 	}
 
+	ve->segs_by_vaddr = calloc(segment_count, sizeof(int));
+	ve->segs_by_host = calloc(segment_count, sizeof(int));
+	ASSERT(ve->segs_by_vaddr != NULL && ve->segs_by_host != NULL);
+	build_segment_tables(ve);
+
+	varray_destroy(&rel_sections);
 	return ve;
 
 failure:
+	varray_destroy(&rel_sections);
 	if (ve != NULL)
 		vita_elf_free(ve);
 	return NULL;
 }
 
+vita_elf_t *vita_elf_load(const char *filename, int strip_debug, int num_threads)
+{
+	void *image;
+	size_t image_size;
+
+	if ((image = map_input(filename, &image_size)) == NULL) {
+		warn("open %s failed", filename);
+		return NULL;
+	}
+#ifndef __MINGW32__
+	return load_image(filename, image, image_size, 0, strip_debug, num_threads);
+#else
+	return load_image(filename, image, image_size, 1, strip_debug, num_threads);
+#endif
+}
+
+vita_elf_t *vita_elf_load_memory(const char *name, const void *data, size_t size, int strip_debug, int num_threads)
+{
+	void *image;
+
+	/* Stub rewriting writes into the image, and the caller's copy is const */
+	if (size == 0 || (image = malloc(size)) == NULL) {
+		warnx("Could not load %s: %s", name, size ? "out of memory" : "empty input");
+		return NULL;
+	}
+	memcpy(image, data, size);
+	return load_image(name, image, size, 1, strip_debug, num_threads);
+}
+
+int vita_elf_rela_table_alloc(vita_elf_rela_table_t *rtable, int capacity)
+{
+	size_t n = capacity > 0 ? capacity : 1;
+	void *block;
+
+	/* The 32-bit arrays first, so every array stays aligned */
+	if ((block = calloc(n, 3 * sizeof(uint32_t) + 3 * sizeof(uint8_t))) == NULL)
+		return 0;
+	rtable->offsets = block;
+	rtable->addends = (Elf32_Sword *)(rtable->offsets + n);
+	rtable->symbols = (uint32_t *)(rtable->addends + n);
+	rtable->types = (uint8_t *)(rtable->symbols + n);
+	rtable->codes2 = rtable->types + n;
+	rtable->dists2 = rtable->codes2 + n;
+	rtable->num_relas = 0;
+	return 1;
+}
+
+void vita_elf_rela_table_release(vita_elf_rela_table_t *rtable)
+{
+	free(rtable->offsets);
+	rtable->offsets = NULL;
+	rtable->num_relas = 0;
+}
+
+static vita_elf_rela_table_t *rela_table_new(int capacity)
+{
+	vita_elf_rela_table_t *rtable;
+
+	if ((rtable = calloc(1, sizeof(*rtable))) == NULL)
+		return NULL;
+	if (!vita_elf_rela_table_alloc(rtable, capacity)) {
+		free(rtable);
+		return NULL;
+	}
+	return rtable;
+}
+
 static void free_rela_table(vita_elf_rela_table_t *rtable)
 {
 	if (rtable == NULL) return;
-	free(rtable->relas);
+	vita_elf_rela_table_release(rtable);
 	free_rela_table(rtable->next);
 	free(rtable);
 }
@@ -464,85 +911,138 @@ void vita_elf_free(vita_elf_t *ve)
 {
 	int i;
 
+	/* memsz may have grown since the reservation was made, so unmap what we mapped */
 	for (i = 0; i < ve->num_segments; i++) {
 		if (ve->segments[i].vaddr_top != NULL)
-			munmap((void *)ve->segments[i].vaddr_top, ve->segments[i].memsz);
+			munmap((void *)ve->segments[i].vaddr_top, ve->segments[i].vaddr_bottom - ve->segments[i].vaddr_top);
 	}
 
+	free(ve->segments);
+	free(ve->stripped);
+	free(ve->segs_by_vaddr);
+	free(ve->segs_by_host);
+	free_rela_table(ve->rela_tables);
+
 	/* free() is safe to call on NULL */
 	free(ve->fstubs);
 	free(ve->vstubs);
 	free(ve->symtab);
 	if (ve->elf != NULL)
 		elf_end(ve->elf);
-	if (ve->file != NULL)
-		fclose(ve->file);
+	/* Only after elf_end, as the Elf points into the image */
+	if (ve->image != NULL)
+		free_image(ve->image, ve->image_size, ve->image_heap);
 	free(ve);
 }
 
-typedef vita_imports_stub_t *(*find_stub_func_ptr)(vita_imports_module_t *, uint32_t);
-static int lookup_stubs(vita_elf_stub_t *stubs, int num_stubs, vita_imports_t **imports, int imports_count, find_stub_func_ptr find_stub, const char *stub_type_name)
+static int lookup_stubs(vita_elf_stub_t *stubs, int num_stubs, const vita_imports_index_t *index, int kind, const char *stub_type_name)
 {
 	int found_all = 1;
-	int i, j;
+	int i;
 	vita_elf_stub_t *stub;
 
 	for (i = 0; i < num_stubs; i++) {
 		stub = &(stubs[i]);
 
-		for (j = 0; j < imports_count; j++) {
-			stub->library = vita_imports_find_lib(imports[j], stub->library_nid);
-			if (stub->library != NULL) {
-				break;
-			}
-		}
+		if (vita_imports_index_find(index, kind, stub->library_nid, stub->module_nid, stub->target_nid,
+					&stub->library, &stub->module, &stub->target))
+			continue;
+
+		found_all = 0;
 
 		if (stub->library == NULL) {
 			warnx("Unable to find library with NID %u for %s symbol %s",
 					stub->library_nid, stub_type_name,
 					stub->symbol ? stub->symbol->name : "(unreferenced stub)");
-			found_all = 0;
-			continue;
-		}
-
-		stub->module = vita_imports_find_module(stub->library, stub->module_nid);
-		if (stub->module == NULL) {
+		} else if (stub->module == NULL) {
 			warnx("Unable to find module with NID %u for %s symbol %s",
 					stub->module_nid, stub_type_name,
 					stub->symbol ? stub->symbol->name : "(unreferenced stub)");
-			found_all = 0;
-			continue;
-		}
-
-		stub->target = find_stub(stub->module, stub->target_nid);
-		if (stub->target == NULL) {
+		} else {
 			warnx("Unable to find %s with NID %u for symbol %s",
 					stub_type_name, stub->module_nid,
 					stub->symbol ? stub->symbol->name : "(unreferenced stub)");
-			found_all = 0;
 		}
 	}
 
 	return found_all;
 }
 
-int vita_elf_lookup_imports(vita_elf_t *ve, vita_imports_t **imports, int imports_count)
+int vita_elf_lookup_imports(vita_elf_t *ve, const vita_imports_index_t *index)
 {
 	int found_all = 1;
 
-	if (!lookup_stubs(ve->fstubs, ve->num_fstubs, imports, imports_count, &vita_imports_find_function, "function"))
+	if (!lookup_stubs(ve->fstubs, ve->num_fstubs, index, VITA_IMPORTS_INDEX_FUNCTION, "function"))
 		found_all = 0;
-	if (!lookup_stubs(ve->vstubs, ve->num_vstubs, imports, imports_count, &vita_imports_find_variable, "variable"))
+	if (!lookup_stubs(ve->vstubs, ve->num_vstubs, index, VITA_IMPORTS_INDEX_VARIABLE, "variable"))
 		found_all = 0;
 
 	return found_all;
 }
 
+/* Returns the loadable segment containing vaddr, preferring non-EXIDX segments */
+static int find_vaddr_segment(const vita_elf_t *ve, Elf32_Addr vaddr)
+{
+	const vita_elf_segment_info_t *seg;
+	int lo, hi, mid, i;
+
+	if (ve->segs_overlap) {
+		for (i = 0, seg = ve->segments; i < ve->num_segments; i++, seg++) {
+			if (seg->type == SHT_ARM_EXIDX)
+				continue;
+			if (vaddr >= seg->vaddr && vaddr < seg->vaddr + seg->memsz)
+				return i;
+		}
+		return -1;
+	}
+
+	lo = 0;
+	hi = ve->num_segs_by_vaddr - 1;
+	while (lo <= hi) {
+		mid = lo + (hi - lo) / 2;
+		seg = ve->segments + ve->segs_by_vaddr[mid];
+		if (vaddr < seg->vaddr)
+			hi = mid - 1;
+		else if (vaddr - seg->vaddr >= seg->memsz)
+			lo = mid + 1;
+		else
+			return ve->segs_by_vaddr[mid];
+	}
+
+	return -1;
+}
+
+static int find_host_segment(const vita_elf_t *ve, const void *host_addr)
+{
+	const vita_elf_segment_info_t *seg;
+	int lo, hi, mid;
+
+	lo = 0;
+	hi = ve->num_segs_by_host - 1;
+	while (lo <= hi) {
+		mid = lo + (hi - lo) / 2;
+		seg = ve->segments + ve->segs_by_host[mid];
+		if (host_addr < seg->vaddr_top)
+			hi = mid - 1;
+		else if (host_addr >= seg->vaddr_bottom)
+			lo = mid + 1;
+		else
+			return ve->segs_by_host[mid];
+	}
+
+	return -1;
+}
+
 const void *vita_elf_vaddr_to_host(const vita_elf_t *ve, Elf32_Addr vaddr)
 {
 	vita_elf_segment_info_t *seg;
 	int i;
 
+	i = find_vaddr_segment(ve, vaddr);
+	if (i >= 0)
+		return ve->segments[i].vaddr_top + vaddr - ve->segments[i].vaddr;
+
+	/* Addresses only covered by an EXIDX segment */
 	for (i = 0, seg = ve->segments; i < ve->num_segments; i++, seg++) {
 		if (vaddr >= seg->vaddr && vaddr < seg->vaddr + seg->memsz)
 			return seg->vaddr_top + vaddr - seg->vaddr;
@@ -568,25 +1068,17 @@ Elf32_Addr vita_elf_host_to_vaddr(const vita_elf_t *ve, const void *host_addr)
 	if (host_addr == NULL)
 		return 0;
 
-	for (i = 0, seg = ve->segments; i < ve->num_segments; i++, seg++) {
-		if (host_addr >= seg->vaddr_top && host_addr < seg->vaddr_bottom)
-			return seg->vaddr + (uint32_t)(host_addr - seg->vaddr_top);
-	}
+	i = find_host_segment(ve, host_addr);
+	if (i < 0)
+		return 0;
 
-	return 0;
+	seg = ve->segments + i;
+	return seg->vaddr + (uint32_t)(host_addr - seg->vaddr_top);
 }
 
 int vita_elf_host_to_segndx(const vita_elf_t *ve, const void *host_addr)
 {
-	vita_elf_segment_info_t *seg;
-	int i;
-
-	for (i = 0, seg = ve->segments; i < ve->num_segments; i++, seg++) {
-		if (host_addr >= seg->vaddr_top && host_addr < seg->vaddr_bottom)
-			return i;
-	}
-
-	return -1;
+	return find_host_segment(ve, host_addr);
 }
 
 int32_t vita_elf_host_to_segoffset(const vita_elf_t *ve, const void *host_addr, int segndx)
@@ -604,19 +1096,9 @@ int32_t vita_elf_host_to_segoffset(const vita_elf_t *ve, const void *host_addr,
 
 int vita_elf_vaddr_to_segndx(const vita_elf_t *ve, Elf32_Addr vaddr)
 {
-	vita_elf_segment_info_t *seg;
-	int i;
-
-	for (i = 0, seg = ve->segments; i < ve->num_segments; i++, seg++) {
-		/* Segments of type EXIDX will duplicate '.ARM.extab .ARM.exidx' sections already present in the data segment
-		 * Since these won't be loaded, we should prefer the actual data segment */
-		if (seg->type == SHT_ARM_EXIDX)
-			continue;
-		if (vaddr >= seg->vaddr && vaddr < seg->vaddr + seg->memsz)
-			return i;
-	}
-
-	return -1;
+	/* Segments of type EXIDX will duplicate '.ARM.extab .ARM.exidx' sections already present in the data segment
+	 * Since these won't be loaded, we should prefer the actual data segment */
+	return find_vaddr_segment(ve, vaddr);
 }
 
 /* vita_elf_vaddr_to_segoffset won't check the validity of the address, it may have been fuzzy-matched */
@@ -629,3 +1111,42 @@ uint32_t vita_elf_vaddr_to_segoffset(const vita_elf_t *ve, Elf32_Addr vaddr, int
 
 	return vaddr - seg->vaddr;
 }
+
+void vita_elf_translate_relas(const vita_elf_t *ve, const vita_elf_rela_table_t *rtable, vita_elf_rela_location_t *locs)
+{
+	const vita_elf_segment_info_t *seg;
+	Elf32_Addr offset, symbase, symvaddr;
+	int i, last = -1;
+
+	/* Relocations in a table usually hit the same segment over and over,
+	 * so try the last match before searching */
+	for (i = 0; i < rtable->num_relas; i++, locs++) {
+		offset = rtable->offsets[i];
+		seg = last >= 0 && !ve->segs_overlap ? ve->segments + last : NULL;
+		if (seg != NULL && offset >= seg->vaddr && offset - seg->vaddr < seg->memsz)
+			locs->datseg = last;
+		else
+			locs->datseg = last = find_vaddr_segment(ve, offset);
+		locs->datoff = locs->datseg >= 0 ? vita_elf_vaddr_to_segoffset(ve, offset, locs->datseg) : 0;
+
+		if (rtable->symbols[i] != VITA_ELF_NO_SYMBOL) {
+			symbase = ve->symtab[rtable->symbols[i]].value;
+			symvaddr = symbase + rtable->addends[i];
+		} else {
+			symbase = rtable->addends[i];
+			symvaddr = rtable->addends[i];
+		}
+		locs->symseg = find_vaddr_segment(ve, symbase);
+		locs->symoff = locs->symseg >= 0 ? vita_elf_vaddr_to_segoffset(ve, symvaddr, locs->symseg) : 0;
+	}
+}
+
+int vita_elf_resize_segment(vita_elf_t *ve, int segndx, Elf32_Word memsz)
+{
+	if (segndx < 0 || segndx >= ve->num_segments)
+		return 0;
+
+	ve->segments[segndx].memsz = memsz;
+	build_segment_tables(ve);
+	return 1;
+}
@@ -16,15 +16,20 @@ typedef struct vita_elf_symbol_t {
 	int shndx;
 } vita_elf_symbol_t;
 
-typedef struct vita_elf_rela_t {
-	uint8_t type;
-	vita_elf_symbol_t *symbol;
-	Elf32_Addr offset;
-	Elf32_Sword addend;
-} vita_elf_rela_t;
+/* Stands in for a symbol index in relocations against an absolute address, held in the addend */
+#define VITA_ELF_NO_SYMBOL	UINT32_MAX
 
+/* Relocations are kept as parallel arrays, num_relas long, which all live in
+ * the one block that offsets points to */
 typedef struct vita_elf_rela_table_t {
-	vita_elf_rela_t *relas;
+	Elf32_Addr *offsets;
+	Elf32_Sword *addends;
+	uint32_t *symbols;	/* Indices into the vita_elf_t's symtab, or VITA_ELF_NO_SYMBOL */
+	uint8_t *types;
+	/* Second relocation applied at offset + dist2 * 2 against the same target,
+	 * set by sce_elf_optimize_relocs; code2 is R_ARM_NONE if unused */
+	uint8_t *codes2;
+	uint8_t *dists2;
 	int num_relas;
 
 	int target_ndx;
@@ -32,6 +37,10 @@ typedef struct vita_elf_rela_table_t {
 	struct vita_elf_rela_table_t *next;
 } vita_elf_rela_table_t;
 
+/* The symbol of entry i, or NULL if it has none */
+#define VITA_ELF_RELA_SYMBOL(ve, rtable, i) \
+	((rtable)->symbols[i] == VITA_ELF_NO_SYMBOL ? NULL : (ve)->symtab + (rtable)->symbols[i])
+
 typedef struct vita_elf_stub_t {
 	Elf32_Addr addr;
 	uint32_t library_nid;
@@ -39,6 +48,7 @@ typedef struct vita_elf_stub_t {
 	uint32_t target_nid;
 
 	vita_elf_symbol_t *symbol;
+	int num_refs;		/* Relocations pointing at the stub, once vita_elf_count_stub_refs ran */
 
 	vita_imports_lib_t *library;
 	vita_imports_module_t *module;
@@ -58,7 +68,9 @@ typedef struct vita_elf_segment_info_t {
 } vita_elf_segment_info_t;
 
 typedef struct vita_elf_t {
-	FILE *file;
+	void *image;		/* Private mapping of the input file backing elf */
+	size_t image_size;
+	int image_heap;		/* image is a malloc'ed copy rather than a mapping */
 	int mode;
 	Elf *elf;
 
@@ -71,6 +83,11 @@ typedef struct vita_elf_t {
 
 	vita_elf_rela_table_t *rela_tables;
 
+	/* With strip_debug, set per section index for the debug sections and their
+	 * relocations, which the output leaves out; NULL otherwise */
+	char *stripped;
+	int num_stripped;
+
 	vita_elf_stub_t *fstubs;
 	vita_elf_stub_t *vstubs;
 	int num_fstubs;
@@ -78,12 +95,40 @@ typedef struct vita_elf_t {
 
 	vita_elf_segment_info_t *segments;
 	int num_segments;
+
+	/* Segment indices sorted by target and host address, for the address
+	 * translation functions below.  EXIDX and empty segments are left out
+	 * of the vaddr table; if the rest overlap, lookups fall back to a scan. */
+	int *segs_by_vaddr;
+	int num_segs_by_vaddr;
+	int segs_overlap;
+	int *segs_by_host;
+	int num_segs_by_host;
 } vita_elf_t;
 
-vita_elf_t *vita_elf_load(const char *filename);
+/* Where a relocation and its target live, as segment index and offset */
+typedef struct vita_elf_rela_location_t {
+	int datseg;		/* -1 when the relocated address is in no segment */
+	Elf32_Word datoff;
+	int symseg;		/* -1 when the target is in no segment */
+	Elf32_Word symoff;
+} vita_elf_rela_location_t;
+
+/* The caller must have set up libelf with elf_version() first.  With num_threads
+ * above 1 the REL sections are decoded side by side; the result is the same. */
+vita_elf_t *vita_elf_load(const char *filename, int strip_debug, int num_threads);
+/* The same for an ELF already in memory, which is copied; name stands in for the filename in messages */
+vita_elf_t *vita_elf_load_memory(const char *name, const void *data, size_t size, int strip_debug, int num_threads);
 void vita_elf_free(vita_elf_t *ve);
+/* Allocates zeroed arrays for up to capacity entries; num_relas starts at 0 */
+int vita_elf_rela_table_alloc(vita_elf_rela_table_t *rtable, int capacity);
+/* Frees only the arrays, for tables that live elsewhere than the heap */
+void vita_elf_rela_table_release(vita_elf_rela_table_t *rtable);
+
+int vita_elf_lookup_imports(vita_elf_t *ve, const vita_imports_index_t *index);
 
-int vita_elf_lookup_imports(vita_elf_t *ve, vita_imports_t **imports, int imports_count);
+/* Fills in num_refs for every stub; returns how many stubs have none */
+int vita_elf_count_stub_refs(vita_elf_t *ve);
 
 const void *vita_elf_vaddr_to_host(const vita_elf_t *ve, Elf32_Addr vaddr);
 const void *vita_elf_segoffset_to_host(const vita_elf_t *ve, int segndx, uint32_t offset);
@@ -95,4 +140,10 @@ int32_t vita_elf_host_to_segoffset(const vita_elf_t *ve, const void *host_addr,
 int vita_elf_vaddr_to_segndx(const vita_elf_t *ve, Elf32_Addr vaddr);
 uint32_t vita_elf_vaddr_to_segoffset(const vita_elf_t *ve, Elf32_Addr vaddr, int segndx);
 
+/* Translates every entry of a single rela table; locs must hold rtable->num_relas entries */
+void vita_elf_translate_relas(const vita_elf_t *ve, const vita_elf_rela_table_t *rtable, vita_elf_rela_location_t *locs);
+
+/* Changes the size of a segment's target address space and updates the lookup tables */
+int vita_elf_resize_segment(vita_elf_t *ve, int segndx, Elf32_Word memsz);
+
 #endif
@@ -0,0 +1,461 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifndef __MINGW32__
+#include <sys/mman.h>
+#endif
+
+#include "vita-import.h"
+#include "endian-utils.h"
+
+/* Compiled import database, as written by vita-nids-compile.
+ *
+ * All fields are little-endian 32-bit words.  The file is a header followed
+ * by three record tables and a string pool; records refer to each other by
+ * table index and to names by offset into the string pool, so the file can
+ * be mapped and used in place.  The tables keep the order of the source
+ * database: each library's modules form a consecutive run of the module
+ * table, and each module's functions followed by its variables form a
+ * consecutive run of the stub table.  The order table holds the lookups:
+ * the library indices in NID order, then for each run of modules, functions
+ * or variables, at the run's own position, its indices in NID order.
+ * Entries with equal NIDs keep table order. */
+
+#define BIN_VERSION	1
+#define BIN_KERNEL	0x1	/* bin_module.flags */
+
+typedef struct {
+	char magic[4];
+	uint32_t version;
+	uint32_t n_libs;
+	uint32_t n_modules;
+	uint32_t n_stubs;
+	uint32_t libs_offset;
+	uint32_t modules_offset;
+	uint32_t stubs_offset;
+	uint32_t order_offset;	/* n_libs + n_modules + n_stubs words */
+	uint32_t strings_offset;
+	uint32_t strings_size;
+} bin_header;
+
+typedef struct {
+	uint32_t name;
+	uint32_t NID;
+	uint32_t first_module;
+	uint32_t n_modules;
+} bin_lib;
+
+typedef struct {
+	uint32_t name;
+	uint32_t NID;
+	uint32_t flags;
+	uint32_t first_stub;
+	uint32_t n_functions;
+	uint32_t n_variables;
+} bin_module;
+
+typedef struct {
+	uint32_t name;
+	uint32_t NID;
+} bin_stub;
+
+static void *map_file(const char *filename, size_t *size)
+{
+	int fd;
+	struct stat st;
+	void *map = NULL;
+
+	if ((fd = open(filename, O_RDONLY)) < 0)
+		return NULL;
+
+	if (fstat(fd, &st) < 0 || st.st_size == 0)
+		goto done;
+
+	*size = st.st_size;
+#ifndef __MINGW32__
+	map = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		map = NULL;
+#else
+	if ((map = malloc(*size)) != NULL && read(fd, map, *size) != *size) {
+		free(map);
+		map = NULL;
+	}
+#endif
+
+done:
+	close(fd);
+	return map;
+}
+
+static void unmap_file(void *map, size_t size)
+{
+#ifndef __MINGW32__
+	munmap(map, size);
+#else
+	free(map);
+#endif
+}
+
+/* Checks that count records of record_size bytes at offset fit in the file */
+static int table_fits(uint32_t offset, uint32_t count, size_t record_size, size_t file_size)
+{
+	return offset <= file_size && count <= (file_size - offset) / record_size;
+}
+
+vita_imports_t *vita_imports_load_binary(const char *filename, int verbose)
+{
+	void *map;
+	size_t map_size;
+	const bin_header *header;
+	const bin_lib *raw_libs;
+	const bin_module *raw_modules;
+	const bin_stub *raw_stubs;
+	const uint32_t *order;
+	const char *strings;
+	uint32_t n_libs, n_modules, n_stubs, strings_size;
+	vita_imports_t *imp = NULL;
+	vita_imports_lib_t *libs;
+	vita_imports_module_t *modules, **module_ptrs;
+	vita_imports_stub_t *stubs, **stub_ptrs;
+	vita_imports_common_fields **lookups;
+	uint32_t i, j;
+
+	if ((map = map_file(filename, &map_size)) == NULL) {
+		fprintf(stderr, "Error: could not map %s\n", filename);
+		return NULL;
+	}
+
+	header = map;
+	if (map_size < sizeof(*header) || memcmp(header->magic, VITA_IMPORTS_BIN_MAGIC, 4) != 0) {
+		fprintf(stderr, "error: %s is not a compiled NID database\n", filename);
+		goto failure;
+	}
+	if (le32toh(header->version) != BIN_VERSION) {
+		fprintf(stderr, "error: %s: unsupported database version %u\n", filename, le32toh(header->version));
+		goto failure;
+	}
+
+	n_libs = le32toh(header->n_libs);
+	n_modules = le32toh(header->n_modules);
+	n_stubs = le32toh(header->n_stubs);
+	strings_size = le32toh(header->strings_size);
+
+	if (!table_fits(le32toh(header->libs_offset), n_libs, sizeof(bin_lib), map_size)
+			|| !table_fits(le32toh(header->modules_offset), n_modules, sizeof(bin_module), map_size)
+			|| !table_fits(le32toh(header->stubs_offset), n_stubs, sizeof(bin_stub), map_size)
+			|| n_modules > UINT32_MAX - n_stubs || n_libs > UINT32_MAX - n_modules - n_stubs
+			|| !table_fits(le32toh(header->order_offset), n_libs + n_modules + n_stubs, sizeof(uint32_t), map_size)
+			|| !table_fits(le32toh(header->strings_offset), strings_size, 1, map_size)
+			|| strings_size == 0) {
+		fprintf(stderr, "error: %s: truncated database\n", filename);
+		goto failure;
+	}
+
+	raw_libs = map + le32toh(header->libs_offset);
+	raw_modules = map + le32toh(header->modules_offset);
+	raw_stubs = map + le32toh(header->stubs_offset);
+	order = map + le32toh(header->order_offset);
+	strings = map + le32toh(header->strings_offset);
+
+	/* Every name offset is checked against the pool, so this makes them all terminated */
+	if (strings[strings_size - 1] != '\0') {
+		fprintf(stderr, "error: %s: corrupt string table\n", filename);
+		goto failure;
+	}
+
+#define NAME(raw) (le32toh((raw)->name) < strings_size ? (char *)strings + le32toh((raw)->name) : NULL)
+/* Fills a lookup from the order table, checking every index lies in the run it sorts */
+#define LOOKUP(lookup, position, first, n, table) do { \
+	(lookup).entries = lookups + (position); \
+	(lookup).count = (n); \
+	for (j = 0; j < (n); j++) { \
+		uint32_t index = le32toh(order[(position) + j]); \
+		if (index < (first) || index - (first) >= (n)) \
+			goto corrupt; \
+		(lookup).entries[j] = (vita_imports_common_fields *)((table) + index); \
+	} \
+} while (0)
+
+	/* The records are laid out like the tables we need, so the whole
+	 * object graph is carved out of one arena allocation */
+	imp = vita_imports_new(0);
+	if (imp == NULL)
+		goto failure;
+	libs = arena_alloc(&imp->arena,
+			n_libs * (sizeof(vita_imports_lib_t) + sizeof(vita_imports_lib_t *))
+			+ n_modules * (sizeof(vita_imports_module_t) + sizeof(vita_imports_module_t *))
+			+ n_stubs * (sizeof(vita_imports_stub_t) + sizeof(vita_imports_stub_t *))
+			+ (n_libs + n_modules + n_stubs) * sizeof(vita_imports_common_fields *));
+	if (libs == NULL)
+		goto failure;
+
+	modules = (vita_imports_module_t *)(libs + n_libs);
+	stubs = (vita_imports_stub_t *)(modules + n_modules);
+	imp->libs = (vita_imports_lib_t **)(stubs + n_stubs);
+	module_ptrs = (vita_imports_module_t **)(imp->libs + n_libs);
+	stub_ptrs = (vita_imports_stub_t **)(module_ptrs + n_modules);
+	lookups = (vita_imports_common_fields **)(stub_ptrs + n_stubs);
+	imp->n_libs = n_libs;
+
+	for (i = 0; i < n_stubs; i++) {
+		stubs[i].name = NAME(raw_stubs + i);
+		stubs[i].NID = le32toh(raw_stubs[i].NID);
+		stub_ptrs[i] = stubs + i;
+		if (stubs[i].name == NULL)
+			goto corrupt;
+	}
+
+	for (i = 0; i < n_modules; i++) {
+		const bin_module *raw = raw_modules + i;
+		uint32_t first_stub = le32toh(raw->first_stub);
+		uint32_t n_functions = le32toh(raw->n_functions), n_variables = le32toh(raw->n_variables);
+
+		if (first_stub > n_stubs || n_functions > n_stubs - first_stub
+				|| n_variables > n_stubs - first_stub - n_functions)
+			goto corrupt;
+
+		modules[i].name = NAME(raw);
+		modules[i].NID = le32toh(raw->NID);
+		modules[i].is_kernel = (le32toh(raw->flags) & BIN_KERNEL) != 0;
+		modules[i].functions = stub_ptrs + first_stub;
+		modules[i].n_functions = n_functions;
+		modules[i].variables = stub_ptrs + first_stub + n_functions;
+		modules[i].n_variables = n_variables;
+		module_ptrs[i] = modules + i;
+		if (modules[i].name == NULL)
+			goto corrupt;
+
+		LOOKUP(modules[i].functions_by_nid, n_libs + n_modules + first_stub, first_stub, n_functions, stubs);
+		LOOKUP(modules[i].variables_by_nid, n_libs + n_modules + first_stub + n_functions,
+				first_stub + n_functions, n_variables, stubs);
+	}
+
+	for (i = 0; i < n_libs; i++) {
+		const bin_lib *raw = raw_libs + i;
+		uint32_t first_module = le32toh(raw->first_module), n_lib_modules = le32toh(raw->n_modules);
+
+		if (first_module > n_modules || n_lib_modules > n_modules - first_module)
+			goto corrupt;
+
+		libs[i].name = NAME(raw);
+		libs[i].NID = le32toh(raw->NID);
+		libs[i].modules = module_ptrs + first_module;
+		libs[i].n_modules = n_lib_modules;
+		imp->libs[i] = libs + i;
+		if (libs[i].name == NULL)
+			goto corrupt;
+
+		LOOKUP(libs[i].modules_by_nid, n_libs + first_module, first_module, n_lib_modules, modules);
+
+		if (verbose) {
+			printf("Lib: %s\n", libs[i].name);
+			for (j = 0; j < n_lib_modules; j++) {
+				vita_imports_module_t *mod = libs[i].modules[j];
+				int k;
+				printf("\tModule: %s\n", mod->name);
+				for (k = 0; k < mod->n_functions; k++)
+					printf("\t\tFunction: %s\n", mod->functions[k]->name);
+				for (k = 0; k < mod->n_variables; k++)
+					printf("\t\tVariable: %s\n", mod->variables[k]->name);
+			}
+		}
+	}
+	LOOKUP(imp->libs_by_nid, 0, 0, n_libs, libs);
+#undef LOOKUP
+#undef NAME
+
+	/* The names stay in the mapping, so it now belongs to imp */
+	imp->mapping = map;
+	imp->mapping_size = map_size;
+
+	return imp;
+
+corrupt:
+	fprintf(stderr, "error: %s: corrupt database\n", filename);
+failure:
+	vita_imports_free(imp);
+	unmap_file(map, map_size);
+	return NULL;
+}
+
+void vita_imports_unmap_binary(vita_imports_t *imp)
+{
+	unmap_file(imp->mapping, imp->mapping_size);
+	imp->mapping = NULL;
+}
+
+typedef struct {
+	uint32_t NID;
+	uint32_t index;
+} order_slot;
+
+static int order_slot_sort(const void *el1, const void *el2)
+{
+	const order_slot *slot1 = el1, *slot2 = el2;
+
+	if (slot1->NID != slot2->NID)
+		return slot1->NID > slot2->NID ? 1 : -1;
+	return slot1->index > slot2->index ? 1 : (slot1->index < slot2->index ? -1 : 0);
+}
+
+/* Sorts the run of count slots at position, so that it lists its indices in NID order */
+static void sort_run(order_slot *slots, uint32_t position, uint32_t count)
+{
+	if (count > 1)
+		qsort(slots + position, count, sizeof(*slots), order_slot_sort);
+}
+
+static uint32_t add_string(char *pool, uint32_t *pool_size, const char *str)
+{
+	uint32_t offset = *pool_size;
+	size_t len = strlen(str) + 1;
+
+	memcpy(pool + offset, str, len);
+	*pool_size += len;
+	return offset;
+}
+
+int vita_imports_save_binary(vita_imports_t *imp, FILE *fp)
+{
+	bin_header header;
+	bin_lib *raw_libs = NULL;
+	bin_module *raw_modules = NULL;
+	bin_stub *raw_stubs = NULL;
+	order_slot *slots = NULL;
+	uint32_t *order = NULL;
+	char *strings = NULL;
+	uint32_t n_libs = 0, n_modules = 0, n_stubs = 0, strings_size = 0;
+	size_t strings_alloc = 1;
+	vita_imports_lib_t *lib;
+	vita_imports_module_t *mod;
+	uint32_t n_slots, n_libs_total, n_modules_total;
+	int i, j, k, ret = 0;
+
+#define EACH_LIB(lib) for (i = 0; i < imp->n_libs; i++) if ((lib = imp->libs[i]) != NULL)
+#define EACH_MODULE(lib, mod) for (j = 0; j < lib->n_modules; j++) if ((mod = lib->modules[j]) != NULL)
+
+	EACH_LIB(lib) {
+		n_libs++;
+		strings_alloc += strlen(lib->name) + 1;
+		EACH_MODULE(lib, mod) {
+			n_modules++;
+			strings_alloc += strlen(mod->name) + 1;
+			for (k = 0; k < mod->n_functions; k++)
+				if (mod->functions[k] != NULL) {
+					n_stubs++;
+					strings_alloc += strlen(mod->functions[k]->name) + 1;
+				}
+			for (k = 0; k < mod->n_variables; k++)
+				if (mod->variables[k] != NULL) {
+					n_stubs++;
+					strings_alloc += strlen(mod->variables[k]->name) + 1;
+				}
+		}
+	}
+
+	raw_libs = calloc(n_libs + 1, sizeof(*raw_libs));
+	raw_modules = calloc(n_modules + 1, sizeof(*raw_modules));
+	raw_stubs = calloc(n_stubs + 1, sizeof(*raw_stubs));
+	n_libs_total = n_libs;
+	n_modules_total = n_modules;
+	n_slots = n_libs + n_modules + n_stubs;
+	slots = calloc(n_slots + 1, sizeof(*slots));
+	order = calloc(n_slots + 1, sizeof(*order));
+	strings = malloc(strings_alloc);
+	if (!raw_libs || !raw_modules || !raw_stubs || !slots || !order || !strings)
+		goto done;
+
+	/* Offset 0 is the empty string */
+	strings[strings_size++] = '\0';
+
+	/* Each slot starts out as its own index and sorts within its run */
+#define SLOT(position, nid, idx) (slots[position].NID = (nid), slots[position].index = (idx))
+	n_libs = n_modules = n_stubs = 0;
+	EACH_LIB(lib) {
+		bin_lib *raw_lib = raw_libs + n_libs++;
+		SLOT(n_libs - 1, lib->NID, n_libs - 1);
+		raw_lib->name = htole32(add_string(strings, &strings_size, lib->name));
+		raw_lib->NID = htole32(lib->NID);
+		raw_lib->first_module = htole32(n_modules);
+
+		EACH_MODULE(lib, mod) {
+			bin_module *raw_mod = raw_modules + n_modules++;
+			uint32_t n_functions = 0, n_variables = 0;
+
+			SLOT(n_libs_total + n_modules - 1, mod->NID, n_modules - 1);
+			raw_mod->name = htole32(add_string(strings, &strings_size, mod->name));
+			raw_mod->NID = htole32(mod->NID);
+			raw_mod->flags = htole32(mod->is_kernel ? BIN_KERNEL : 0);
+			raw_mod->first_stub = htole32(n_stubs);
+
+			for (k = 0; k < mod->n_functions; k++) {
+				if (mod->functions[k] == NULL)
+					continue;
+				raw_stubs[n_stubs].name = htole32(add_string(strings, &strings_size, mod->functions[k]->name));
+				raw_stubs[n_stubs].NID = htole32(mod->functions[k]->NID);
+				SLOT(n_libs_total + n_modules_total + n_stubs, mod->functions[k]->NID, n_stubs);
+				n_stubs++;
+				n_functions++;
+			}
+			for (k = 0; k < mod->n_variables; k++) {
+				if (mod->variables[k] == NULL)
+					continue;
+				raw_stubs[n_stubs].name = htole32(add_string(strings, &strings_size, mod->variables[k]->name));
+				raw_stubs[n_stubs].NID = htole32(mod->variables[k]->NID);
+				SLOT(n_libs_total + n_modules_total + n_stubs, mod->variables[k]->NID, n_stubs);
+				n_stubs++;
+				n_variables++;
+			}
+
+			raw_mod->n_functions = htole32(n_functions);
+			raw_mod->n_variables = htole32(n_variables);
+			sort_run(slots, n_libs_total + n_modules_total + le32toh(raw_mod->first_stub), n_functions);
+			sort_run(slots, n_libs_total + n_modules_total + le32toh(raw_mod->first_stub) + n_functions, n_variables);
+		}
+
+		raw_lib->n_modules = htole32(n_modules - le32toh(raw_lib->first_module));
+		sort_run(slots, n_libs_total + le32toh(raw_lib->first_module), le32toh(raw_lib->n_modules));
+	}
+	sort_run(slots, 0, n_libs);
+	for (i = 0; i < n_slots; i++)
+		order[i] = htole32(slots[i].index);
+#undef SLOT
+#undef EACH_LIB
+#undef EACH_MODULE
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, VITA_IMPORTS_BIN_MAGIC, 4);
+	header.version = htole32(BIN_VERSION);
+	header.n_libs = htole32(n_libs);
+	header.n_modules = htole32(n_modules);
+	header.n_stubs = htole32(n_stubs);
+	header.libs_offset = htole32(sizeof(header));
+	header.modules_offset = htole32(sizeof(header) + n_libs * sizeof(bin_lib));
+	header.stubs_offset = htole32(le32toh(header.modules_offset) + n_modules * sizeof(bin_module));
+	header.order_offset = htole32(le32toh(header.stubs_offset) + n_stubs * sizeof(bin_stub));
+	header.strings_offset = htole32(le32toh(header.order_offset) + n_slots * sizeof(uint32_t));
+	header.strings_size = htole32(strings_size);
+
+	if (fwrite(&header, sizeof(header), 1, fp) != 1
+			|| fwrite(raw_libs, sizeof(bin_lib), n_libs, fp) != n_libs
+			|| fwrite(raw_modules, sizeof(bin_module), n_modules, fp) != n_modules
+			|| fwrite(raw_stubs, sizeof(bin_stub), n_stubs, fp) != n_stubs
+			|| fwrite(order, sizeof(uint32_t), n_slots, fp) != n_slots
+			|| fwrite(strings, 1, strings_size, fp) != strings_size)
+		goto done;
+
+	ret = 1;
+done:
+	free(raw_libs);
+	free(raw_modules);
+	free(raw_stubs);
+	free(slots);
+	free(order);
+	free(strings);
+	return ret;
+}
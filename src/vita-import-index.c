@@ -0,0 +1,226 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "vita-import.h"
+#include "fail-utils.h"
+
+static int index_key_compar(const vita_imports_index_entry_t *entry1, const vita_imports_index_entry_t *entry2)
+{
+#define CMP_FIELD(field) do { \
+	if (entry1->field > entry2->field) \
+		return 1; \
+	else if (entry1->field < entry2->field) \
+		return -1; \
+} while (0)
+	CMP_FIELD(library_nid);
+	CMP_FIELD(module_nid);
+	CMP_FIELD(kind);
+	CMP_FIELD(target_nid);
+#undef CMP_FIELD
+	return 0;
+}
+
+static int index_sort(const void *el1, const void *el2)
+{
+	const vita_imports_index_entry_t *entry1 = el1, *entry2 = el2;
+	int result = index_key_compar(entry1, entry2);
+
+	if (result != 0)
+		return result;
+
+	/* Equal keys keep the order the databases were given in, so the first one wins */
+	if (entry1->priority > entry2->priority)
+		return 1;
+	else if (entry1->priority < entry2->priority)
+		return -1;
+	return 0;
+}
+
+static const char *entry_name(const vita_imports_index_entry_t *entry)
+{
+	return entry->kind == VITA_IMPORTS_INDEX_MODULE ? entry->module->name : entry->target->name;
+}
+
+static const char *kind_name(int kind)
+{
+	switch (kind) {
+		case VITA_IMPORTS_INDEX_MODULE: return "module";
+		case VITA_IMPORTS_INDEX_FUNCTION: return "function";
+		case VITA_IMPORTS_INDEX_VARIABLE: return "variable";
+	}
+	return "entry";
+}
+
+static int add_entries(vita_imports_index_entry_t *entry, vita_imports_lib_t *lib, vita_imports_module_t *mod,
+		vita_imports_stub_t **stubs, int n_stubs, int kind, int *priority)
+{
+	int i, count = 0;
+
+	for (i = 0; i < n_stubs; i++) {
+		if (stubs[i] == NULL)
+			continue;
+
+		entry->library_nid = lib->NID;
+		entry->module_nid = mod->NID;
+		entry->kind = kind;
+		entry->target_nid = stubs[i]->NID;
+		entry->priority = (*priority)++;
+		entry->library = lib;
+		entry->module = mod;
+		entry->target = stubs[i];
+		entry++;
+		count++;
+	}
+
+	return count;
+}
+
+vita_imports_index_t *vita_imports_index_new(vita_imports_t **imports, int imports_count)
+{
+	vita_imports_index_t *index;
+	vita_imports_index_entry_t *entry, *prev_entry;
+	int n_entries = 0, priority = 0;
+	int h, i, j, k;
+
+	for (h = 0; h < imports_count; h++) {
+		for (i = 0; i < imports[h]->n_libs; i++) {
+			vita_imports_lib_t *lib = imports[h]->libs[i];
+			if (lib == NULL)
+				continue;
+			for (j = 0; j < lib->n_modules; j++) {
+				vita_imports_module_t *mod = lib->modules[j];
+				if (mod == NULL)
+					continue;
+				n_entries += 1 + mod->n_functions + mod->n_variables;
+			}
+		}
+	}
+
+	index = calloc(1, sizeof(*index));
+	if (index == NULL)
+		return NULL;
+
+	index->entries = calloc(n_entries ? n_entries : 1, sizeof(*index->entries));
+	if (index->entries == NULL) {
+		free(index);
+		return NULL;
+	}
+
+	entry = index->entries;
+	for (h = 0; h < imports_count; h++) {
+		for (i = 0; i < imports[h]->n_libs; i++) {
+			vita_imports_lib_t *lib = imports[h]->libs[i];
+			if (lib == NULL)
+				continue;
+			for (j = 0; j < lib->n_modules; j++) {
+				vita_imports_module_t *mod = lib->modules[j];
+				if (mod == NULL)
+					continue;
+
+				/* A placeholder for the module itself, so a lookup can tell a
+				 * missing module apart from a missing function or variable */
+				entry->library_nid = lib->NID;
+				entry->module_nid = mod->NID;
+				entry->kind = VITA_IMPORTS_INDEX_MODULE;
+				entry->target_nid = 0;
+				entry->priority = priority++;
+				entry->library = lib;
+				entry->module = mod;
+				entry++;
+
+				entry += add_entries(entry, lib, mod, mod->functions, mod->n_functions, VITA_IMPORTS_INDEX_FUNCTION, &priority);
+				entry += add_entries(entry, lib, mod, mod->variables, mod->n_variables, VITA_IMPORTS_INDEX_VARIABLE, &priority);
+			}
+		}
+	}
+	n_entries = entry - index->entries;
+
+	qsort(index->entries, n_entries, sizeof(*index->entries), index_sort);
+
+	/* Drop the lower-priority duplicates, complaining once about any that disagree */
+	prev_entry = NULL;
+	entry = index->entries;
+	for (k = 0; k < n_entries; k++) {
+		vita_imports_index_entry_t *cur = index->entries + k;
+
+		if (prev_entry != NULL && index_key_compar(prev_entry, cur) == 0) {
+			const char *prev_name = entry_name(prev_entry), *cur_name = entry_name(cur);
+			if (strcmp(prev_name, cur_name) != 0)
+				warnx("NID conflict: %s %s and %s in library %s both have NID 0x%08X; using %s",
+						kind_name(cur->kind), prev_name, cur_name, prev_entry->library->name,
+						cur->kind == VITA_IMPORTS_INDEX_MODULE ? cur->module_nid : cur->target_nid, prev_name);
+			continue;
+		}
+
+		*entry = *cur;
+		prev_entry = entry;
+		entry++;
+	}
+	index->n_entries = entry - index->entries;
+
+	return index;
+}
+
+void vita_imports_index_free(vita_imports_index_t *index)
+{
+	if (index) {
+		free(index->entries);
+		free(index);
+	}
+}
+
+int vita_imports_index_find(const vita_imports_index_t *index, int kind,
+		uint32_t library_nid, uint32_t module_nid, uint32_t target_nid,
+		vita_imports_lib_t **library, vita_imports_module_t **module, vita_imports_stub_t **target)
+{
+	vita_imports_index_entry_t key;
+	const vita_imports_index_entry_t *entry;
+	int low_idx = 0, high_idx = index->n_entries;
+
+	key.library_nid = library_nid;
+	key.module_nid = module_nid;
+	key.kind = kind;
+	key.target_nid = target_nid;
+
+	*library = NULL;
+	*module = NULL;
+	*target = NULL;
+
+	while (low_idx < high_idx) {
+		int test_idx = (low_idx + high_idx) / 2;
+
+		if (index_key_compar(index->entries + test_idx, &key) < 0)
+			low_idx = test_idx + 1;
+		else
+			high_idx = test_idx;
+	}
+
+	if (low_idx < index->n_entries) {
+		entry = index->entries + low_idx;
+		if (index_key_compar(entry, &key) == 0) {
+			*library = entry->library;
+			*module = entry->module;
+			*target = entry->target;
+			return 1;
+		}
+	}
+
+	/* Not found, so report how far we got.  The module placeholder sorts before
+	 * every function and variable of its module, so if the module exists then
+	 * the entry just before the insertion point belongs to it. */
+	if (low_idx > 0) {
+		entry = index->entries + low_idx - 1;
+		if (entry->library_nid == library_nid) {
+			*library = entry->library;
+			if (entry->module_nid == module_nid)
+				*module = entry->module;
+		}
+	}
+	if (*library == NULL && low_idx < index->n_entries) {
+		entry = index->entries + low_idx;
+		if (entry->library_nid == library_nid)
+			*library = entry->library;
+	}
+
+	return 0;
+}
@@ -1,175 +1,763 @@
+#include <ctype.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
-#include <jansson.h>
 #include "vita-import.h"
+#include "varray.h"
 
-vita_imports_t *vita_imports_load(const char *filename, int verbose)
+/* A streaming reader for the JSON NID database.  Libraries, modules and stubs
+ * are built directly while the text is tokenized, so we never hold a DOM of
+ * the file next to the vita_imports_t graph.  Only the children of the
+ * objects currently open are kept in temporary arrays. */
+
+typedef struct {
+	FILE *fp;
+	int c;		/* Lookahead character, EOF at end of input */
+	int line;
+	int verbose;
+
+	/* Text of the token being read, for error messages */
+	char token[64];
+	int token_len;
+
+	vita_imports_t *imp;
+
+	/* Last string read; keys are only valid until the next string */
+	char *str;
+	size_t str_len;
+	size_t str_size;
+
+	varray libs;
+	varray modules;
+	varray functions;
+	varray variables;
+} json_stream;
+
+/* Outcome of reading an integer or boolean where the database wants one */
+enum { VALUE_OK, VALUE_WRONG_TYPE, VALUE_FAILED };
+
+static void next_char(json_stream *js)
 {
-	FILE *fp = fopen(filename, "r");
-	if (fp == NULL) {
-		fprintf(stderr, "Error: could not open %s\n", filename);
-		return NULL;
+	if (js->c == '\n')
+		js->line++;
+	if (js->c != EOF && js->token_len < (int)sizeof(js->token) - 1)
+		js->token[js->token_len++] = js->c;
+	js->c = getc(js->fp);
+}
+
+static void skip_whitespace(json_stream *js)
+{
+	while (js->c == ' ' || js->c == '\t' || js->c == '\n' || js->c == '\r')
+		next_char(js);
+	js->token_len = 0;
+}
+
+/* Reads the rest of the token starting at the lookahead, only to show it */
+static void scan_token(json_stream *js)
+{
+	if (js->c == '"') {
+		do {
+			if (js->c == '\\')
+				next_char(js);
+			next_char(js);
+		} while (js->c != '"' && js->c != '\n' && js->c != EOF);
+		if (js->c == '"')
+			next_char(js);
+	} else if (isalpha(js->c)) {
+		while (isalpha(js->c))
+			next_char(js);
+	} else if (isdigit(js->c) || js->c == '-') {
+		do {
+			next_char(js);
+		} while (isdigit(js->c) || js->c == '.' || js->c == 'e' || js->c == 'E' || js->c == '+' || js->c == '-');
+	} else if (js->c != EOF) {
+		next_char(js);
 	}
-	vita_imports_t *imports = vita_imports_loads(fp, verbose);
+}
 
-	fclose(fp);
+static int syntax_error(json_stream *js, const char *fmt, ...)
+{
+	va_list ap;
+	int line = js->line;
+
+	/* Quote the whole token like jansson did: the one the error is in, or
+	 * the one that starts at the lookahead */
+	if (js->token_len == 0)
+		scan_token(js);
+	else if (js->c >= 0x20 && strchr("{}[],:", js->c) == NULL)
+		next_char(js);
+	js->token[js->token_len] = '\0';
+
+	fprintf(stderr, "error: on line %d: ", line);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	if (js->token_len == 0)
+		fprintf(stderr, " near end of file\n");
+	else
+		fprintf(stderr, " near '%s'\n", js->token);
+	return 0;
+}
 
-	return imports;
+static int expect_char(json_stream *js, int c)
+{
+	skip_whitespace(js);
+	if (js->c != c)
+		return syntax_error(js, "'%c' expected", c);
+	next_char(js);
+	return 1;
 }
 
-vita_imports_t *vita_imports_loads(FILE *text, int verbose)
+static int append_char(json_stream *js, int c)
 {
-	json_t *libs, *lib_data;
-	json_error_t error;
-	const char *lib_name, *mod_name, *target_name;
+	if (js->str_len + 1 >= js->str_size) {
+		size_t new_size = js->str_size ? js->str_size * 2 : 256;
+		char *new_str = realloc(js->str, new_size);
+		if (new_str == NULL) {
+			fprintf(stderr, "error: out of memory\n");
+			return 0;
+		}
+		js->str = new_str;
+		js->str_size = new_size;
+	}
+	js->str[js->str_len++] = c;
+	js->str[js->str_len] = '\0';
+	return 1;
+}
 
-	libs = json_loadf(text, 0, &error);
-	if (libs == NULL) {
-		fprintf(stderr, "error: on line %d: %s\n", error.line, error.text);
-		return NULL;
+static int append_utf8(json_stream *js, uint32_t cp)
+{
+	if (cp < 0x80)
+		return append_char(js, cp);
+	if (cp < 0x800)
+		return append_char(js, 0xC0 | (cp >> 6))
+			&& append_char(js, 0x80 | (cp & 0x3F));
+	if (cp < 0x10000)
+		return append_char(js, 0xE0 | (cp >> 12))
+			&& append_char(js, 0x80 | ((cp >> 6) & 0x3F))
+			&& append_char(js, 0x80 | (cp & 0x3F));
+	return append_char(js, 0xF0 | (cp >> 18))
+		&& append_char(js, 0x80 | ((cp >> 12) & 0x3F))
+		&& append_char(js, 0x80 | ((cp >> 6) & 0x3F))
+		&& append_char(js, 0x80 | (cp & 0x3F));
+}
+
+static int read_hex4(json_stream *js, uint32_t *value)
+{
+	int i;
+
+	*value = 0;
+	for (i = 0; i < 4; i++) {
+		next_char(js);
+		if (js->c >= '0' && js->c <= '9')
+			*value = (*value << 4) | (js->c - '0');
+		else if (js->c >= 'a' && js->c <= 'f')
+			*value = (*value << 4) | (js->c - 'a' + 10);
+		else if (js->c >= 'A' && js->c <= 'F')
+			*value = (*value << 4) | (js->c - 'A' + 10);
+		else
+			return syntax_error(js, "invalid escape");
 	}
+	return 1;
+}
 
-	if (!json_is_object(libs)) {
-		fprintf(stderr, "error: modules is not an object\n");
-		json_decref(libs);
+/* Reads a string into js->str; the lookahead must be the opening quote */
+static int read_string(json_stream *js)
+{
+	uint32_t cp, low;
+
+	js->str_len = 0;
+	if (!append_char(js, '\0'))
+		return 0;
+	js->str_len = 0;
+
+	next_char(js);
+	while (js->c != '"') {
+		if (js->c == EOF)
+			return syntax_error(js, "premature end of input");
+		if (js->c < 0x20 && js->c >= 0)
+			return syntax_error(js, "control character in string");
+
+		if (js->c != '\\') {
+			if (!append_char(js, js->c))
+				return 0;
+			next_char(js);
+			continue;
+		}
+
+		next_char(js);
+		switch (js->c) {
+			case '"': case '\\': case '/':
+				if (!append_char(js, js->c)) return 0;
+				break;
+			case 'b': if (!append_char(js, '\b')) return 0; break;
+			case 'f': if (!append_char(js, '\f')) return 0; break;
+			case 'n': if (!append_char(js, '\n')) return 0; break;
+			case 'r': if (!append_char(js, '\r')) return 0; break;
+			case 't': if (!append_char(js, '\t')) return 0; break;
+			case 'u':
+				if (!read_hex4(js, &cp))
+					return 0;
+				if (cp >= 0xD800 && cp < 0xDC00) {
+					/* High surrogate, must be followed by the low half */
+					next_char(js);
+					if (js->c != '\\')
+						return syntax_error(js, "invalid Unicode surrogate pair");
+					next_char(js);
+					if (js->c != 'u' || !read_hex4(js, &low) || low < 0xDC00 || low >= 0xE000)
+						return syntax_error(js, "invalid Unicode surrogate pair");
+					cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+				} else if (cp >= 0xDC00 && cp < 0xE000) {
+					return syntax_error(js, "invalid Unicode surrogate pair");
+				}
+				if (cp == 0)
+					return syntax_error(js, "\\u0000 is not allowed");
+				if (!append_utf8(js, cp))
+					return 0;
+				break;
+			default:
+				return syntax_error(js, "invalid escape");
+		}
+		next_char(js);
+	}
+	next_char(js);
+
+	return 1;
+}
+
+static int read_literal(json_stream *js, const char *literal)
+{
+	const char *p;
+
+	for (p = literal; *p || isalpha(js->c); p++) {
+		if (js->c != *p) {
+			while (isalpha(js->c))
+				next_char(js);
+			return syntax_error(js, "invalid token");
+		}
+		next_char(js);
+	}
+	return 1;
+}
+
+/* Reads a number; *is_integer is cleared for anything with a fraction or exponent */
+static int read_number(json_stream *js, long long *value, int *is_integer)
+{
+	unsigned long long magnitude = 0;
+	int negative = 0, digits = 0;
+
+	*is_integer = 1;
+
+	if (js->c == '-') {
+		negative = 1;
+		next_char(js);
+	}
+
+	while (js->c >= '0' && js->c <= '9') {
+		if (digits == 1 && magnitude == 0)
+			return syntax_error(js, "invalid number");
+		if (magnitude > (ULLONG_MAX - (js->c - '0')) / 10)
+			return syntax_error(js, "too big integer");
+		magnitude = magnitude * 10 + (js->c - '0');
+		digits++;
+		next_char(js);
+	}
+	if (digits == 0)
+		return syntax_error(js, "invalid number");
+
+	if (js->c == '.') {
+		*is_integer = 0;
+		next_char(js);
+		if (js->c < '0' || js->c > '9')
+			return syntax_error(js, "invalid number");
+		while (js->c >= '0' && js->c <= '9')
+			next_char(js);
+	}
+
+	if (js->c == 'e' || js->c == 'E') {
+		*is_integer = 0;
+		next_char(js);
+		if (js->c == '+' || js->c == '-')
+			next_char(js);
+		if (js->c < '0' || js->c > '9')
+			return syntax_error(js, "invalid number");
+		while (js->c >= '0' && js->c <= '9')
+			next_char(js);
+	}
+
+	if (*is_integer) {
+		if (magnitude > (negative ? (unsigned long long)LLONG_MAX + 1 : (unsigned long long)LLONG_MAX))
+			return syntax_error(js, "too big integer");
+		*value = negative ? (long long)(0 - magnitude) : (long long)magnitude;
+	}
+
+	return 1;
+}
+
+/* Steps through an object: start with *n_members zeroed and the lookahead
+ * on '{'.  Each call that returns 1 leaves the key in js->str and the
+ * lookahead on its value; 0 means the object is closed, -1 an error. */
+static int next_member(json_stream *js, int *n_members)
+{
+	skip_whitespace(js);
+	if (*n_members == 0) {
+		if (js->c != '{') {
+			syntax_error(js, "'{' expected");
+			return -1;
+		}
+		next_char(js);
+		skip_whitespace(js);
+		if (js->c == '}') {
+			next_char(js);
+			return 0;
+		}
+	} else {
+		if (js->c == '}') {
+			next_char(js);
+			return 0;
+		}
+		if (js->c != ',') {
+			syntax_error(js, "'}' expected");
+			return -1;
+		}
+		next_char(js);
+		skip_whitespace(js);
+	}
+
+	if (js->c != '"') {
+		syntax_error(js, "string or '}' expected");
+		return -1;
+	}
+	if (!read_string(js) || !expect_char(js, ':'))
+		return -1;
+	skip_whitespace(js);
+
+	(*n_members)++;
+	return 1;
+}
+
+static int skip_value(json_stream *js)
+{
+	long long value;
+	int is_integer, n_members = 0, result;
+
+	skip_whitespace(js);
+	switch (js->c) {
+		case '{':
+			while ((result = next_member(js, &n_members)) > 0) {
+				if (!skip_value(js))
+					return 0;
+			}
+			return result == 0;
+		case '[':
+			next_char(js);
+			skip_whitespace(js);
+			if (js->c == ']') {
+				next_char(js);
+				return 1;
+			}
+			for (;;) {
+				if (!skip_value(js))
+					return 0;
+				skip_whitespace(js);
+				if (js->c == ']') {
+					next_char(js);
+					return 1;
+				}
+				if (js->c != ',')
+					return syntax_error(js, "']' expected");
+				next_char(js);
+			}
+		case '"':
+			return read_string(js);
+		case 't':
+			return read_literal(js, "true");
+		case 'f':
+			return read_literal(js, "false");
+		case 'n':
+			return read_literal(js, "null");
+		default:
+			if (js->c == '-' || (js->c >= '0' && js->c <= '9'))
+				return read_number(js, &value, &is_integer);
+			return syntax_error(js, "invalid token");
+	}
+}
+
+static int read_integer(json_stream *js, uint32_t *nid)
+{
+	long long value;
+	int is_integer;
+
+	if (js->c != '-' && (js->c < '0' || js->c > '9'))
+		return skip_value(js) ? VALUE_WRONG_TYPE : VALUE_FAILED;
+
+	if (!read_number(js, &value, &is_integer))
+		return VALUE_FAILED;
+	if (!is_integer)
+		return VALUE_WRONG_TYPE;
+
+	*nid = value;
+	return VALUE_OK;
+}
+
+static int read_boolean(json_stream *js, bool *value)
+{
+	if (js->c == 't') {
+		*value = true;
+		return read_literal(js, "true") ? VALUE_OK : VALUE_FAILED;
+	}
+	if (js->c == 'f') {
+		*value = false;
+		return read_literal(js, "false") ? VALUE_OK : VALUE_FAILED;
+	}
+	return skip_value(js) ? VALUE_WRONG_TYPE : VALUE_FAILED;
+}
+
+/* Moves the pointers collected in va into an exact-size table in the arena */
+static void **take_table(json_stream *js, varray *va, int *count)
+{
+	void **table;
+
+	*count = va->count;
+	table = arena_calloc(&js->imp->arena, va->count, sizeof(void *));
+	if (table == NULL) {
+		fprintf(stderr, "error: out of memory\n");
 		return NULL;
 	}
+	memcpy(table, va->data, va->count * sizeof(void *));
+	va->count = 0;
+	return table;
+}
 
-	vita_imports_t *imports = vita_imports_new(json_object_size(libs));
-	int i, j, k;
+typedef struct {
+	const char *name;
+	int position;
+} key_slot;
 
-	i = -1;
-	json_object_foreach(libs, lib_name, lib_data) {
-		json_t *nid, *modules, *mod_data;
+static int key_slot_sort(const void *el1, const void *el2)
+{
+	const key_slot *slot1 = el1, *slot2 = el2;
+	int cmp = strcmp(slot1->name, slot2->name);
 
-		i++;
+	if (cmp != 0)
+		return cmp;
+	return slot1->position - slot2->position;
+}
 
-		if (!json_is_object(lib_data)) {
-			fprintf(stderr, "error: library %s is not an object\n", lib_name);
-			json_decref(libs);
-			return NULL;
+/* A key given twice in one object replaces the earlier entry in its place,
+ * as json_object_set did; va holds libraries, modules or stubs */
+static int merge_duplicate_keys(varray *va)
+{
+	vita_imports_common_fields **entries = va->data;
+	vita_imports_common_fields *last;
+	key_slot *slots;
+	int i, j, k, count = 0;
+
+	if (va->count < 2)
+		return 1;
+
+	slots = malloc(va->count * sizeof(*slots));
+	if (slots == NULL) {
+		fprintf(stderr, "error: out of memory\n");
+		return 0;
+	}
+	for (i = 0; i < va->count; i++) {
+		slots[i].name = entries[i]->name;
+		slots[i].position = i;
+	}
+	qsort(slots, va->count, sizeof(*slots), key_slot_sort);
+
+	for (i = 0; i < va->count; i = j) {
+		for (j = i + 1; j < va->count && strcmp(slots[j].name, slots[i].name) == 0; j++)
+			;
+		if (j - i > 1) {
+			last = entries[slots[j - 1].position];
+			for (k = i + 1; k < j; k++)
+				entries[slots[k].position] = NULL;
+			entries[slots[i].position] = last;
 		}
+	}
+	free(slots);
 
-		nid = json_object_get(lib_data, "nid");
-		if (!json_is_integer(nid)) {
-			fprintf(stderr, "error: library %s: nid is not an integer\n", lib_name);
-			json_decref(libs);
-			return NULL;
+	for (i = 0; i < va->count; i++) {
+		if (entries[i] != NULL)
+			entries[count++] = entries[i];
+	}
+	va->count = count;
+	return 1;
+}
+
+/* Reads a functions or variables object into stubs; given twice, the later
+ * object replaces the earlier one */
+static int read_stubs(json_stream *js, varray *stubs, const char *type_name, const char *label)
+{
+	vita_imports_stub_t *stub;
+	uint32_t nid;
+	int n_members = 0, result;
+
+	stubs->count = 0;
+
+	while ((result = next_member(js, &n_members)) > 0) {
+		switch (read_integer(js, &nid)) {
+			case VALUE_OK:
+				break;
+			case VALUE_WRONG_TYPE:
+				fprintf(stderr, "error: %s %s: nid is not an integer\n", type_name, js->str);
+				return 0;
+			default:
+				return 0;
 		}
 
-		modules = json_object_get(lib_data, "modules");
-		if (!json_is_object(modules)) {
-			fprintf(stderr, "error: library %s: module is not an object\n", lib_name);
-			json_decref(libs);
-			return NULL;
+		if (js->verbose)
+			printf("\t\t%s: %s\n", label, js->str);
+
+		if ((stub = vita_imports_stub_new(js->imp, js->str, nid)) == NULL
+				|| varray_push(stubs, &stub) == NULL) {
+			fprintf(stderr, "error: out of memory\n");
+			return 0;
 		}
+	}
 
-		imports->libs[i] = vita_imports_lib_new(
-				lib_name,
-				json_integer_value(nid),
-				json_object_size(modules));
+	return result == 0 && merge_duplicate_keys(stubs);
+}
 
-		if (verbose)
-			printf("Lib: %s\n", lib_name);
+/* Reads the module whose name is the key in js->str */
+static int read_module(json_stream *js)
+{
+	vita_imports_module_t *mod;
+	int has_nid = 0, has_kernel = 0, has_functions = 0;
+	int n_members = 0, result;
 
-		j = -1;
-		json_object_foreach(modules, mod_name, mod_data) {
-			json_t *nid, *kernel, *functions, *variables, *target_nid;
-			int has_variables = 1;
+	if (js->c != '{') {
+		fprintf(stderr, "error: module %s is not an object\n", js->str);
+		return 0;
+	}
 
-			j++;
+	if ((mod = vita_imports_module_new(js->imp, js->str, false, 0, 0, 0)) == NULL) {
+		fprintf(stderr, "error: out of memory\n");
+		return 0;
+	}
 
-			if (!json_is_object(mod_data)) {
-				fprintf(stderr, "error: module %s is not an object\n", mod_name);
-				json_decref(libs);
-				return NULL;
+	if (js->verbose)
+		printf("\tModule: %s\n", mod->name);
+
+	js->functions.count = 0;
+	js->variables.count = 0;
+
+	while ((result = next_member(js, &n_members)) > 0) {
+		if (strcmp(js->str, "nid") == 0) {
+			if ((result = read_integer(js, &mod->NID)) == VALUE_WRONG_TYPE)
+				fprintf(stderr, "error: module %s: nid is not an integer\n", mod->name);
+			if (result != VALUE_OK)
+				return 0;
+			has_nid = 1;
+		} else if (strcmp(js->str, "kernel") == 0) {
+			if ((result = read_boolean(js, &mod->is_kernel)) == VALUE_WRONG_TYPE)
+				fprintf(stderr, "error: module %s: kernel is not a boolean\n", mod->name);
+			if (result != VALUE_OK)
+				return 0;
+			has_kernel = 1;
+		} else if (strcmp(js->str, "functions") == 0) {
+			if (js->c != '{') {
+				fprintf(stderr, "error: module %s: functions is not an array\n", mod->name);
+				return 0;
 			}
-
-			nid = json_object_get(mod_data, "nid");
-			if (!json_is_integer(nid)) {
-				fprintf(stderr, "error: module %s: nid is not an integer\n", mod_name);
-				json_decref(libs);
-				return NULL;
+			if (!read_stubs(js, &js->functions, "function", "Function"))
+				return 0;
+			has_functions = 1;
+		} else if (strcmp(js->str, "variables") == 0) {
+			if (js->c != '{') {
+				fprintf(stderr, "error: module %s: variables is not an array\n", mod->name);
+				return 0;
 			}
+			if (!read_stubs(js, &js->variables, "variable", "Variable"))
+				return 0;
+		} else if (!skip_value(js)) {
+			return 0;
+		}
+	}
+	if (result < 0)
+		return 0;
 
-			kernel = json_object_get(mod_data, "kernel");
-			if (!json_is_boolean(kernel)) {
-				fprintf(stderr, "error: module %s: kernel is not a boolean\n", mod_name);
-				json_decref(libs);
-				return NULL;
-			}
+	if (!has_nid) {
+		fprintf(stderr, "error: module %s: nid is not an integer\n", mod->name);
+		return 0;
+	}
+	if (!has_kernel) {
+		fprintf(stderr, "error: module %s: kernel is not a boolean\n", mod->name);
+		return 0;
+	}
+	if (!has_functions) {
+		fprintf(stderr, "error: module %s: functions is not an array\n", mod->name);
+		return 0;
+	}
 
-			functions = json_object_get(mod_data, "functions");
-			if (!json_is_object(functions)) {
-				fprintf(stderr, "error: module %s: functions is not an array\n", mod_name);
-				json_decref(libs);
-				return NULL;
-			}
+	if ((mod->functions = (vita_imports_stub_t **)take_table(js, &js->functions, &mod->n_functions)) == NULL
+			|| (mod->variables = (vita_imports_stub_t **)take_table(js, &js->variables, &mod->n_variables)) == NULL)
+		return 0;
 
-			variables = json_object_get(mod_data, "variables");
-			if (variables == NULL) {
-				has_variables = 0;
-			}
+	if (varray_push(&js->modules, &mod) == NULL) {
+		fprintf(stderr, "error: out of memory\n");
+		return 0;
+	}
 
-			if (has_variables && !json_is_object(variables)) {
-				fprintf(stderr, "error: module %s: variables is not an array\n", mod_name);
-				json_decref(libs);
-				return NULL;
+	return 1;
+}
+
+/* Reads the library whose name is the key in js->str */
+static int read_lib(json_stream *js)
+{
+	vita_imports_lib_t *lib;
+	int has_nid = 0, has_modules = 0;
+	int n_members = 0, n_modules, result;
+
+	if (js->c != '{') {
+		fprintf(stderr, "error: library %s is not an object\n", js->str);
+		return 0;
+	}
+
+	if ((lib = vita_imports_lib_new(js->imp, js->str, 0, 0)) == NULL) {
+		fprintf(stderr, "error: out of memory\n");
+		return 0;
+	}
+
+	if (js->verbose)
+		printf("Lib: %s\n", lib->name);
+
+	js->modules.count = 0;
+
+	while ((result = next_member(js, &n_members)) > 0) {
+		if (strcmp(js->str, "nid") == 0) {
+			if ((result = read_integer(js, &lib->NID)) == VALUE_WRONG_TYPE)
+				fprintf(stderr, "error: library %s: nid is not an integer\n", lib->name);
+			if (result != VALUE_OK)
+				return 0;
+			has_nid = 1;
+		} else if (strcmp(js->str, "modules") == 0) {
+			if (js->c != '{') {
+				fprintf(stderr, "error: library %s: module is not an object\n", lib->name);
+				return 0;
 			}
+			/* Given twice, the later object replaces the earlier one */
+			js->modules.count = 0;
+			n_modules = 0;
+			while ((result = next_member(js, &n_modules)) > 0) {
+				if (!read_module(js))
+					return 0;
+			}
+			if (result < 0 || !merge_duplicate_keys(&js->modules))
+				return 0;
+			has_modules = 1;
+		} else if (!skip_value(js)) {
+			return 0;
+		}
+	}
+	if (result < 0)
+		return 0;
 
-			if (verbose)
-				printf("\tModule: %s\n", mod_name);
+	if (!has_nid) {
+		fprintf(stderr, "error: library %s: nid is not an integer\n", lib->name);
+		return 0;
+	}
+	if (!has_modules) {
+		fprintf(stderr, "error: library %s: module is not an object\n", lib->name);
+		return 0;
+	}
 
-			imports->libs[i]->modules[j] = vita_imports_module_new(
-					mod_name,
-					json_boolean_value(kernel),
-					json_integer_value(nid),
-					json_object_size(functions),
-					json_object_size(variables));
+	if ((lib->modules = (vita_imports_module_t **)take_table(js, &js->modules, &lib->n_modules)) == NULL)
+		return 0;
 
-			k = -1;
-			json_object_foreach(functions, target_name, target_nid) {
-				k++;
+	if (varray_push(&js->libs, &lib) == NULL) {
+		fprintf(stderr, "error: out of memory\n");
+		return 0;
+	}
 
-				if (!json_is_integer(target_nid)) {
-					fprintf(stderr, "error: function %s: nid is not an integer\n", target_name);
-					json_decref(libs);
-					return NULL;
-				}
+	return 1;
+}
+vita_imports_t *vita_imports_load(const char *filename, int verbose)
+{
+	char magic[4];
+	FILE *fp = fopen(filename, "rb");
+	if (fp == NULL) {
+		fprintf(stderr, "Error: could not open %s\n", filename);
+		return NULL;
+	}
 
-				if (verbose)
-					printf("\t\tFunction: %s\n", target_name);
+	if (fread(magic, sizeof(magic), 1, fp) == 1 && memcmp(magic, VITA_IMPORTS_BIN_MAGIC, sizeof(magic)) == 0) {
+		fclose(fp);
+		return vita_imports_load_binary(filename, verbose);
+	}
+	rewind(fp);
 
-				imports->libs[i]->modules[j]->functions[k] = vita_imports_stub_new(
-						target_name,
-						json_integer_value(target_nid));
+	vita_imports_t *imports = vita_imports_loads(fp, verbose);
 
-			}
+	fclose(fp);
 
-			if (!has_variables) {
-				continue;
-			}
+	return imports;
+}
+
+vita_imports_t *vita_imports_loads(FILE *text, int verbose)
+{
+	json_stream js;
+	vita_imports_t *imports = NULL;
+	int n_members = 0, result;
+
+	memset(&js, 0, sizeof(js));
+	js.fp = text;
+	js.line = 1;
+	js.verbose = verbose;
+
+	if (!varray_init(&js.libs, sizeof(void *), 64)
+			|| !varray_init(&js.modules, sizeof(void *), 16)
+			|| !varray_init(&js.functions, sizeof(void *), 256)
+			|| !varray_init(&js.variables, sizeof(void *), 16)
+			|| (js.imp = vita_imports_new(0)) == NULL) {
+		fprintf(stderr, "error: out of memory\n");
+		goto done;
+	}
 
-			k = -1;
-			json_object_foreach(variables, target_name, target_nid) {
-				k++;
+	js.c = getc(text);
+	skip_whitespace(&js);
 
-				if (!json_is_integer(target_nid)) {
-					fprintf(stderr, "error: variable %s: nid is not an integer\n", target_name);
-					json_decref(libs);
-					return NULL;
-				}
+	if (js.c == '[') {
+		fprintf(stderr, "error: modules is not an object\n");
+		goto done;
+	} else if (js.c != '{') {
+		syntax_error(&js, "'[' or '{' expected");
+		goto done;
+	}
 
-				if (verbose)
-					printf("\t\tVariable: %s\n", target_name);
+	while ((result = next_member(&js, &n_members)) > 0) {
+		if (!read_lib(&js))
+			goto done;
+	}
+	if (result < 0 || !merge_duplicate_keys(&js.libs))
+		goto done;
 
-				imports->libs[i]->modules[j]->variables[k] = vita_imports_stub_new(
-						target_name,
-						json_integer_value(target_nid));
+	skip_whitespace(&js);
+	if (js.c != EOF) {
+		syntax_error(&js, "end of file expected");
+		goto done;
+	}
 
-			}
+	if ((js.imp->libs = (vita_imports_lib_t **)take_table(&js, &js.libs, &js.imp->n_libs)) == NULL)
+		goto done;
 
-		}
+	if (!vita_imports_build_lookups(js.imp)) {
+		fprintf(stderr, "error: out of memory\n");
+		goto done;
 	}
 
+	imports = js.imp;
+done:
+	if (imports == NULL && js.imp != NULL)
+		vita_imports_free(js.imp);
+	varray_destroy(&js.libs);
+	varray_destroy(&js.modules);
+	varray_destroy(&js.functions);
+	varray_destroy(&js.variables);
+	free(js.str);
 	return imports;
 }
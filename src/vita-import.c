@@ -2,15 +2,24 @@
 #include <stdlib.h>
 #include <string.h>
 
+/* Every struct, name and table of a database is carved out of its arena */
+#define IMPORTS_ARENA_BLOCK_SIZE (256 * 1024)
+
 vita_imports_t *vita_imports_new(int n_libs)
 {
-	vita_imports_t *imp = malloc(sizeof(*imp));
+	vita_imports_t *imp = calloc(1, sizeof(*imp));
 	if (imp == NULL)
 		return NULL;
 
+	arena_init(&imp->arena, IMPORTS_ARENA_BLOCK_SIZE);
+
 	imp->n_libs = n_libs;
 
-	imp->libs = calloc(n_libs, sizeof(*imp->libs));
+	imp->libs = arena_calloc(&imp->arena, n_libs, sizeof(*imp->libs));
+	if (imp->libs == NULL) {
+		vita_imports_free(imp);
+		return NULL;
+	}
 
 	return imp;
 }
@@ -18,124 +27,179 @@ vita_imports_t *vita_imports_new(int n_libs)
 void vita_imports_free(vita_imports_t *imp)
 {
 	if (imp) {
-		int i;
-		for (i = 0; i < imp->n_libs; i++) {
-			vita_imports_lib_free(imp->libs[i]);
-		}
+		if (imp->mapping != NULL)
+			vita_imports_unmap_binary(imp);
+		arena_destroy(&imp->arena);
 		free(imp);
 	}
 }
 
-vita_imports_lib_t *vita_imports_lib_new(const char *name, uint32_t NID, int n_modules)
+vita_imports_lib_t *vita_imports_lib_new(vita_imports_t *imp, const char *name, uint32_t NID, int n_modules)
 {
-	vita_imports_lib_t *lib = malloc(sizeof(*lib));
+	vita_imports_lib_t *lib = arena_alloc(&imp->arena, sizeof(*lib));
 	if (lib == NULL)
 		return NULL;
 
-	lib->name = strdup(name);
+	lib->name = arena_strdup(&imp->arena, name);
 	lib->NID = NID;
 	lib->n_modules = n_modules;
 
-	lib->modules = calloc(n_modules, sizeof(*lib->modules));
+	lib->modules = arena_calloc(&imp->arena, n_modules, sizeof(*lib->modules));
+
+	if (lib->name == NULL || lib->modules == NULL)
+		return NULL;
 
 	return lib;
 }
 
 
-vita_imports_module_t *vita_imports_module_new(const char *name, bool kernel, uint32_t NID, int n_functions, int n_variables)
+vita_imports_module_t *vita_imports_module_new(vita_imports_t *imp, const char *name, bool kernel, uint32_t NID, int n_functions, int n_variables)
 {
-	vita_imports_module_t *mod = malloc(sizeof(*mod));
+	vita_imports_module_t *mod = arena_alloc(&imp->arena, sizeof(*mod));
 	if (mod == NULL)
 		return NULL;
 
-	mod->name = strdup(name);
+	mod->name = arena_strdup(&imp->arena, name);
 	mod->NID = NID;
 	mod->is_kernel = kernel;
 	mod->n_functions = n_functions;
 	mod->n_variables = n_variables;
 
-	mod->functions = calloc(n_functions, sizeof(*mod->functions));
+	mod->functions = arena_calloc(&imp->arena, n_functions, sizeof(*mod->functions));
 
-	mod->variables = calloc(n_variables, sizeof(*mod->variables));
-
-	return mod;
-}
-
-void vita_imports_module_free(vita_imports_module_t *mod)
-{
-	if (mod) {
-		int i;
-		for (i = 0; i < mod->n_variables; i++) {
-			vita_imports_stub_free(mod->variables[i]);
-		}
-		for (i = 0; i < mod->n_functions; i++) {
-			vita_imports_stub_free(mod->functions[i]);
-		}
-		free(mod->name);
-		free(mod);
-	}
-}
+	mod->variables = arena_calloc(&imp->arena, n_variables, sizeof(*mod->variables));
 
+	if (mod->name == NULL || mod->functions == NULL || mod->variables == NULL)
+		return NULL;
 
-void vita_imports_lib_free(vita_imports_lib_t *lib)
-{
-	if (lib) {
-		int i;
-		for (i = 0; i < lib->n_modules; i++) {
-			vita_imports_module_free(lib->modules[i]);
-		}
-		free(lib->name);
-		free(lib);
-	}
+	return mod;
 }
 
-vita_imports_stub_t *vita_imports_stub_new(const char *name, uint32_t NID)
+vita_imports_stub_t *vita_imports_stub_new(vita_imports_t *imp, const char *name, uint32_t NID)
 {
-	vita_imports_stub_t *stub = malloc(sizeof(*stub));
+	vita_imports_stub_t *stub = arena_alloc(&imp->arena, sizeof(*stub));
 	if (stub == NULL)
 		return NULL;
 
-	stub->name = strdup(name);
+	stub->name = arena_strdup(&imp->arena, name);
 	stub->NID = NID;
 
+	if (stub->name == NULL)
+		return NULL;
+
 	return stub;
 }
 
-void vita_imports_stub_free(vita_imports_stub_t *stub)
-{
-	if (stub) {
-		free(stub->name);
-		free(stub);
+/* Each table keeps the order of the database; the lookups are separate arrays
+ * of its non-NULL entries in NID order, so every lookup is a binary search. */
+
+typedef struct {
+	vita_imports_common_fields *entry;
+	int position;
+} lookup_slot;
+
+static int lookup_slot_sort(const void *el1, const void *el2) {
+	const lookup_slot *slot1 = el1, *slot2 = el2;
+
+	if (slot1->entry->NID > slot2->entry->NID)
+		return 1;
+	else if (slot1->entry->NID < slot2->entry->NID)
+		return -1;
+
+	/* Equal NIDs stay in table order, so the first one in the database wins */
+	return slot1->position - slot2->position;
+}
+
+static vita_imports_common_fields *generic_find(const vita_imports_lookup_t *lookup, uint32_t NID) {
+	int low_idx = 0, high_idx = lookup->count;
+
+	/* Find the first entry with a matching NID, in case the table has duplicates */
+	while (low_idx < high_idx) {
+		int test_idx = (low_idx + high_idx) / 2;
+
+		if (lookup->entries[test_idx]->NID < NID)
+			low_idx = test_idx + 1;
+		else
+			high_idx = test_idx;
 	}
+
+	if (low_idx < lookup->count && lookup->entries[low_idx]->NID == NID)
+		return lookup->entries[low_idx];
+
+	return NULL;
 }
 
-/* For now these functions are just dumb full-table searches.  We can implement qsort/bsearch/whatever later if necessary. */
+static int generic_build_lookup(arena *a, vita_imports_lookup_t *lookup, void *table, int n_entries) {
+	vita_imports_common_fields **entries = table;
+	lookup_slot *slots;
+	int i, count = 0;
 
-static vita_imports_common_fields *generic_find(vita_imports_common_fields **entries, int n_entries, uint32_t NID) {
-	int i;
-	vita_imports_common_fields *entry;
+	lookup->count = 0;
+
+	/* Only the lookup itself lives as long as the database */
+	lookup->entries = arena_calloc(a, n_entries, sizeof(*lookup->entries));
+	slots = malloc((n_entries ? n_entries : 1) * sizeof(*slots));
+	if (lookup->entries == NULL || slots == NULL) {
+		free(slots);
+		return 0;
+	}
 
 	for (i = 0; i < n_entries; i++) {
-		entry = entries[i];
-		if (entry == NULL)
+		if (entries[i] == NULL)
+			continue;
+		slots[count].entry = entries[i];
+		slots[count].position = i;
+		count++;
+	}
+
+	qsort(slots, count, sizeof(*slots), lookup_slot_sort);
+
+	for (i = 0; i < count; i++)
+		lookup->entries[i] = slots[i].entry;
+	lookup->count = count;
+
+	free(slots);
+	return 1;
+}
+
+int vita_imports_build_lookups(vita_imports_t *imp)
+{
+	int i, j;
+
+	if (!generic_build_lookup(&imp->arena, &imp->libs_by_nid, imp->libs, imp->n_libs))
+		return 0;
+
+	for (i = 0; i < imp->n_libs; i++) {
+		vita_imports_lib_t *lib = imp->libs[i];
+		if (lib == NULL)
 			continue;
 
-		if (entry->NID == NID)
-			return entry;
+		if (!generic_build_lookup(&imp->arena, &lib->modules_by_nid, lib->modules, lib->n_modules))
+			return 0;
+
+		for (j = 0; j < lib->n_modules; j++) {
+			vita_imports_module_t *mod = lib->modules[j];
+			if (mod == NULL)
+				continue;
+
+			if (!generic_build_lookup(&imp->arena, &mod->functions_by_nid, mod->functions, mod->n_functions)
+					|| !generic_build_lookup(&imp->arena, &mod->variables_by_nid, mod->variables, mod->n_variables))
+				return 0;
+		}
 	}
 
-	return NULL;
+	return 1;
 }
 
 vita_imports_lib_t *vita_imports_find_lib(vita_imports_t *imp, uint32_t NID) {
-	return (vita_imports_lib_t *)generic_find((vita_imports_common_fields **)imp->libs, imp->n_libs, NID);
+	return (vita_imports_lib_t *)generic_find(&imp->libs_by_nid, NID);
 }
 vita_imports_module_t *vita_imports_find_module(vita_imports_lib_t *lib, uint32_t NID) {
-	return (vita_imports_module_t *)generic_find((vita_imports_common_fields **)lib->modules, lib->n_modules, NID);
+	return (vita_imports_module_t *)generic_find(&lib->modules_by_nid, NID);
 }
 vita_imports_stub_t *vita_imports_find_function(vita_imports_module_t *mod, uint32_t NID) {
-	return (vita_imports_stub_t *)generic_find((vita_imports_common_fields **)mod->functions, mod->n_functions, NID);
+	return (vita_imports_stub_t *)generic_find(&mod->functions_by_nid, NID);
 }
 vita_imports_stub_t *vita_imports_find_variable(vita_imports_module_t *mod, uint32_t NID) {
-	return (vita_imports_stub_t *)generic_find((vita_imports_common_fields **)mod->variables, mod->n_variables, NID);
+	return (vita_imports_stub_t *)generic_find(&mod->variables_by_nid, NID);
 }
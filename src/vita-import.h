@@ -5,12 +5,20 @@
 #include <stdint.h>
 #include <stdio.h>
 
+#include "arena.h"
+
 /* These fields must always come at the beginning of the NID-bearing structs */
 typedef struct {
 	char *name;
 	uint32_t NID;
 } vita_imports_common_fields;
 
+/* The non-NULL entries of one table in NID order, those with equal NIDs in table order */
+typedef struct {
+	vita_imports_common_fields **entries;
+	int count;
+} vita_imports_lookup_t;
+
 typedef struct {
 	char *name;
 	uint32_t NID;
@@ -24,6 +32,8 @@ typedef struct {
 	vita_imports_stub_t **variables;
 	int n_functions;
 	int n_variables;
+	vita_imports_lookup_t functions_by_nid;
+	vita_imports_lookup_t variables_by_nid;
 } vita_imports_module_t;
 
 typedef struct {
@@ -31,37 +41,89 @@ typedef struct {
 	uint32_t NID;
 	vita_imports_module_t **modules;
 	int n_modules;
+	vita_imports_lookup_t modules_by_nid;
 } vita_imports_lib_t;
 
 typedef struct {
 	vita_imports_lib_t **libs;
 	int n_libs;
+	vita_imports_lookup_t libs_by_nid;
+
+	/* Backs the whole object graph; vita_imports_free releases it in one go */
+	arena arena;
+
+	/* Set when loaded from a compiled database: the names point into the mapped file */
+	void *mapping;
+	size_t mapping_size;
 } vita_imports_t;
 
+/* First bytes of a database written by vita_imports_save_binary */
+#define VITA_IMPORTS_BIN_MAGIC "VNDB"
 
+/* Loads either a JSON or a compiled database */
 vita_imports_t *vita_imports_load(const char *filename, int verbose);
 vita_imports_t *vita_imports_loads(FILE *text, int verbose);
 
+vita_imports_t *vita_imports_load_binary(const char *filename, int verbose);
+void vita_imports_unmap_binary(vita_imports_t *imp);
+int vita_imports_save_binary(vita_imports_t *imp, FILE *fp);
+
 vita_imports_t *vita_imports_new(int n_libs);
 void vita_imports_free(vita_imports_t *imp);
 
+/* Builds the NID-ordered lookups the vita_imports_find_* functions search, leaving
+ * the tables in database order; returns 0 if out of memory.  vita_imports_load
+ * does it for you once the database has been read; redo it after changing a table. */
+int vita_imports_build_lookups(vita_imports_t *imp);
+
 vita_imports_lib_t *vita_imports_find_lib(vita_imports_t *imp, uint32_t NID);
 
 
-vita_imports_lib_t *vita_imports_lib_new(const char *name, uint32_t NID, int n_modules);
-void vita_imports_lib_free(vita_imports_lib_t *lib);
+/* Libraries, modules and stubs are allocated from imp, and freed along with it */
+vita_imports_lib_t *vita_imports_lib_new(vita_imports_t *imp, const char *name, uint32_t NID, int n_modules);
 
 vita_imports_module_t *vita_imports_find_module(vita_imports_lib_t *lib, uint32_t NID);
 
 
-vita_imports_module_t *vita_imports_module_new(const char *name, bool kernel, uint32_t NID, int n_functions, int n_variables);
-void vita_imports_module_free(vita_imports_module_t *mod);
+vita_imports_module_t *vita_imports_module_new(vita_imports_t *imp, const char *name, bool kernel, uint32_t NID, int n_functions, int n_variables);
 
 vita_imports_stub_t *vita_imports_find_function(vita_imports_module_t *mod, uint32_t NID);
 vita_imports_stub_t *vita_imports_find_variable(vita_imports_module_t *mod, uint32_t NID);
 
 
-vita_imports_stub_t *vita_imports_stub_new(const char *name, uint32_t NID);
-void vita_imports_stub_free(vita_imports_stub_t *stub);
+vita_imports_stub_t *vita_imports_stub_new(vita_imports_t *imp, const char *name, uint32_t NID);
+
+/* Merged lookup index over several databases, keyed by (library NID, module NID, NID).
+ * When more than one database defines the same key, the one given first wins. */
+#define VITA_IMPORTS_INDEX_MODULE	0
+#define VITA_IMPORTS_INDEX_FUNCTION	1
+#define VITA_IMPORTS_INDEX_VARIABLE	2
+
+typedef struct {
+	uint32_t library_nid;
+	uint32_t module_nid;
+	uint32_t kind;
+	uint32_t target_nid;
+	int priority;
+
+	vita_imports_lib_t *library;
+	vita_imports_module_t *module;
+	vita_imports_stub_t *target;
+} vita_imports_index_entry_t;
+
+typedef struct {
+	vita_imports_index_entry_t *entries;
+	int n_entries;
+} vita_imports_index_t;
+
+/* The index points into the given databases; they must outlive it. */
+vita_imports_index_t *vita_imports_index_new(vita_imports_t **imports, int imports_count);
+void vita_imports_index_free(vita_imports_index_t *index);
+
+/* Returns 1 if the function or variable was found.  Otherwise returns 0,
+ * with library and module still set if those could be found. */
+int vita_imports_index_find(const vita_imports_index_t *index, int kind,
+		uint32_t library_nid, uint32_t module_nid, uint32_t target_nid,
+		vita_imports_lib_t **library, vita_imports_module_t **module, vita_imports_stub_t **target);
 
 #endif
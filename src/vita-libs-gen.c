@@ -1,17 +1,63 @@
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
 #include "vita-import.h"
+#include "stub-archive.h"
+#include "fail-utils.h"
 
 #define KERNEL_LIBS_STUB "SceKernel"
 
+/* Digest and name of each archive the last --incremental run wrote, one per line */
+#define STATE_FILE ".vita-libs-gen.state"
+
 void usage();
+int generate_archives(vita_imports_t **imports, int imports_count, int num_threads, int incremental);
 int generate_assembly(vita_imports_t **imports, int imports_count);
 int generate_makefile(vita_imports_t **imports, int imports_count);
 
+static const struct option long_options[] = {
+	{"assembly", no_argument, NULL, 'a'},
+	{"jobs", required_argument, NULL, 'j'},
+	{"incremental", no_argument, NULL, 'i'},
+	{NULL, 0, NULL, 0}
+};
+
 int main(int argc, char *argv[])
 {
+	int assembly = 0;
+	int incremental = 0;
+	int num_threads = 1;
+	char *end;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "+aij:", long_options, NULL)) != -1) {
+		switch (opt) {
+			case 'a':
+				assembly = 1;
+				break;
+			case 'i':
+				incremental = 1;
+				break;
+			case 'j':
+				num_threads = strtol(optarg, &end, 10);
+				if (*end != '\0' || num_threads < 1) {
+					fprintf(stderr, "Invalid job count: %s\n", optarg);
+					goto exit_failure;
+				}
+				break;
+			default:
+				usage();
+				goto exit_failure;
+		}
+	}
+	/* Keep the positional arguments at argv[1] onwards */
+	argc -= optind - 1;
+	argv += optind - 1;
+
 	if (argc < 3) {
 		usage();
 		goto exit_failure;
@@ -38,14 +84,21 @@ int main(int argc, char *argv[])
 		goto exit_failure;
 	}
 
-	if (!generate_assembly(imports, imports_count)) {
-		fprintf(stderr, "Error generating the assembly file\n");
-		goto exit_failure;
-	}
+	if (!assembly) {
+		if (!generate_archives(imports, imports_count, num_threads, incremental)) {
+			fprintf(stderr, "Error generating the stub libraries\n");
+			goto exit_failure;
+		}
+	} else {
+		if (!generate_assembly(imports, imports_count)) {
+			fprintf(stderr, "Error generating the assembly file\n");
+			goto exit_failure;
+		}
 
-	if (!generate_makefile(imports, imports_count)) {
-		fprintf(stderr, "Error generating the assembly makefile\n");
-		goto exit_failure;
+		if (!generate_makefile(imports, imports_count)) {
+			fprintf(stderr, "Error generating the assembly makefile\n");
+			goto exit_failure;
+		}
 	}
 
 	for (i = 0; i < imports_count; i++)
@@ -61,6 +114,280 @@ exit_failure:
 }
 
 
+/* Returns the index of the archive for library in archives, adding it if needed, or -1 */
+static int find_archive(varray *archives, const char *library)
+{
+	char filename[4096];
+	stub_archive_t *ar;
+	int i;
+
+	snprintf(filename, sizeof(filename), "lib%s_stub.a", library);
+	for (i = 0; i < archives->count; i++) {
+		ar = VARRAY_ELEMENT(archives, i);
+		if (strcmp(ar->filename, filename) == 0)
+			return i;
+	}
+
+	if ((ar = varray_push(archives, NULL)) == NULL)
+		return -1;
+	if (stub_archive_init(ar, filename) == NULL) {
+		varray_pop(archives);
+		return -1;
+	}
+	return archives->count - 1;
+}
+
+static void archive_destroy(void *element)
+{
+	stub_archive_destroy(element);
+}
+
+typedef struct {
+	char *name;
+	uint8_t digest[SHA256_DIGEST_SIZE];
+} state_entry_t;
+
+static int state_entry_compar(const void *el1, const void *el2)
+{
+	return strcmp(((const state_entry_t *)el1)->name, ((const state_entry_t *)el2)->name);
+}
+
+static void state_entry_destroy(void *element)
+{
+	free(((state_entry_t *)element)->name);
+}
+
+static int parse_digest(const char *hex, uint8_t digest[SHA256_DIGEST_SIZE])
+{
+	unsigned byte;
+	int i;
+
+	for (i = 0; i < SHA256_DIGEST_SIZE; i++) {
+		if (sscanf(hex + i * 2, "%2x", &byte) != 1)
+			return 0;
+		digest[i] = byte;
+	}
+	return hex[SHA256_DIGEST_SIZE * 2] == ' ';
+}
+
+/* A missing or unreadable state just means everything gets written */
+static void read_state(varray *state)
+{
+	char line[4096];
+	state_entry_t entry;
+	FILE *fp;
+	size_t len;
+
+	if ((fp = fopen(STATE_FILE, "r")) == NULL)
+		return;
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		len = strlen(line);
+		if (len > 0 && line[len - 1] == '\n')
+			line[--len] = '\0';
+		if (len <= SHA256_DIGEST_SIZE * 2 + 1 || !parse_digest(line, entry.digest))
+			continue;
+		if ((entry.name = strdup(line + SHA256_DIGEST_SIZE * 2 + 1)) == NULL)
+			break;
+		if (varray_push(state, &entry) == NULL) {
+			free(entry.name);
+			break;
+		}
+	}
+	fclose(fp);
+
+	varray_sort(state);
+}
+
+typedef struct {
+	uint8_t digest[SHA256_DIGEST_SIZE];
+	int unchanged;		/* Same digest as last time, and still there */
+	int ok;
+} archive_job_t;
+
+static int write_state(const varray *archives, const archive_job_t *jobs)
+{
+	const stub_archive_t *ar;
+	FILE *fp;
+	int i, j;
+
+	/* Replaced in one go, so an interrupted run never leaves a digest for a half-written archive */
+	if ((fp = fopen(STATE_FILE ".tmp", "w")) == NULL)
+		FAIL("Could not open %s for writing", STATE_FILE ".tmp");
+	for (i = 0; i < archives->count; i++) {
+		if (!jobs[i].ok)
+			continue;
+		ar = VARRAY_ELEMENT(archives, i);
+		for (j = 0; j < SHA256_DIGEST_SIZE; j++)
+			fprintf(fp, "%02x", jobs[i].digest[j]);
+		fprintf(fp, " %s\n", ar->filename);
+	}
+	if (fclose(fp) != 0)
+		FAIL("Could not write %s", STATE_FILE ".tmp");
+	if (rename(STATE_FILE ".tmp", STATE_FILE) < 0)
+		FAIL("Could not rename %s to %s", STATE_FILE ".tmp", STATE_FILE);
+	return 1;
+failure:
+	remove(STATE_FILE ".tmp");
+	return 0;
+}
+
+typedef struct {
+	const varray *archives;
+	archive_job_t *jobs;
+	pthread_mutex_t lock;
+	int next_job;
+} write_queue_t;
+
+static void *write_worker(void *arg)
+{
+	write_queue_t *queue = arg;
+	int i;
+
+	for (;;) {
+		pthread_mutex_lock(&queue->lock);
+		while (queue->next_job < queue->archives->count && queue->jobs[queue->next_job].unchanged)
+			queue->next_job++;
+		i = queue->next_job < queue->archives->count ? queue->next_job++ : -1;
+		pthread_mutex_unlock(&queue->lock);
+		if (i < 0)
+			break;
+
+		queue->jobs[i].ok = stub_archive_write(VARRAY_ELEMENT(queue->archives, i));
+	}
+
+	return NULL;
+}
+
+/* Writes the lib*_stub.a files the generated Makefile would build, without
+ * going through the assembler: kernel stubs all go to the SceKernel one.
+ * When incremental, archives whose digest matches the state file are left alone. */
+int generate_archives(vita_imports_t **imports, int imports_count, int num_threads, int incremental)
+{
+	varray archives;
+	varray state;
+	stub_archive_t *ar;
+	archive_job_t *jobs = NULL;
+	write_queue_t queue;
+	pthread_t *threads = NULL;
+	state_entry_t key, *entry;
+	int lib_index, kernel_index = -1;
+	int started = 0, written = 0;
+	int h, i, j, k;
+	int is_special;
+	int ok = 0;
+
+	if (varray_init(&archives, sizeof(stub_archive_t), 64) == NULL)
+		return 0;
+	archives.destroy_func = archive_destroy;
+	if (varray_init(&state, sizeof(state_entry_t), 64) == NULL) {
+		varray_destroy(&archives);
+		return 0;
+	}
+	state.destroy_func = state_entry_destroy;
+	state.sort_compar = state_entry_compar;
+
+	for (h = 0; h < imports_count; h++) {
+		vita_imports_t *imp = imports[h];
+		for (i = 0; i < imp->n_libs; i++) {
+			vita_imports_lib_t *library = imp->libs[i];
+			is_special = (strcmp(KERNEL_LIBS_STUB, library->name) == 0);
+
+			if ((lib_index = find_archive(&archives, library->name)) < 0)
+				goto exit;
+
+			for (j = 0; j < library->n_modules; j++) {
+				vita_imports_module_t *module = library->modules[j];
+
+				/* Indices rather than pointers, as adding an archive can move the rest */
+				if (is_special || module->is_kernel) {
+					if (kernel_index < 0 && (kernel_index = find_archive(&archives, KERNEL_LIBS_STUB)) < 0)
+						goto exit;
+					ar = VARRAY_ELEMENT(&archives, kernel_index);
+				} else {
+					ar = VARRAY_ELEMENT(&archives, lib_index);
+				}
+
+				for (k = 0; k < module->n_functions; k++) {
+					vita_imports_stub_t *function = module->functions[k];
+					if (!stub_archive_add(ar, library->name, module->name, function->name, 0,
+							library->NID, module->NID, function->NID))
+						goto exit;
+				}
+				for (k = 0; k < module->n_variables; k++) {
+					vita_imports_stub_t *variable = module->variables[k];
+					if (!stub_archive_add(ar, library->name, module->name, variable->name, 1,
+							library->NID, module->NID, variable->NID))
+						goto exit;
+				}
+			}
+		}
+	}
+
+	if (archives.count == 0) {
+		ok = !incremental || write_state(&archives, NULL);
+		goto exit;
+	}
+	if ((jobs = calloc(archives.count, sizeof(archive_job_t))) == NULL)
+		goto exit;
+
+	if (incremental) {
+		read_state(&state);
+		for (i = 0; i < archives.count; i++) {
+			ar = VARRAY_ELEMENT(&archives, i);
+			stub_archive_digest(ar, jobs[i].digest);
+			key.name = ar->filename;
+			entry = varray_sorted_search(&state, &key);
+			if (entry && memcmp(entry->digest, jobs[i].digest, SHA256_DIGEST_SIZE) == 0
+					&& access(ar->filename, F_OK) == 0)
+				jobs[i].unchanged = jobs[i].ok = 1;
+		}
+	}
+
+	queue.archives = &archives;
+	queue.jobs = jobs;
+	queue.next_job = 0;
+	pthread_mutex_init(&queue.lock, NULL);
+
+	/* The calling thread is always one of the workers */
+	if (num_threads > archives.count)
+		num_threads = archives.count;
+	if (num_threads > 1 && (threads = calloc(num_threads - 1, sizeof(pthread_t))) == NULL)
+		num_threads = 1;
+	for (i = 0; i < num_threads - 1; i++) {
+		if (pthread_create(&threads[i], NULL, write_worker, &queue) != 0) {
+			warnx("Could not start worker thread %d", i + 1);
+			break;
+		}
+		started++;
+	}
+	write_worker(&queue);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	pthread_mutex_destroy(&queue.lock);
+
+	ok = 1;
+	for (i = 0; i < archives.count; i++) {
+		if (!jobs[i].ok)
+			ok = 0;
+		else if (!jobs[i].unchanged)
+			written++;
+	}
+
+	if (incremental) {
+		/* Whatever did get written is recorded, so a retry only redoes the failures */
+		if (!write_state(&archives, jobs))
+			ok = 0;
+		printf("%d of %d stub libraries changed\n", written, archives.count);
+	}
+exit:
+	free(jobs);
+	varray_destroy(&state);
+	varray_destroy(&archives);
+	return ok;
+}
+
 int generate_assembly(vita_imports_t **imports, int imports_count)
 {
 	char filename[128];
@@ -130,54 +457,80 @@ int generate_assembly(vita_imports_t **imports, int imports_count)
 	return 1;
 }
 
-char *g_kernel_objs;
-size_t g_special_size, g_special_written;
-FILE *fp;
+/* Output accumulated in memory; appends cost the length of what is added, never of what is there */
+typedef struct {
+	char *data;
+	size_t len;
+	size_t size;
+	int failed;	/* Set once an allocation fails; later appends do nothing */
+} out_buf_t;
 
-void write_symbol(const char *symbol, int is_kernel)
+static void out_buf_printf(out_buf_t *out, const char *fmt, ...)
 {
-	if (is_kernel) {
-		size_t len = strlen(symbol);
-		while (g_special_written + len >= g_special_size) {
-			g_special_size *= 2;
-			g_kernel_objs = realloc(g_kernel_objs, g_special_size);
+	va_list ap;
+	size_t size;
+	char *data;
+	int n;
+
+	if (out->failed)
+		return;
+
+	for (;;) {
+		va_start(ap, fmt);
+		n = vsnprintf(out->data + out->len, out->size - out->len, fmt, ap);
+		va_end(ap);
+		if (n < 0) {
+			out->failed = 1;
+			return;
 		}
-		strcat(g_kernel_objs, symbol);
-		g_special_written += len;
-	} else {
-		fprintf(fp, "%s", symbol);
+		if (out->len + n < out->size)
+			break;
+
+		for (size = out->size ? out->size : 4096; out->len + n >= size; size *= 2)
+			;
+		if ((data = realloc(out->data, size)) == NULL) {
+			out->failed = 1;
+			return;
+		}
+		out->data = data;
+		out->size = size;
 	}
+	out->len += n;
+}
+
+static void out_buf_puts(out_buf_t *out, const char *s)
+{
+	out_buf_printf(out, "%s", s);
 }
 
 int generate_makefile(vita_imports_t **imports, int imports_count)
 {
+	out_buf_t makefile = {};
+	out_buf_t kernel_objs = {};
+	out_buf_t *objs;
+	FILE *fp;
 	int h, i, j, k;
 	int is_special;
+	int ok;
 
-	if ((fp = fopen("Makefile", "w")) == NULL) {
-		return 0;
-	}
-
-	g_special_size = 1024;
-	g_special_written = 0;
-	g_kernel_objs = malloc(g_special_size);
-	g_kernel_objs[0] = '\0';
-
-	fputs(
+	out_buf_puts(&makefile,
 		"ARCH ?= arm-vita-eabi\n"
 		"AS = $(ARCH)-as\n"
 		"AR = $(ARCH)-ar\n"
 		"RANLIB = $(ARCH)-ranlib\n\n"
-		"TARGETS =", fp);
+		"TARGETS =");
 
 	for (h = 0; h < imports_count; h++) {
 		vita_imports_t *imp = imports[h];
 		for (i = 0; i < imp->n_libs; i++) {
-			fprintf(fp, " lib%s_stub.a", imp->libs[i]->name);
+			out_buf_printf(&makefile, " lib%s_stub.a", imp->libs[i]->name);
 		}
 	}
 
-	fprintf(fp, "\n\n");
+	out_buf_puts(&makefile, "\n\n");
+
+	/* Kernel objects are gathered aside and listed last, under SceKernel_OBJS */
+	out_buf_puts(&kernel_objs, "");
 
 	for (h = 0; h < imports_count; h++) {
 		vita_imports_t *imp = imports[h];
@@ -186,34 +539,33 @@ int generate_makefile(vita_imports_t **imports, int imports_count)
 			is_special = (strcmp(KERNEL_LIBS_STUB, library->name) == 0);
 
 			if (!is_special) {
-				fprintf(fp, "%s_OBJS =", library->name);
+				out_buf_printf(&makefile, "%s_OBJS =", library->name);
 			}
 
 			for (j = 0; j < library->n_modules; j++) {
 				vita_imports_module_t *module = library->modules[j];
-				char buf[4096];
+				objs = is_special || module->is_kernel ? &kernel_objs : &makefile;
 				for (k = 0; k < module->n_functions; k++) {
 					vita_imports_stub_t *function = module->functions[k];
-					snprintf(buf, sizeof(buf), " %s_%s_%s.o", library->name, module->name, function->name);
-					write_symbol(buf, is_special || module->is_kernel);
+					out_buf_printf(objs, " %s_%s_%s.o", library->name, module->name, function->name);
 				}
 				for (k = 0; k < module->n_variables; k++) {
 					vita_imports_stub_t *variable = module->variables[k];
-					snprintf(buf, sizeof(buf), " %s_%s_%s.o", library->name, module->name, variable->name);
-					write_symbol(buf, is_special || module->is_kernel);
+					out_buf_printf(objs, " %s_%s_%s.o", library->name, module->name, variable->name);
 				}
 			}
 
 			if (!is_special) {
-				fprintf(fp, "\n");
+				out_buf_puts(&makefile, "\n");
 			}
 		}
 	}
 
 	// write kernel lib stub
-	fprintf(fp, "%s_OBJS =%s\n", KERNEL_LIBS_STUB, g_kernel_objs);
+	if (!kernel_objs.failed)
+		out_buf_printf(&makefile, "%s_OBJS =%s\n", KERNEL_LIBS_STUB, kernel_objs.data);
 
-	fputs(
+	out_buf_puts(&makefile,
 		"ALL_OBJS=\n\n"
 		"all: $(TARGETS)\n\n"
 		"define LIBRARY_template\n"
@@ -228,19 +580,34 @@ int generate_makefile(vita_imports_t **imports, int imports_count)
 		"\t$(AR) cru $@ $?\n"
 		"\t$(RANLIB) $@\n\n"
 		"%.o: %.S\n"
-		"\t$(AS) $< -o $@\n"
-		, fp);
+		"\t$(AS) $< -o $@\n");
+
+	ok = !makefile.failed && !kernel_objs.failed;
+	if (ok) {
+		if ((fp = fopen("Makefile", "w")) == NULL) {
+			ok = 0;
+		} else {
+			if (fwrite(makefile.data, 1, makefile.len, fp) != makefile.len)
+				ok = 0;
+			if (fclose(fp) != 0)
+				ok = 0;
+		}
+	}
 
-	fclose(fp);
-	free(g_kernel_objs);
+	free(makefile.data);
+	free(kernel_objs.data);
 
-	return 1;
+	return ok;
 }
 
 void usage()
 {
 	fprintf(stderr,
 		"vita-libs-gen by xerpi\n"
-		"usage:\n\tvita-libs-gen nids.json [extra.json ...] output-dir\n"
+		"usage:\n\tvita-libs-gen [-a] [-i] [-j jobs] nids.json [extra.json ...] output-dir\n"
+		"\nWrites the lib*_stub.a stub libraries to output-dir, jobs at a time. With -a (--assembly),\n"
+		"writes a .S file per stub and a Makefile that builds them instead.\n"
+		"With -i (--incremental), only the libraries whose stubs changed since the last -i run\n"
+		"are rewritten; the digests are kept in output-dir/" STATE_FILE ".\n"
 	);
 }
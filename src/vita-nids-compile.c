@@ -0,0 +1,47 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "vita-import.h"
+
+void usage();
+
+int main(int argc, char *argv[])
+{
+	vita_imports_t *imp;
+	FILE *fp;
+	int ok;
+
+	if (argc != 3) {
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	if ((imp = vita_imports_load(argv[1], 0)) == NULL)
+		return EXIT_FAILURE;
+
+	if ((fp = fopen(argv[2], "wb")) == NULL) {
+		perror(argv[2]);
+		vita_imports_free(imp);
+		return EXIT_FAILURE;
+	}
+
+	ok = vita_imports_save_binary(imp, fp);
+	if (fclose(fp) != 0)
+		ok = 0;
+	vita_imports_free(imp);
+
+	if (!ok) {
+		fprintf(stderr, "Error writing %s\n", argv[2]);
+		remove(argv[2]);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+void usage()
+{
+	fprintf(stderr,
+		"usage:\n\tvita-nids-compile nids.json output.vndb\n"
+		"\nThe output can be passed anywhere a JSON database is accepted.\n"
+	);
+}